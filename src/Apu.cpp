@@ -2,18 +2,37 @@
 #include "AudioDriver.h"
 #include "Bitfield.h"
 #include "Serializer.h"
+#include "AvOutput.h"
 #include <vector>
 #include <algorithm>
 
-// Temp for debug drawing
-#include "Renderer.h"
-#include <SDL_render.h>
-Apu* g_apu = nullptr; //@HACK: get rid of this
-
 // If set, samples every CPU cycle (~1.79 MHz, more expensive but better quality),
 // otherwise will only sample at output rate (e.g. 44.1 KHz)
 #define SAMPLE_EVERY_CPU_CYCLE 1
 
+namespace
+{
+	// Nonlinear mixer output (http://wiki.nesdev.com/w/index.php/APU_Mixer). Built during static
+	// initialization, so that Apus on different threads share them without synchronization.
+	struct MixTables
+	{
+		float32 pulse[31];
+		float32 tnd[203];
+	};
+
+	MixTables BuildMixTables()
+	{
+		MixTables tables;
+		for (size_t i = 0; i < ARRAYSIZE(tables.pulse); ++i)
+			tables.pulse[i] = 95.52f / (8128.0f / i + 100.0f);
+		for (size_t i = 0; i < ARRAYSIZE(tables.tnd); ++i)
+			tables.tnd[i] = 163.67f / (24329.0f / i + 100.0f);
+		return tables;
+	}
+
+	const MixTables g_mixTables = BuildMixTables();
+}
+
 class LengthCounter;
 
 // Divider outputs a clock periodically.
@@ -24,6 +43,12 @@ class Divider
 public:
 	Divider() : m_period(0), m_counter(0) {}
 
+	void Serialize(class Serializer& serializer)
+	{
+		SERIALIZE(m_period);
+		SERIALIZE(m_counter);
+	}
+
 	size_t GetPeriod() const { return m_period; }
 	size_t GetCounter() const { return m_counter;  }
 
@@ -60,6 +85,13 @@ class LengthCounter
 public:
 	LengthCounter() : m_enabled(false), m_halt(false), m_counter(0) {}
 
+	void Serialize(class Serializer& serializer)
+	{
+		SERIALIZE(m_enabled);
+		SERIALIZE(m_halt);
+		SERIALIZE(m_counter);
+	}
+
 	void SetEnabled(bool enabled)
 	{
 		m_enabled = enabled;
@@ -132,6 +164,16 @@ public:
 	{
 	}
 
+	void Serialize(class Serializer& serializer)
+	{
+		SERIALIZE(m_restart);
+		SERIALIZE(m_loop);
+		serializer.SerializeObject(m_divider);
+		SERIALIZE(m_counter);
+		SERIALIZE(m_constantVolumeMode);
+		SERIALIZE(m_constantVolume);
+	}
+
 	void Restart() { m_restart = true; }
 	void SetLoop(bool loop) { m_loop = loop;  }
 	void SetConstantVolumeMode(bool mode) { m_constantVolumeMode = mode; }
@@ -175,8 +217,6 @@ public:
 		}
 	}
 private:
-	friend void DebugDrawAudio(SDL_Renderer* renderer);
-
 	bool m_restart;
 	bool m_loop;
 	Divider m_divider;
@@ -192,6 +232,12 @@ class PulseWaveGenerator
 public:
 	PulseWaveGenerator() : m_duty(0), m_step(0) {}
 
+	void Serialize(class Serializer& serializer)
+	{
+		SERIALIZE(m_duty);
+		SERIALIZE(m_step);
+	}
+
 	void Restart()
 	{
 		m_step = 0;
@@ -237,6 +283,12 @@ class Timer
 public:
 	Timer() : m_minPeriod(0) {}
 
+	void Serialize(class Serializer& serializer)
+	{
+		serializer.SerializeObject(m_divider);
+		SERIALIZE(m_minPeriod);
+	}
+
 	void Reset()
 	{
 		m_divider.ResetCounter();
@@ -287,8 +339,6 @@ public:
 	}
 
 private:
-	friend void DebugDrawAudio(SDL_Renderer* renderer);
-
 	Divider m_divider;
 	size_t m_minPeriod;
 };
@@ -309,6 +359,18 @@ public:
 	{
 	}
 
+	void Serialize(class Serializer& serializer)
+	{
+		SERIALIZE(m_subtractExtra);
+		SERIALIZE(m_enabled);
+		SERIALIZE(m_negate);
+		SERIALIZE(m_reload);
+		SERIALIZE(m_silenceChannel);
+		SERIALIZE(m_shiftCount);
+		serializer.SerializeObject(m_divider);
+		SERIALIZE(m_targetPeriod);
+	}
+
 	void SetSubtractExtra()
 	{
 		m_subtractExtra = 1;
@@ -415,8 +477,6 @@ private:
 	}
 
 private:
-	friend void DebugDrawAudio(SDL_Renderer* renderer);
-
 	size_t m_subtractExtra;
 	bool m_enabled;
 	bool m_negate;
@@ -431,6 +491,12 @@ private:
 class AudioChannel
 {
 public:
+	void Serialize(class Serializer& serializer)
+	{
+		serializer.SerializeObject(m_timer);
+		serializer.SerializeObject(m_lengthCounter);
+	}
+
 	LengthCounter& GetLengthCounter()
 	{
 		return m_lengthCounter;
@@ -452,6 +518,14 @@ public:
 			m_sweepUnit.SetSubtractExtra();
 	}
 
+	void Serialize(class Serializer& serializer)
+	{
+		AudioChannel::Serialize(serializer);
+		serializer.SerializeObject(m_volumeEnvelope);
+		serializer.SerializeObject(m_sweepUnit);
+		serializer.SerializeObject(m_pulseWaveGenerator);
+	}
+
 	void ClockQuarterFrameChips()
 	{
 		m_volumeEnvelope.Clock();
@@ -525,8 +599,6 @@ public:
 	}
 
 private:
-	friend void DebugDrawAudio(SDL_Renderer* renderer);
-
 	VolumeEnvelope m_volumeEnvelope;
 	SweepUnit m_sweepUnit;
 	PulseWaveGenerator m_pulseWaveGenerator;
@@ -540,6 +612,13 @@ class LinearCounter
 public:
 	LinearCounter() : m_reload(true), m_control(true) {}
 
+	void Serialize(class Serializer& serializer)
+	{
+		SERIALIZE(m_reload);
+		SERIALIZE(m_control);
+		serializer.SerializeObject(m_divider);
+	}
+
 	void Restart() { m_reload = true; }
 
 	// If control is false, counter will keep reloading to input period.
@@ -592,6 +671,11 @@ class TriangleWaveGenerator
 public:
 	TriangleWaveGenerator() : m_step(0) {}
 
+	void Serialize(class Serializer& serializer)
+	{
+		SERIALIZE(m_step);
+	}
+
 	void Clock()
 	{
 		m_step = (m_step + 1) % 32;
@@ -620,6 +704,13 @@ public:
 		m_timer.SetMinPeriod(2); // Avoid popping from ultrasonic frequencies
 	}
 
+	void Serialize(class Serializer& serializer)
+	{
+		AudioChannel::Serialize(serializer);
+		serializer.SerializeObject(m_linearCounter);
+		serializer.SerializeObject(m_triangleWaveGenerator);
+	}
+
 	void ClockQuarterFrameChips()
 	{
 		m_linearCounter.Clock();
@@ -691,6 +782,12 @@ class LinearFeedbackShiftRegister
 public:
 	LinearFeedbackShiftRegister() : m_register(1), m_mode(false){}
 
+	void Serialize(class Serializer& serializer)
+	{
+		SERIALIZE(m_register);
+		SERIALIZE(m_mode);
+	}
+
 	// Clocked by noise channel timer
 	void Clock()
 	{
@@ -724,6 +821,13 @@ public:
 		m_volumeEnvelope.SetLoop(true); // Always looping
 	}
 
+	void Serialize(class Serializer& serializer)
+	{
+		AudioChannel::Serialize(serializer);
+		serializer.SerializeObject(m_volumeEnvelope);
+		serializer.SerializeObject(m_shiftRegister);
+	}
+
 	void ClockQuarterFrameChips()
 	{
 		m_volumeEnvelope.Clock();
@@ -942,10 +1046,8 @@ private:
 	bool m_inhibitInterrupt;
 };
 
-void Apu::Initialize()
+void Apu::Initialize(bool headless)
 {
-	g_apu = this;
-
 	std::fill(std::begin(m_channelVolumes), std::end(m_channelVolumes), 1.0f);
 
 	m_frameCounter.reset(new FrameCounter(*this));
@@ -956,7 +1058,16 @@ void Apu::Initialize()
 	m_noiseChannel = std::make_shared<NoiseChannel>();
 
 	m_audioDriver = std::make_shared<AudioDriver>();
-	m_audioDriver->Initialize();
+	m_audioDriver->Initialize(headless);
+
+	m_sampleCapture = nullptr;
+	m_outputListeners = nullptr;
+	m_outputEnabled = true;
+}
+
+size_t Apu::GetSampleRate() const
+{
+	return m_audioDriver->GetSampleRate();
 }
 
 void Apu::Reset()
@@ -976,10 +1087,10 @@ void Apu::Serialize(class Serializer& serializer)
 	SERIALIZE(m_elapsedCpuCycles);
 	SERIALIZE(m_sampleSum);
 	SERIALIZE(m_numSamples);
-	SERIALIZE(*m_pulseChannel0);
-	SERIALIZE(*m_pulseChannel1);
-	SERIALIZE(*m_triangleChannel);
-	SERIALIZE(*m_noiseChannel);
+	serializer.SerializeObject(*m_pulseChannel0);
+	serializer.SerializeObject(*m_pulseChannel1);
+	serializer.SerializeObject(*m_triangleChannel);
+	serializer.SerializeObject(*m_noiseChannel);
 	serializer.SerializeObject(*m_frameCounter);
 }
 
@@ -1028,7 +1139,19 @@ void Apu::Execute(uint32 cpuCycles)
 			const float32 sample = SampleChannelsAndMix();
 		#endif
 
-			m_audioDriver->AddSampleF32(sample);
+			if (m_outputEnabled)
+			{
+				m_audioDriver->AddSampleF32(sample);
+
+				if (m_sampleCapture)
+					m_sampleCapture->push_back(sample);
+
+				if (m_outputListeners)
+				{
+					for (auto listener : *m_outputListeners)
+						listener->OnAudioSample(sample);
+				}
+			}
 		}
 	}
 }
@@ -1123,24 +1246,9 @@ float32 Apu::SampleChannelsAndMix()
 	const float32 pulseOut = 0.00752f * (pulse1 + pulse2);
 	const float32 tndOut = 0.00851f * triangle + 0.00494f * noise + 0.00335f * dmc;
 #else
-	// Lookup Table (accurate)			
-	static float32 pulseTable[31] = { ~0 };
-	if (pulseTable[0] == ~0)
-	{
-		for (size_t i = 0; i < ARRAYSIZE(pulseTable); ++i)
-		{
-			pulseTable[i] = 95.52f / (8128.0f / i + 100.0f);
-		}
-	}
-	static float32 tndTable[203] = { ~0 };
-	if (tndTable[0] == ~0)
-	{
-		for (size_t i = 0; i < ARRAYSIZE(tndTable); ++i)
-		{
-			tndTable[i] = 163.67f / (24329.0f / i + 100.0f);
-		}
-	}
-
+	// Lookup Table (accurate)
+	const float32* pulseTable = g_mixTables.pulse;
+	const float32* tndTable = g_mixTables.tnd;
 	const float32 pulseOut = pulseTable[pulse1 + pulse2];
 	const float32 tndOut = tndTable[3 * triangle + 2 * noise + dmc];
 #endif
@@ -1148,45 +1256,3 @@ float32 Apu::SampleChannelsAndMix()
 	const float32 sample = kMasterVolume * (pulseOut + tndOut);
 	return sample;
 }
-
-void DebugDrawAudio(SDL_Renderer* renderer)
-{
-	(void)renderer;
-	int x = 0;
-	int y = 0;
-
-	auto DrawBar = [&](float32 ratio, const Color4& color)
-	{
-		const int width = 400;
-		const int height = 20;
-
-		static auto white = Color4::White();
-		SDL_Rect rect = { x, y, width, height };
-		SDL_SetRenderDrawColor(renderer, white.R(), white.G(), white.B(), white.A());
-		SDL_RenderFillRect(renderer, &rect);
-
-		SDL_Rect rect2 = { x, y, (int)(ratio * width), 20 };
-		SDL_SetRenderDrawColor(renderer, color.R(), color.G(), color.B(), color.A());
-		SDL_RenderFillRect(renderer, &rect2);
-
-		y += (height + 1);
-	};
-
-#if 0
-	auto pulse = g_apu->m_pulseChannel1.get();
-
-	DrawBar(pulse->GetValue() / 15.0f, Color4::Yellow());
-	DrawBar(pulse->m_volumeEnvelope.GetVolume() / 15.0f, Color4::Red());
-	DrawBar(pulse->m_volumeEnvelope.m_counter / 15.0f, Color4::Cyan());
-	DrawBar(pulse->m_volumeEnvelope.m_constantVolume / 15.0f, Color4::Magenta());
-	DrawBar(pulse->m_sweepUnit.SilenceChannel() ? 0.0f : 1.0f, Color4::Green());
-	DrawBar(pulse->m_pulseWaveGenerator.GetValue() * 1.0f, Color4::Blue());
-	DrawBar(pulse->m_lengthCounter.GetValue() / 255.0f, Color4::Black());
-
-	DrawBar(pulse->m_sweepUnit.m_divider.GetCounter() / 7.0f, Color4::Red());
-	DrawBar(pulse->m_timer.m_divider.GetPeriod() / 2047.0f, Color4::Blue());
-	DrawBar(pulse->m_timer.m_divider.GetCounter() / 2047.0f, Color4::Green());
-
-	DrawBar(g_apu->m_audioDriver->GetBufferUsageRatio(), Color4::Green());
-#endif
-}
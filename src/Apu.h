@@ -1,12 +1,14 @@
 #pragma once
 #include "Base.h"
 #include <memory>
+#include <vector>
 
 class FrameCounter;
 class PulseChannel;
 class TriangleChannel;
 class NoiseChannel;
 class AudioDriver;
+class AvOutputListener;
 
 namespace ApuChannel
 {
@@ -19,7 +21,7 @@ namespace ApuChannel
 class Apu
 {
 public:
-	void Initialize();
+	void Initialize(bool headless); // If headless, no audio device is opened
 	void Reset();
 	void Serialize(class Serializer& serializer);
 	void Execute(uint32 cpuCycles);
@@ -29,9 +31,19 @@ public:
 	float32 GetChannelVolume(ApuChannel::Type type) const { return m_channelVolumes[type]; }
 	void SetChannelVolume(ApuChannel::Type type, float32 volume);
 
+	// If set, every output sample is also appended to samples
+	void SetSampleCapture(std::vector<float32>* samples) { m_sampleCapture = samples; }
+
+	// Every output sample is also passed to these listeners
+	void SetOutputListeners(const std::vector<AvOutputListener*>* listeners) { m_outputListeners = listeners; }
+
+	size_t GetSampleRate() const;
+
+	// When disabled, samples are generated as usual but neither played nor captured
+	void SetOutputEnabled(bool enabled) { m_outputEnabled = enabled; }
+
 private:
 	float32 SampleChannelsAndMix();
-	friend void DebugDrawAudio(struct SDL_Renderer* renderer);
 	friend class FrameCounter;
 
 	bool m_evenFrame;
@@ -45,4 +57,7 @@ private:
 	std::shared_ptr<TriangleChannel> m_triangleChannel;
 	std::shared_ptr<NoiseChannel> m_noiseChannel;
 	std::shared_ptr<AudioDriver> m_audioDriver;
+	std::vector<float32>* m_sampleCapture;
+	const std::vector<AvOutputListener*>* m_outputListeners;
+	bool m_outputEnabled;
 };
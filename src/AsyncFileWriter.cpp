@@ -0,0 +1,162 @@
+#include "AsyncFileWriter.h"
+#include "Stream.h"
+#include "System.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <set>
+#include <algorithm>
+
+class AsyncFileWriter::AsyncFileWriterImpl
+{
+public:
+	AsyncFileWriterImpl()
+		: m_quit(false)
+		, m_writing(false)
+	{
+	}
+
+	~AsyncFileWriterImpl()
+	{
+		if (m_thread.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_quit = true;
+			}
+			m_wakeCondition.notify_one();
+			m_thread.join();
+		}
+	}
+
+	void WriteFile(const std::string& file, std::vector<uint8> data)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			// Lazily start thread on first write
+			if (!m_thread.joinable())
+				m_thread = std::thread(&AsyncFileWriterImpl::ThreadMain, this);
+
+			auto iter = std::find_if(m_jobs.begin(), m_jobs.end(), [&file] (const Job& job) { return job.file == file; });
+			if (iter != m_jobs.end())
+			{
+				iter->data = std::move(data);
+			}
+			else
+			{
+				m_jobs.push_back(Job());
+				m_jobs.back().file = file;
+				m_jobs.back().data = std::move(data);
+			}
+		}
+		m_wakeCondition.notify_one();
+	}
+
+	void Flush()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_idleCondition.wait(lock, [this] { return m_jobs.empty() && !m_writing; });
+	}
+
+	bool TakeWriteFailure(const std::string& file)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_failedFiles.erase(file) > 0;
+	}
+
+private:
+	struct Job
+	{
+		std::string file;
+		std::vector<uint8> data;
+	};
+
+	void ThreadMain()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		for (;;)
+		{
+			m_wakeCondition.wait(lock, [this] { return m_quit || !m_jobs.empty(); });
+
+			// Always drain pending jobs, even when quitting, so nothing is lost on exit
+			if (m_jobs.empty())
+				break;
+
+			Job job = std::move(m_jobs.front());
+			m_jobs.pop_front();
+			m_writing = true;
+
+			lock.unlock();
+			const bool written = WriteJob(job);
+			lock.lock();
+
+			if (written)
+				m_failedFiles.erase(job.file);
+			else
+				m_failedFiles.insert(job.file);
+			m_writing = false;
+			m_idleCondition.notify_all();
+		}
+	}
+
+	static bool WriteJob(const Job& job)
+	{
+		const std::string tempFile = job.file + ".tmp";
+
+		FileStream fs;
+		if (!fs.Open(tempFile.c_str(), "wb"))
+		{
+			printf("Failed to open file for write: %s\n", tempFile.c_str());
+			return false;
+		}
+
+		const bool written = fs.Write(job.data.data(), job.data.size()) == job.data.size();
+		fs.Close();
+
+		if (!written || !System::RenameFile(tempFile.c_str(), job.file.c_str()))
+		{
+			printf("Failed to write file: %s\n", job.file.c_str());
+			return false;
+		}
+
+		printf("Saved file: %s\n", job.file.c_str());
+		return true;
+	}
+
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_wakeCondition;
+	std::condition_variable m_idleCondition;
+	std::deque<Job> m_jobs;
+	std::set<std::string> m_failedFiles;
+	bool m_quit;
+	bool m_writing;
+};
+
+AsyncFileWriter::AsyncFileWriter()
+	: m_impl(new AsyncFileWriter::AsyncFileWriterImpl)
+{
+}
+
+AsyncFileWriter::~AsyncFileWriter()
+{
+	delete m_impl;
+}
+
+void AsyncFileWriter::WriteFile(const std::string& file, std::vector<uint8> data)
+{
+	m_impl->WriteFile(file, std::move(data));
+}
+
+void AsyncFileWriter::Flush()
+{
+	m_impl->Flush();
+}
+
+bool AsyncFileWriter::TakeWriteFailure(const std::string& file)
+{
+	return m_impl->TakeWriteFailure(file);
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "Base.h"
+#include <string>
+#include <vector>
+
+// Writes files on a background thread so that the caller (emulation thread) never blocks on disk I/O.
+// Files are written to a temporary file first, then renamed over the destination, so a crash or power
+// loss mid-write never leaves a truncated file behind.
+class AsyncFileWriter
+{
+public:
+	AsyncFileWriter();
+	~AsyncFileWriter(); // Waits for pending writes to complete
+
+	// Queues data to be written to file. If a write to the same file is still pending, it is replaced.
+	void WriteFile(const std::string& file, std::vector<uint8> data);
+
+	// Blocks until all queued writes have completed
+	void Flush();
+
+	// Returns true if the last completed write to file failed, so that the caller can write it again,
+	// and forgets the failure
+	bool TakeWriteFailure(const std::string& file);
+
+private:
+	AsyncFileWriter(const AsyncFileWriter&);
+	AsyncFileWriter& operator=(const AsyncFileWriter&);
+
+	class AsyncFileWriterImpl;
+	AsyncFileWriterImpl* m_impl;
+};
@@ -1,12 +1,9 @@
 #include "AudioDriver.h"
 #include "CircularBuffer.h"
-#include "Stream.h"
 #define SDL_MAIN_HANDLED // Don't use SDL's main impl
 #include <SDL.h>
 #include <SDL_audio.h>
 
-#define OUTPUT_RAW_AUDIO_FILE_STREAM 0
-
 namespace
 {
 	template <SDL_AudioFormat Format> struct FormatToType;
@@ -31,6 +28,7 @@ public:
 
 	AudioDriverImpl()
 		: m_audioDeviceID(0)
+		, m_headless(false)
 	{
 	}
 
@@ -39,8 +37,16 @@ public:
 		Shutdown();
 	}
 
-	void Initialize()
+	void Initialize(bool headless)
 	{
+		m_headless = headless;
+		if (m_headless)
+		{
+			SDL_zero(m_audioSpec);
+			m_audioSpec.freq = kSampleRate;
+			return;
+		}
+
 		SDL_InitSubSystem(SDL_INIT_AUDIO);
 			
 		SDL_AudioSpec desired;
@@ -64,16 +70,13 @@ public:
 		const size_t bufferSize = static_cast<size_t>(desiredLatencySamples * 2); // We wait until buffer is 50% full to start playing
 		m_samples.Init(bufferSize);
 
-	#if OUTPUT_RAW_AUDIO_FILE_STREAM
-		m_rawAudioOutputFS.Open("RawAudio.raw", "wb");
-	#endif
-
 		SetPaused(true);
 	}
 
 	void Shutdown()
 	{
-		m_rawAudioOutputFS.Close();
+		if (m_headless)
+			return;
 
 		SDL_CloseAudioDevice(m_audioDeviceID);
 		SDL_QuitSubSystem(SDL_INIT_AUDIO);
@@ -86,6 +89,9 @@ public:
 
 	float32 GetBufferUsageRatio() const
 	{
+		if (m_headless)
+			return 0.0f;
+
 		return static_cast<float32>(m_samples.UsedSize()) / m_samples.TotalSize();
 	}
 
@@ -101,6 +107,10 @@ public:
 	void AddSampleF32(float32 sample)
 	{
 		assert(sample >= 0.0f && sample <= 1.0f);
+
+		if (m_headless)
+			return;
+
 		//@TODO: This multiply is wrong for signed format types (S16, S32)
 		float targetSample = sample * std::numeric_limits<SampleFormatType>::max();
 
@@ -119,10 +129,6 @@ public:
 		{
 			SetPaused(true);
 		}
-
-	#if OUTPUT_RAW_AUDIO_FILE_STREAM
-		m_rawAudioOutputFS.WriteValue(sample);
-	#endif
 	}
 
 private:
@@ -147,8 +153,8 @@ private:
 	SDL_AudioDeviceID m_audioDeviceID;
 	SDL_AudioSpec m_audioSpec;
 	CircularBuffer<SampleFormatType> m_samples;
-	FileStream m_rawAudioOutputFS;
 	bool m_paused;
+	bool m_headless; // No audio device, samples are discarded
 };
 
 
@@ -162,9 +168,9 @@ AudioDriver::~AudioDriver()
 	delete m_impl;
 }
 
-void AudioDriver::Initialize()
+void AudioDriver::Initialize(bool headless)
 {
-	m_impl->Initialize();
+	m_impl->Initialize(headless);
 }
 
 void AudioDriver::Shutdown()
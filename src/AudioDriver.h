@@ -7,7 +7,7 @@ public:
 	AudioDriver();
 	~AudioDriver();
 
-	void Initialize();
+	void Initialize(bool headless = false); // If headless, no audio device is opened
 	void Shutdown();
 
 	size_t GetSampleRate() const;
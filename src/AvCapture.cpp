@@ -0,0 +1,422 @@
+#include "AvCapture.h"
+#include "Stream.h"
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+	const size_t kFrameWidth = 256;
+	const size_t kFrameHeight = 240;
+	const size_t kFrameSize = kFrameWidth * kFrameHeight;
+
+	// The APU generates exactly 1/60th of a second of samples per frame (see Apu::Execute), so video
+	// must run at 60 fps rather than the NES' 60.0988 for the two to stay in sync.
+	const char* kY4mHeader = "YUV4MPEG2 W256 H240 F60:1 Ip A1:1 C420jpeg\n";
+	const char* kY4mFrameHeader = "FRAME\n";
+
+	const size_t kMaxQueuedFrames = 120; // 2 seconds, ~30 MB
+	const size_t kWriteBufferSize = 4 * 1024 * 1024;
+
+	// Accumulates writes to issue few large ones
+	class BufferedFile
+	{
+	public:
+		BufferedFile() : m_failed(false) {}
+
+		bool Open(const std::string& file)
+		{
+			m_failed = false;
+			m_buffer.reserve(kWriteBufferSize);
+			return m_file.Open(file.c_str(), "wb");
+		}
+
+		bool Close()
+		{
+			Flush();
+			m_file.Close();
+			return !m_failed;
+		}
+
+		void Write(const void* data, size_t size)
+		{
+			if (m_buffer.size() + size > kWriteBufferSize)
+				Flush();
+			const uint8* bytes = static_cast<const uint8*>(data);
+			m_buffer.insert(m_buffer.end(), bytes, bytes + size);
+		}
+
+		template <typename T>
+		void WriteValue(const T& value) { Write(&value, sizeof(T)); }
+
+		void Flush()
+		{
+			if (!m_buffer.empty() && m_file.Write(m_buffer.data(), m_buffer.size()) != m_buffer.size())
+				m_failed = true;
+			m_buffer.clear();
+		}
+
+		// Writes value at pos, for headers completed once the size of the data is known
+		template <typename T>
+		void Patch(size_t pos, const T& value)
+		{
+			Flush();
+			m_file.SetPos(pos);
+			if (m_file.WriteValue(value) != 1)
+				m_failed = true;
+		}
+
+	private:
+		FileStream m_file;
+		std::vector<uint8> m_buffer;
+		bool m_failed;
+	};
+
+	// 16-bit mono PCM, sizes patched in by Close
+	class WavWriter
+	{
+	public:
+		static const size_t kRiffSizePos = 4;
+		static const size_t kDataSizePos = 40;
+		static const size_t kHeaderSize = 44;
+
+		bool Open(const std::string& file, size_t sampleRate)
+		{
+			m_numSamples = 0;
+			if (!m_file.Open(file))
+				return false;
+
+			const uint16 kNumChannels = 1;
+			const uint16 kBitsPerSample = 16;
+			m_file.Write("RIFF", 4);
+			m_file.WriteValue<uint32>(0);
+			m_file.Write("WAVEfmt ", 8);
+			m_file.WriteValue<uint32>(16);
+			m_file.WriteValue<uint16>(1); // PCM
+			m_file.WriteValue<uint16>(kNumChannels);
+			m_file.WriteValue<uint32>(static_cast<uint32>(sampleRate));
+			m_file.WriteValue<uint32>(static_cast<uint32>(sampleRate * kNumChannels * kBitsPerSample / 8));
+			m_file.WriteValue<uint16>(kNumChannels * kBitsPerSample / 8);
+			m_file.WriteValue<uint16>(kBitsPerSample);
+			m_file.Write("data", 4);
+			m_file.WriteValue<uint32>(0);
+			return true;
+		}
+
+		void Write(const std::vector<float32>& samples)
+		{
+			// Samples are in [0, 1], centered to use the whole signed range
+			for (float32 sample : samples)
+				m_file.WriteValue(static_cast<int16>((sample * 2.0f - 1.0f) * 32767.0f));
+			m_numSamples += samples.size();
+		}
+
+		bool Close()
+		{
+			const uint32 dataSize = static_cast<uint32>(m_numSamples * sizeof(int16));
+			m_file.Patch<uint32>(kRiffSizePos, static_cast<uint32>(kHeaderSize - 8 + dataSize));
+			m_file.Patch<uint32>(kDataSizePos, dataSize);
+			return m_file.Close();
+		}
+
+	private:
+		BufferedFile m_file;
+		size_t m_numSamples;
+	};
+
+	// Converts PpuPixels to BT.601 limited range YCbCr, the range players assume for Y4M
+	class YCbCrTable
+	{
+	public:
+		YCbCrTable()
+		{
+			PpuPixel pixels[PixelConverter::kNumPpuPixelValues];
+			uint32 argb[PixelConverter::kNumPpuPixelValues];
+			for (size_t i = 0; i < PixelConverter::kNumPpuPixelValues; ++i)
+				pixels[i] = static_cast<PpuPixel>(i);
+			PixelConverter::Get().Convert(pixels, PixelConverter::kNumPpuPixelValues, 1, PixelFormat::Argb8888, reinterpret_cast<uint8*>(argb), sizeof(argb));
+
+			for (size_t i = 0; i < PixelConverter::kNumPpuPixelValues; ++i)
+			{
+				const float32 r = static_cast<float32>((argb[i] >> 16) & 0xFF);
+				const float32 g = static_cast<float32>((argb[i] >> 8) & 0xFF);
+				const float32 b = static_cast<float32>(argb[i] & 0xFF);
+				y[i] = static_cast<uint8>(16.5f + (65.481f * r + 128.553f * g + 24.966f * b) / 255.0f);
+				cb[i] = static_cast<uint8>(128.5f + (-37.797f * r - 74.203f * g + 112.0f * b) / 255.0f);
+				cr[i] = static_cast<uint8>(128.5f + (112.0f * r - 93.786f * g - 18.214f * b) / 255.0f);
+			}
+		}
+
+		uint8 y[PixelConverter::kNumPpuPixelValues];
+		uint8 cb[PixelConverter::kNumPpuPixelValues];
+		uint8 cr[PixelConverter::kNumPpuPixelValues];
+	};
+
+	// Planar Y, then Cb and Cr averaged over 2x2 blocks
+	void ConvertToY4mFrame(const PpuPixel* pixels, const YCbCrTable& table, std::vector<uint8>& frame)
+	{
+		const size_t kChromaWidth = kFrameWidth / 2;
+		const size_t kChromaHeight = kFrameHeight / 2;
+		frame.resize(kFrameSize + 2 * kChromaWidth * kChromaHeight);
+
+		uint8* y = frame.data();
+		uint8* cb = y + kFrameSize;
+		uint8* cr = cb + kChromaWidth * kChromaHeight;
+
+		for (size_t i = 0; i < kFrameSize; ++i)
+			y[i] = table.y[pixels[i]];
+
+		for (size_t cy = 0; cy < kChromaHeight; ++cy)
+		{
+			const PpuPixel* row0 = pixels + cy * 2 * kFrameWidth;
+			const PpuPixel* row1 = row0 + kFrameWidth;
+			for (size_t cx = 0; cx < kChromaWidth; ++cx)
+			{
+				const size_t x = cx * 2;
+				*cb++ = static_cast<uint8>((table.cb[row0[x]] + table.cb[row0[x + 1]] + table.cb[row1[x]] + table.cb[row1[x + 1]] + 2) / 4);
+				*cr++ = static_cast<uint8>((table.cr[row0[x]] + table.cr[row0[x + 1]] + table.cr[row1[x]] + table.cr[row1[x + 1]] + 2) / 4);
+			}
+		}
+	}
+}
+
+class AvCapture::AvCaptureImpl
+{
+public:
+	struct Frame
+	{
+		bool presented;
+		std::vector<PpuPixel> pixels;
+		std::vector<float32> samples;
+	};
+
+	AvCaptureImpl()
+		: m_capturing(false)
+		, m_current(nullptr)
+		, m_numStalls(0)
+		, m_quit(false)
+	{
+	}
+
+	~AvCaptureImpl()
+	{
+		Stop();
+	}
+
+	bool Start(const std::string& baseFile, VideoCaptureFormat::Type format, size_t audioSampleRate)
+	{
+		Stop();
+
+		m_format = format;
+		if (!m_videoFile.Open(baseFile + VideoCaptureFormat::Extension[format]))
+			return false;
+
+		if (!m_wavWriter.Open(baseFile + ".wav", audioSampleRate))
+		{
+			m_videoFile.Close();
+			return false;
+		}
+
+		if (m_format == VideoCaptureFormat::Y4m)
+			m_videoFile.Write(kY4mHeader, strlen(kY4mHeader));
+
+		if (m_frames.empty())
+		{
+			for (size_t i = 0; i < kMaxQueuedFrames; ++i)
+			{
+				m_frames.push_back(std::unique_ptr<Frame>(new Frame()));
+				m_frames.back()->pixels.resize(kFrameSize);
+			}
+		}
+
+		m_freeFrames.clear();
+		for (auto& frame : m_frames)
+			m_freeFrames.push_back(frame.get());
+		m_current = PopFreeFrame();
+		m_current->samples.clear(); // May hold audio of a previous capture
+
+		m_lastPixels.assign(kFrameSize, 0x0F); // Black until the first presented frame
+		m_numStalls = 0;
+		m_quit = false;
+		m_capturing = true;
+		m_thread = std::thread(&AvCaptureImpl::ThreadMain, this);
+		return true;
+	}
+
+	bool Stop()
+	{
+		if (!m_capturing)
+			return true;
+
+		// Audio after the last frame end belongs to an incomplete frame, and is dropped
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit = true;
+		}
+		m_queuedCondition.notify_one();
+		m_thread.join();
+
+		const bool videoWritten = m_videoFile.Close();
+		const bool audioWritten = m_wavWriter.Close();
+		m_capturing = false;
+		m_current = nullptr;
+		return videoWritten && audioWritten;
+	}
+
+	bool IsCapturing() const { return m_capturing; }
+	size_t GetNumStalls() const { return m_numStalls; }
+
+	void OnAudioSample(float32 sample)
+	{
+		if (m_capturing)
+			m_current->samples.push_back(sample);
+	}
+
+	void OnFrameEnd(const PpuPixel* pixels)
+	{
+		if (!m_capturing)
+			return;
+
+		m_current->presented = pixels != nullptr;
+		if (pixels)
+			memcpy(m_current->pixels.data(), pixels, kFrameSize * sizeof(PpuPixel));
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_queue.push_back(m_current);
+		}
+		m_queuedCondition.notify_one();
+
+		m_current = PopFreeFrame();
+		m_current->samples.clear();
+	}
+
+private:
+	Frame* PopFreeFrame()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		if (m_freeFrames.empty())
+		{
+			++m_numStalls;
+			m_freeCondition.wait(lock, [this] { return !m_freeFrames.empty(); });
+		}
+
+		Frame* frame = m_freeFrames.back();
+		m_freeFrames.pop_back();
+		return frame;
+	}
+
+	void ThreadMain()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (;;)
+		{
+			m_queuedCondition.wait(lock, [this] { return m_quit || !m_queue.empty(); });
+			if (m_queue.empty())
+				break; // Quit once all frames are written
+
+			Frame* frame = m_queue.front();
+			m_queue.pop_front();
+
+			lock.unlock();
+			WriteFrame(*frame);
+			lock.lock();
+
+			m_freeFrames.push_back(frame);
+			m_freeCondition.notify_one();
+		}
+	}
+
+	void WriteFrame(Frame& frame)
+	{
+		// Skipped frames repeat the last presented one
+		if (frame.presented)
+			std::swap(frame.pixels, m_lastPixels);
+
+		switch (m_format)
+		{
+		case VideoCaptureFormat::Y4m:
+			ConvertToY4mFrame(m_lastPixels.data(), m_yCbCrTable, m_y4mFrame);
+			m_videoFile.Write(kY4mFrameHeader, strlen(kY4mFrameHeader));
+			m_videoFile.Write(m_y4mFrame.data(), m_y4mFrame.size());
+			break;
+
+		case VideoCaptureFormat::Indexed:
+			m_videoFile.Write(m_lastPixels.data(), m_lastPixels.size() * sizeof(PpuPixel));
+			break;
+
+		default:
+			assert(false);
+		}
+
+		m_wavWriter.Write(frame.samples);
+	}
+
+	bool m_capturing;
+	VideoCaptureFormat::Type m_format;
+
+	// Emulation thread
+	Frame* m_current;
+	size_t m_numStalls;
+
+	// Writer thread
+	BufferedFile m_videoFile;
+	WavWriter m_wavWriter;
+	YCbCrTable m_yCbCrTable;
+	std::vector<PpuPixel> m_lastPixels;
+	std::vector<uint8> m_y4mFrame;
+
+	std::vector<std::unique_ptr<Frame>> m_frames;
+	std::deque<Frame*> m_queue;
+	std::vector<Frame*> m_freeFrames;
+	std::thread m_thread;
+	std::mutex m_mutex;
+	std::condition_variable m_queuedCondition;
+	std::condition_variable m_freeCondition;
+	bool m_quit;
+};
+
+AvCapture::AvCapture()
+	: m_impl(new AvCaptureImpl())
+{
+}
+
+AvCapture::~AvCapture()
+{
+	delete m_impl;
+}
+
+bool AvCapture::Start(const std::string& baseFile, VideoCaptureFormat::Type format, size_t audioSampleRate)
+{
+	return m_impl->Start(baseFile, format, audioSampleRate);
+}
+
+bool AvCapture::Stop()
+{
+	return m_impl->Stop();
+}
+
+bool AvCapture::IsCapturing() const
+{
+	return m_impl->IsCapturing();
+}
+
+size_t AvCapture::GetNumStalls() const
+{
+	return m_impl->GetNumStalls();
+}
+
+void AvCapture::OnAudioSample(float32 sample)
+{
+	m_impl->OnAudioSample(sample);
+}
+
+void AvCapture::OnFrameEnd(const PpuPixel* pixels)
+{
+	m_impl->OnFrameEnd(pixels);
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include "Base.h"
+#include "AvOutput.h"
+#include <string>
+
+namespace VideoCaptureFormat
+{
+	enum Type
+	{
+		Y4m,		// YUV4MPEG2, 4:2:0, playable and encodable by common tools (e.g. ffmpeg -i capture.y4m)
+		Indexed,	// Raw 256x240 frames of little-endian PpuPixels, to convert losslessly later
+
+		NumTypes
+	};
+
+	static const char* String[] = { "Y4m", "Indexed" };
+	static_assert(NumTypes == ARRAYSIZE(String), "Size mismatch");
+
+	static const char* Extension[] = { ".y4m", ".ppu" };
+	static_assert(NumTypes == ARRAYSIZE(Extension), "Size mismatch");
+}
+
+// Captures video and audio (16-bit PCM WAV) to files. Frames and their audio are queued by the
+// emulation thread, and converted and written on a background thread in large blocks, so capturing
+// adds no disk I/O to frame time. The queue is bounded: if the disk can't keep up for a while, the
+// emulation thread waits rather than frames being dropped. Skipped frames repeat the previous
+// frame, so that video stays in sync with audio.
+class AvCapture : public AvOutputListener
+{
+public:
+	AvCapture();
+	~AvCapture(); // Stops
+
+	// Writes to baseFile + VideoCaptureFormat::Extension[format] and baseFile + ".wav"
+	bool Start(const std::string& baseFile, VideoCaptureFormat::Type format, size_t audioSampleRate);
+
+	// Waits for queued frames to be written, then closes the files. Returns false if a write failed.
+	bool Stop();
+
+	bool IsCapturing() const;
+
+	// Number of times the emulation thread waited for the writer since Start
+	size_t GetNumStalls() const;
+
+	virtual void OnAudioSample(float32 sample);
+	virtual void OnFrameEnd(const PpuPixel* pixels);
+
+private:
+	AvCapture(const AvCapture&);
+	AvCapture& operator=(const AvCapture&);
+
+	class AvCaptureImpl;
+	AvCaptureImpl* m_impl;
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "Base.h"
+#include "PixelConverter.h"
+
+// Receives audio and video as the emulator outputs them, to export or capture them (see Nes::AddAvOutputListener)
+class AvOutputListener
+{
+public:
+	virtual ~AvOutputListener() {}
+
+	// Every sample that is played, at Nes::GetAudioSampleRate(). Not called for hidden run-ahead frames.
+	virtual void OnAudioSample(float32 sample) = 0;
+
+	// At the end of each emulated frame, with the 256x240 PPU output if the frame was presented,
+	// nullptr if it was skipped (see Nes::SetFrameSkip). Not called while paused.
+	virtual void OnFrameEnd(const PpuPixel* pixels) = 0;
+};
@@ -164,7 +164,7 @@ namespace Debugger { extern void Shutdown(); }
 
 inline void FailHandler(const char* msg)
 {
-	Debugger::Shutdown(); // Flush buffered output to trace file
+	Debugger::Shutdown(); // Give the debugger a chance to clean up before unwinding
 
 #if CONFIG_DEBUG
 	printf("FAIL: %s\n", msg);
@@ -0,0 +1,74 @@
+#include "Breakpoints.h"
+#include <algorithm>
+
+namespace
+{
+	const BreakpointFlag::Type kAccessTypes[] = { BreakpointFlag::Read, BreakpointFlag::Write, BreakpointFlag::Execute };
+}
+
+BreakpointTable::BreakpointTable()
+{
+	static_assert(ARRAYSIZE(kAccessTypes) == kNumAccessTypes, "Size mismatch");
+
+	for (size_t i = 0; i < kNumAccessTypes; ++i)
+	{
+		m_bitmaps[MemorySpace::Cpu][i].resize(kCpuSpaceSize / 32);
+		m_bitmaps[MemorySpace::Ppu][i].resize(kPpuSpaceSize / 32);
+	}
+}
+
+void BreakpointTable::Add(MemorySpace::Type space, uint16 address, uint8 flags, BreakpointCondition condition)
+{
+	Remove(space, address, flags);
+
+	const size_t index = MapAddress(space, address);
+	for (auto access : kAccessTypes)
+	{
+		if ((flags & access) == 0)
+			continue;
+
+		m_bitmaps[space][AccessIndex(access)][index >> 5] |= (1u << (index & 31));
+
+		if (condition)
+		{
+			Condition entry = { space, access, static_cast<uint16>(index), condition };
+			m_conditions.push_back(entry);
+		}
+	}
+}
+
+void BreakpointTable::Remove(MemorySpace::Type space, uint16 address, uint8 flags)
+{
+	const size_t index = MapAddress(space, address);
+	for (auto access : kAccessTypes)
+	{
+		if ((flags & access) != 0)
+			m_bitmaps[space][AccessIndex(access)][index >> 5] &= ~(1u << (index & 31));
+	}
+
+	m_conditions.erase(std::remove_if(m_conditions.begin(), m_conditions.end(), [&] (const Condition& entry)
+	{
+		return entry.space == space && entry.address == index && (flags & entry.access) != 0;
+	}), m_conditions.end());
+}
+
+void BreakpointTable::Clear()
+{
+	for (auto& spaceBitmaps : m_bitmaps)
+	{
+		for (auto& bitmap : spaceBitmaps)
+			std::fill(bitmap.begin(), bitmap.end(), 0);
+	}
+	m_conditions.clear();
+}
+
+bool BreakpointTable::EvaluateCondition(MemorySpace::Type space, BreakpointFlag::Type access, uint16 address) const
+{
+	const size_t index = MapAddress(space, address);
+	for (const auto& entry : m_conditions)
+	{
+		if (entry.space == space && entry.access == access && entry.address == index)
+			return entry.condition(address);
+	}
+	return true; // Unconditional
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include "Base.h"
+#include <functional>
+#include <vector>
+
+namespace BreakpointFlag
+{
+	enum Type : uint8
+	{
+		Read	= BIT(0),
+		Write	= BIT(1),
+		Execute	= BIT(2), // CPU space only
+
+		All		= Read | Write | Execute
+	};
+}
+
+namespace MemorySpace
+{
+	enum Type
+	{
+		Cpu, // 64K
+		Ppu, // 16K, mirrored above
+
+		NumTypes
+	};
+
+	static const char* String[] = { "Cpu", "Ppu" };
+
+	static_assert(NumTypes == ARRAYSIZE(String), "Size mismatch");
+}
+
+// Evaluated when a breakpoint is hit, return false to ignore the hit
+typedef std::function<bool (uint16 address)> BreakpointCondition;
+
+// Breakpoints and watchpoints over all of CPU and PPU memory. Each space and access type has its own
+// bitmap, so checking an access is a single bit test regardless of how many breakpoints are set.
+// Conditions are only looked up once the bit test hits.
+class BreakpointTable
+{
+public:
+	BreakpointTable();
+
+	// Adds breakpoint on the access types in flags (BreakpointFlag), replacing any condition
+	// previously set for them
+	void Add(MemorySpace::Type space, uint16 address, uint8 flags, BreakpointCondition condition = BreakpointCondition());
+	void Remove(MemorySpace::Type space, uint16 address, uint8 flags);
+	void Clear();
+
+	FORCEINLINE bool Test(MemorySpace::Type space, BreakpointFlag::Type access, uint16 address) const
+	{
+		const size_t index = MapAddress(space, address);
+		return (m_bitmaps[space][AccessIndex(access)][index >> 5] & (1u << (index & 31))) != 0;
+	}
+
+	// Call once Test returns true. Returns false if the hit is filtered out by a condition.
+	bool EvaluateCondition(MemorySpace::Type space, BreakpointFlag::Type access, uint16 address) const;
+
+private:
+	static const size_t kNumAccessTypes = 3;
+	static const size_t kCpuSpaceSize = KB(64);
+	static const size_t kPpuSpaceSize = KB(16);
+
+	FORCEINLINE static size_t MapAddress(MemorySpace::Type space, uint16 address)
+	{
+		return space == MemorySpace::Ppu? (address & (kPpuSpaceSize - 1)) : address;
+	}
+
+	FORCEINLINE static size_t AccessIndex(BreakpointFlag::Type access)
+	{
+		return access == BreakpointFlag::Read? 0 : access == BreakpointFlag::Write? 1 : 2;
+	}
+
+	struct Condition
+	{
+		MemorySpace::Type space;
+		BreakpointFlag::Type access;
+		uint16 address;
+		BreakpointCondition condition;
+	};
+
+	typedef std::vector<uint32> Bitmap;
+	Bitmap m_bitmaps[MemorySpace::NumTypes][kNumAccessTypes];
+	std::vector<Condition> m_conditions; // Only breakpoints that have a condition
+};
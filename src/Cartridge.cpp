@@ -4,6 +4,7 @@
 #include "Rom.h"
 #include "MemoryMap.h"
 #include "Debugger.h"
+#include "Hash.h"
 #include "Mapper0.h"
 #include "Mapper1.h"
 #include "Mapper2.h"
@@ -29,6 +30,9 @@ void Cartridge::Initialize(Nes& nes)
 {
 	m_nes = &nes;
 	m_mapper = nullptr;
+	m_romHash = 0;
+	m_saveRamDirty = false;
+	m_saveRamWriteListener = nullptr;
 }
 
 void Cartridge::Serialize(class Serializer& serializer)
@@ -39,10 +43,21 @@ void Cartridge::Serialize(class Serializer& serializer)
 		SERIALIZE_BUFFER(m_prgBanks.data(), m_mapper->PrgMemorySize());
 
 	if (m_mapper->CanWriteChrMemory())
-		SERIALIZE_BUFFER(m_chrBanks.data(), m_mapper->ChrMemorySize());
+		SERIALIZE_TRACKED_BUFFER(m_chrBanks.data(), m_mapper->ChrMemorySize(), m_chrPages);
 
 	if (m_mapper->SavMemorySize() > 0)
-		SERIALIZE_BUFFER(m_savBanks.data(), m_mapper->SavMemorySize());
+	{
+		// Loading a state may change sram contents. States are loaded often (run-ahead, rewind, clones),
+		// usually with the same sram, so compare to avoid needlessly rewriting the sram file.
+		const size_t savMemorySize = m_mapper->SavMemorySize();
+		if (!serializer.IsSaving())
+			memcpy(m_savBanksBeforeLoad.data(), m_savBanks.data(), savMemorySize);
+
+		SERIALIZE_TRACKED_BUFFER(m_savBanks.data(), savMemorySize, m_savPages);
+
+		if (!serializer.IsSaving() && memcmp(m_savBanksBeforeLoad.data(), m_savBanks.data(), savMemorySize) != 0)
+			m_saveRamDirty = true;
+	}
 	
 	serializer.SerializeObject(*m_mapper);
 }
@@ -55,6 +70,7 @@ RomHeader Cartridge::LoadRom(const char* file)
 	fs.ReadValue(headerBytes);
 	RomHeader romHeader;
 	romHeader.Initialize(headerBytes);
+	m_romHash = Fnv1a64(headerBytes, sizeof(headerBytes));
 
 	// Next is Trainer, if present (0 or 512 bytes)
 	if ( romHeader.HasTrainer() )
@@ -75,6 +91,7 @@ RomHeader Cartridge::LoadRom(const char* file)
 	for (size_t i = 0; i < numPrgBanks; ++i)
 	{
 		fs.Read(m_prgBanks[i].RawPtr(), kPrgBankSize);
+		m_romHash = Fnv1a64(m_prgBanks[i].RawPtr(), kPrgBankSize, m_romHash);
 	}
 
 	// CHR-ROM data
@@ -87,14 +104,52 @@ RomHeader Cartridge::LoadRom(const char* file)
 		for (size_t i = 0; i < numChrBanks; ++i)
 		{
 			fs.Read(m_chrBanks[i].RawPtr(), kChrBankSize);
+			m_romHash = Fnv1a64(m_chrBanks[i].RawPtr(), kChrBankSize, m_romHash);
 		}
 	}
 
+	m_romHeader = romHeader;
+	InitializeMapper();
+
+	return romHeader;
+}
+
+void Cartridge::LoadRomFrom(const Cartridge& other)
+{
+	assert(other.IsRomLoaded());
+
+	// Copies cartridge RAM too, but that's state, which the caller is expected to copy next
+	m_prgBanks = other.m_prgBanks;
+	m_chrBanks = other.m_chrBanks;
+	m_savBanks = other.m_savBanks;
+	m_romHash = other.m_romHash;
+	m_romHeader = other.m_romHeader;
+	InitializeMapper();
+}
+
+void Cartridge::ClearRam()
+{
+	// Without CHR-ROM, CHR banks are RAM
+	if (m_romHeader.GetChrRomSizeBytes() == 0)
+	{
+		std::for_each(begin(m_chrBanks), end(m_chrBanks), [] (ChrBankMemory& m) { m.Initialize(); });
+		m_chrPages.MarkAllDirty();
+	}
+	std::for_each(begin(m_savBanks), end(m_savBanks), [] (SavBankMemory& m) { m.Initialize(); });
+	m_savPages.MarkAllDirty();
+	m_saveRamDirty = false;
+}
+
+void Cartridge::InitializeMapper()
+{
+	const size_t numPrgBanks = m_romHeader.GetPrgRomSizeBytes() / kPrgBankSize;
+	const size_t numChrBanks = m_romHeader.GetChrRomSizeBytes() / kChrBankSize;
+
 	// Note that "save" here doesn't imply battery-backed
-	const size_t numSavBanks = romHeader.GetNumPrgRamBanks();
+	const size_t numSavBanks = m_romHeader.GetNumPrgRamBanks();
 	assert(numSavBanks <= kMaxSavBanks);
 
-	switch (romHeader.GetMapperNumber())
+	switch (m_romHeader.GetMapperNumber())
 	{
 	case 0: m_mapperHolder.reset(new Mapper0()); break;
 	case 1: m_mapperHolder.reset(new Mapper1()); break;
@@ -103,16 +158,19 @@ RomHeader Cartridge::LoadRom(const char* file)
 	case 4: m_mapperHolder.reset(new Mapper4()); break;
 	case 7: m_mapperHolder.reset(new Mapper7()); break;
 	default:
-		FAIL("Unsupported mapper: %d", romHeader.GetMapperNumber());
+		FAIL("Unsupported mapper: %d", m_romHeader.GetMapperNumber());
 	}
 	m_mapper = m_mapperHolder.get();
 
 	m_mapper->Initialize(numPrgBanks, numChrBanks, numSavBanks);
 
-	m_cartNameTableMirroring = romHeader.GetNameTableMirroring();
-	m_hasSRAM = romHeader.HasSRAM();
+	m_cartNameTableMirroring = m_romHeader.GetNameTableMirroring();
+	m_hasSRAM = m_romHeader.HasSRAM();
+	m_saveRamDirty = false;
 
-	return romHeader;
+	m_chrPages.Initialize(m_mapper->CanWriteChrMemory()? m_mapper->ChrMemorySize() : 0);
+	m_savPages.Initialize(m_mapper->SavMemorySize());
+	m_savBanksBeforeLoad.resize(m_mapper->SavMemorySize());
 }
 
 NameTableMirroring Cartridge::GetNameTableMirroring() const
@@ -161,7 +219,16 @@ void Cartridge::HandleCpuWrite(uint16 cpuAddress, uint8 value)
 	{
 		if (m_mapper->CanWriteSavMemory())
 		{
-			AccessSavMem(cpuAddress) = value;
+			uint8& savMem = AccessSavMem(cpuAddress);
+			if (savMem != value)
+			{
+				savMem = value;
+				m_saveRamDirty = true;
+				m_savPages.MarkDirty(&savMem - m_savBanks[0].Begin());
+			}
+
+			if (m_saveRamWriteListener)
+				m_saveRamWriteListener->OnSaveRamWrite(cpuAddress, value);
 		}
 	}
 	else
@@ -173,6 +240,23 @@ void Cartridge::HandleCpuWrite(uint16 cpuAddress, uint8 value)
 	}
 }
 
+const uint8* Cartridge::GetCpuPagePtr(uint16 cpuAddress)
+{
+	// Banks are larger than a page, so a page is always contiguous in cartridge memory
+	const uint16 pageAddress = cpuAddress & 0xFF00;
+
+	if (pageAddress >= CpuMemory::kPrgRomBase)
+	{
+		return &AccessPrgMem(pageAddress);
+	}
+	else if (pageAddress >= CpuMemory::kSaveRamBase)
+	{
+		return &AccessSavMem(pageAddress);
+	}
+
+	return nullptr;
+}
+
 uint8 Cartridge::HandlePpuRead(uint16 ppuAddress)
 {
 	return AccessChrMem(ppuAddress);
@@ -182,7 +266,9 @@ void Cartridge::HandlePpuWrite(uint16 ppuAddress, uint8 value)
 {
 	if (m_mapper->CanWriteChrMemory())
 	{
-		AccessChrMem(ppuAddress) = value;
+		uint8& chrMem = AccessChrMem(ppuAddress);
+		chrMem = value;
+		m_chrPages.MarkDirty(&chrMem - m_chrBanks[0].Begin());
 	}
 }
 
@@ -190,7 +276,11 @@ void Cartridge::WriteSaveRamFile(const char* file)
 {
 	assert(IsRomLoaded());
 
-	if (!m_hasSRAM)
+	// The writer thread may have failed to write what we handed it last time
+	if (m_saveRamWriter.TakeWriteFailure(file))
+		m_saveRamDirty = true;
+
+	if (!m_hasSRAM || !m_saveRamDirty)
 		return;
 
 	//@NOTE: We assume all prg-ram is battery-backed here, even though this may not
@@ -200,25 +290,28 @@ void Cartridge::WriteSaveRamFile(const char* file)
 	if (numSavBanks == 0)
 		return;
 
-	FileStream saveFS;
-	if (saveFS.Open(file, "wb"))
+	// Snapshot sram and hand it off to the writer thread so we don't stall emulation on disk I/O
+	std::vector<uint8> data(numSavBanks * kSavBankSize);
+	for (size_t i = 0; i < numSavBanks; ++i)
 	{
-		for (size_t i = 0; i < numSavBanks; ++i)
-		{
-			auto& bank = m_savBanks[i];
-			saveFS.Write(bank.RawPtr(), kSavBankSize);
-		}
-		saveFS.Close();
-
-		printf("Saved save ram file: %s\n", file);
+		auto& bank = m_savBanks[i];
+		std::copy(bank.RawPtr(), bank.RawPtr() + kSavBankSize, data.begin() + i * kSavBankSize);
 	}
+
+	m_saveRamWriter.WriteFile(file, std::move(data));
+	m_saveRamDirty = false;
 }
 
 void Cartridge::LoadSaveRamFile(const char* file)
 {
+	m_saveRamDirty = false;
+
 	if (!m_hasSRAM)
 		return;
 
+	// Make sure we don't read a file that's still being written
+	m_saveRamWriter.Flush();
+
 	const size_t numSavBanks = m_mapper->NumSavBanks8k();
 	if (numSavBanks == 0)
 		return;
@@ -232,6 +325,7 @@ void Cartridge::LoadSaveRamFile(const char* file)
 			saveFS.Read(bank.RawPtr(), kSavBankSize);
 		}
 		saveFS.Close();
+		m_savPages.MarkAllDirty();
 
 		printf("Loaded save ram file: %s\n", file);
 	}
@@ -249,11 +343,15 @@ void Cartridge::HACK_OnScanline()
 	}
 }
 
-size_t Cartridge::GetPrgBankIndex16k(uint16 cpuAddress) const
+size_t Cartridge::GetPrgBankIndex4k(uint16 cpuAddress) const
 {
 	const size_t bankIndex4k = GetBankIndex(cpuAddress, CpuMemory::kPrgRomBase, kPrgBankSize);
-	const size_t mappedBankIndex4k = m_mapper->GetMappedPrgBankIndex(bankIndex4k);
-	return mappedBankIndex4k * KB(4) / KB(16);
+	return m_mapper->GetMappedPrgBankIndex(bankIndex4k);
+}
+
+size_t Cartridge::GetPrgBankIndex16k(uint16 cpuAddress) const
+{
+	return GetPrgBankIndex4k(cpuAddress) * KB(4) / KB(16);
 }
 
 uint8& Cartridge::AccessPrgMem(uint16 cpuAddress)
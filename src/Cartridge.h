@@ -3,11 +3,22 @@
 #include "Memory.h"
 #include "Rom.h"
 #include "Mapper.h"
+#include "AsyncFileWriter.h"
+#include "DirtyPageHash.h"
 #include <memory>
 #include <string>
+#include <vector>
 
 class Nes;
 
+// Notified of CPU writes to sram ($6000-$7FFF), e.g. by test roms that post their results there
+class SaveRamWriteListener
+{
+public:
+	virtual ~SaveRamWriteListener() {}
+	virtual void OnSaveRamWrite(uint16 cpuAddress, uint8 value) = 0;
+};
+
 class Cartridge
 {
 public:
@@ -15,7 +26,14 @@ public:
 	void Serialize(class Serializer& serializer);
 	
 	RomHeader LoadRom(const char* file);
+
+	// Loads the rom loaded in other, from memory
+	void LoadRomFrom(const Cartridge& other);
+
+	// Clears sram and CHR-RAM, as when a freshly loaded cart has no sram file
+	void ClearRam();
 	bool IsRomLoaded() const { return m_mapper != nullptr; }
+	uint64 GetRomHash() const { return m_romHash; } // Hash of header, PRG-ROM and CHR-ROM
 
 	NameTableMirroring GetNameTableMirroring() const;
 
@@ -24,25 +42,45 @@ public:
 	uint8 HandlePpuRead(uint16 ppuAddress);
 	void HandlePpuWrite(uint16 ppuAddress, uint8 value);
 
+	// Returns pointer to the 256 byte page containing cpuAddress, or nullptr if unmapped
+	const uint8* GetCpuPagePtr(uint16 cpuAddress);
+
 	//@TODO: Rename to SerializeSaveRam to mimic SerializeSaveState
+	// Only writes if sram was modified since the last load or successful write. The file is written
+	// asynchronously.
 	void WriteSaveRamFile(const char* file);
 	void LoadSaveRamFile(const char* file);
 
+	void SetSaveRamWriteListener(SaveRamWriteListener* listener) { m_saveRamWriteListener = listener; }
+
 	void HACK_OnScanline();
 	
+	size_t GetPrgBankIndex4k(uint16 cpuAddress) const;
 	size_t GetPrgBankIndex16k(uint16 cpuAddress) const;
+
+	// Mapped 4K PRG bank index per 4K of CPU memory from $8000
+	const size_t* GetPrgBankIndices() const { return m_mapper->GetPrgBankIndices(); }
+	size_t GetPrgMemorySize() const { return m_mapper->PrgMemorySize(); }
+	bool CanWritePrgMemory() const { return m_mapper->CanWritePrgMemory(); }
 	
 private:
 	uint8& AccessPrgMem(uint16 cpuAddress);
 	uint8& AccessChrMem(uint16 ppuAddress);
 	uint8& AccessSavMem(uint16 cpuAddress);
 
+	void InitializeMapper();
+
 	Nes* m_nes;
 	
 	std::shared_ptr<Mapper> m_mapperHolder;
 	Mapper* m_mapper;
+	RomHeader m_romHeader;
 	NameTableMirroring m_cartNameTableMirroring;
 	bool m_hasSRAM;
+	uint64 m_romHash;
+	bool m_saveRamDirty; // Set when sram is modified
+	AsyncFileWriter m_saveRamWriter;
+	SaveRamWriteListener* m_saveRamWriteListener;
 
 	// Set arbitrarily large max number of banks
 	static const size_t kMaxPrgBanks = 128;
@@ -56,4 +94,9 @@ private:
 	std::array<PrgBankMemory, kMaxPrgBanks> m_prgBanks;
 	std::array<ChrBankMemory, kMaxChrBanks> m_chrBanks;
 	std::array<SavBankMemory, kMaxSavBanks> m_savBanks;
+
+	// Writes to writable memory, by offset from the first bank
+	DirtyPageHash m_chrPages;
+	DirtyPageHash m_savPages;
+	std::vector<uint8> m_savBanksBeforeLoad; // To detect sram changes when loading states
 };
@@ -6,34 +6,37 @@
 #include <string>
 #include <algorithm>
 
-namespace
+uint8 KeyboardInputSource::GetButtons(size_t controllerIndex)
 {
-	bool ReadInputDown(uint16 controllerIndex, ControllerButtons::Type button)
+	static SDL_Scancode buttonMapping[] =
 	{
-		static SDL_Scancode buttonMapping[] =
-		{
-			SDL_SCANCODE_LEFT,
-			SDL_SCANCODE_RIGHT,
-			SDL_SCANCODE_UP,
-			SDL_SCANCODE_DOWN,
-			SDL_SCANCODE_S,
-			SDL_SCANCODE_A,
-			SDL_SCANCODE_TAB,
-			SDL_SCANCODE_RETURN
-		};
-		static_assert(ARRAYSIZE(buttonMapping) == ControllerButtons::Size, "Mismatched size");
-
-		// For second controller, hold alternate key
-		if ((controllerIndex == 1) != Input::AltDown())
-			return false;
-
-		const bool isDown = Input::KeyDown(buttonMapping[button]);
-
-		//if (isDown)
-		//	printf("%d: KeyDown: %s -> %s\n", controllerIndex, Input::GetScancodeName(buttonMapping[button]), ControllerButtons::Names[button]);
-
-		return isDown;
+		SDL_SCANCODE_LEFT,
+		SDL_SCANCODE_RIGHT,
+		SDL_SCANCODE_UP,
+		SDL_SCANCODE_DOWN,
+		SDL_SCANCODE_S,
+		SDL_SCANCODE_A,
+		SDL_SCANCODE_TAB,
+		SDL_SCANCODE_RETURN
+	};
+	static_assert(ARRAYSIZE(buttonMapping) == ControllerButtons::Size, "Mismatched size");
+
+	// For second controller, hold alternate key
+	if ((controllerIndex == 1) != Input::AltDown())
+		return 0;
+
+	uint8 buttons = 0;
+	for (size_t button = 0; button < ControllerButtons::Size; ++button)
+	{
+		if (Input::KeyDown(buttonMapping[button]))
+			buttons |= static_cast<uint8>(BIT(button));
 	}
+	return buttons;
+}
+
+ControllerPorts::ControllerPorts()
+	: m_inputSource(&m_keyboardInputSource)
+{
 }
 
 void ControllerPorts::Initialize()
@@ -78,7 +81,7 @@ uint8 ControllerPorts::HandleCpuRead(uint16 cpuAddress)
 	
 	if (readIndex < ARRAYSIZE(reportOrder))
 	{
-		isButtonDown = ReadInputDown(controllerIndex, button);
+		isButtonDown = (m_inputSource->GetButtons(controllerIndex) & BIT(button)) != 0;
 
 		// NES d-pad doesn't allow both left and right, nor up and down to be pressed at the same
 		// time, and many games assume this, leading to wonky behaviour if both are reported as
@@ -124,6 +127,11 @@ void ControllerPorts::HandleCpuWrite(uint16 cpuAddress, uint8 value)
 	}
 }
 
+void ControllerPorts::SetInputSource(InputSource* inputSource)
+{
+	m_inputSource = inputSource? inputSource : &m_keyboardInputSource;
+}
+
 uint16 ControllerPorts::MapCpuToPorts(uint16 cpuAddress)
 {
 	if (cpuAddress == CpuMemory::kControllerPort1)
@@ -32,9 +32,32 @@ namespace ControllerButtons
 	static_assert(ARRAYSIZE(Names) == Size, "Mismatched size");
 }
 
+// Provides controller button state to ControllerPorts (e.g. keyboard, recorded movie)
+class InputSource
+{
+public:
+	virtual ~InputSource() {}
+
+	// Called once before each emulated frame
+	virtual void NextFrame() {}
+
+	// Returns buttons down for input controller, where bit N is set if ControllerButtons::Type N is down
+	virtual uint8 GetButtons(size_t controllerIndex) = 0;
+};
+
+// Reads buttons from the keyboard
+class KeyboardInputSource : public InputSource
+{
+public:
+	virtual uint8 GetButtons(size_t controllerIndex);
+};
+
 class ControllerPorts
 {
 public:
+	static const size_t kNumControllers = 2;
+
+	ControllerPorts();
 	void Initialize();
 	void Reset();
 	void Serialize(class Serializer& serializer);
@@ -42,11 +65,15 @@ public:
 	uint8 HandleCpuRead(uint16 cpuAddress);
 	void HandleCpuWrite(uint16 cpuAddress, uint8 value);
 
+	// Set to nullptr to read from the keyboard
+	void SetInputSource(InputSource* inputSource);
+
 private:
 	uint16 MapCpuToPorts(uint16 cpuAddress);
 
+	KeyboardInputSource m_keyboardInputSource;
+	InputSource* m_inputSource;
 	bool m_strobe;
-	const static size_t kNumControllers = 2;
 	uint8 m_ports[kNumControllers]; // For read only
 	uint8 m_readIndex[kNumControllers];
 	bool m_lastIsButtonDown[kNumControllers][ControllerButtons::Size];
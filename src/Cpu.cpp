@@ -4,15 +4,79 @@
 #include "MemoryMap.h"
 #include "Serializer.h"
 #include "Debugger.h"
+#include "Profiler.h"
+#include "Ppu.h"
+#include "InstructionTrace.h"
 
 // Some retail games overflow (on purpose?) like Battletoads
 // so we can't leave this on
 #define FAIL_ON_STACK_OVERFLOW 0
 
+// Cached instructions are fetched without going through the bus, which would hide instruction
+// fetches from read breakpoints
+#define INSTRUCTION_CACHE_ENABLED !DEBUGGING_ENABLED
+
+// Same for sprite DMA reading its source page directly
+#define DIRECT_SPRITE_DMA_ENABLED !DEBUGGING_ENABLED
+
+// Skipped instructions don't fetch or read through the bus, so they'd never hit breakpoints
+#define IDLE_LOOP_SKIP_ENABLED !DEBUGGING_ENABLED
+
 namespace
 {
 	OpCodeEntry** g_opCodeTable = GetOpCodeTable();
 
+	// Idle loops are short and settle quickly
+	const uint16 kMaxIdleLoopBytes = 16;
+	const size_t kMaxIdleLoopAttempts = 2;
+
+	// Instructions that may appear in an idle loop: no writes, no stack, no I/O reads other than $2002
+	struct IdleLoopOpCodes
+	{
+		IdleLoopOpCodes()
+		{
+			using namespace OpCodeName;
+			for (size_t i = 0; i < 256; ++i)
+			{
+				isSafe[i] = readsMemory[i] = false;
+
+				const OpCodeEntry* entry = g_opCodeTable[i];
+				if (!entry)
+					continue;
+
+				switch (entry->opCodeName)
+				{
+				case LDA: case LDX: case LDY: case CMP: case CPX: case CPY:
+				case BIT: case AND: case ORA: case EOR: case ADC: case SBC:
+					isSafe[i] = true;
+					readsMemory[i] = entry->addrMode != AddressMode::Immedt;
+					break;
+
+				case BCC: case BCS: case BEQ: case BMI: case BNE: case BPL: case BVC: case BVS:
+				case CLC: case CLD: case CLI: case CLV: case SEC: case SED: case SEI:
+				case TAX: case TAY: case TSX: case TXA: case TXS: case TYA:
+				case INX: case INY: case DEX: case DEY: case NOP:
+					isSafe[i] = true;
+					break;
+
+				case JMP:
+					isSafe[i] = entry->addrMode == AddressMode::Absolu;
+					break;
+
+				case ASL: case LSR: case ROL: case ROR:
+					isSafe[i] = entry->addrMode == AddressMode::Accumu;
+					break;
+
+				default:
+					break;
+				}
+			}
+		}
+
+		bool isSafe[256];
+		bool readsMemory[256];
+	} g_idleLoopOpCodes;
+
 	FORCEINLINE uint16 GetPageAddress(uint16 address)
 	{
 		return (address & 0xFF00);
@@ -65,14 +129,25 @@ namespace
 Cpu::Cpu()
 	: m_cpuMemoryBus(nullptr)
 	, m_apu(nullptr)
+	, m_ppu(nullptr)
 	, m_opCodeEntry(nullptr)
+	, m_operands(0)
+	, m_instructionListener(nullptr)
+	, m_instructionTrace(nullptr)
+	, m_numIdleLoopSteps(0)
+	, m_idleLoopStep(0)
+	, m_idleLoopAttempts(0)
+	, m_idleLoopStart(0)
+	, m_idleLoopState(IdleLoopState::None)
+	, m_idleLoopSkipEnabled(true)
 {
 }
 
-void Cpu::Initialize(CpuMemoryBus& cpuMemoryBus, Apu& apu)
+void Cpu::Initialize(CpuMemoryBus& cpuMemoryBus, Apu& apu, Ppu& ppu)
 {
 	m_cpuMemoryBus = &cpuMemoryBus;
 	m_apu = &apu;
+	m_ppu = &ppu;
 
 	m_controllerPorts.Initialize();
 }
@@ -95,6 +170,13 @@ void Cpu::Reset()
 	m_pendingNmi = m_pendingIrq = false;
 
 	m_controllerPorts.Reset();
+
+	ResetIdleLoop();
+}
+
+void Cpu::OnCartridgeLoaded()
+{
+	m_instructionCache.Initialize(m_cpuMemoryBus->GetPrgBankIndices(), m_cpuMemoryBus->GetPrgMemorySize());
 }
 
 void Cpu::Serialize(class Serializer& serializer)
@@ -111,6 +193,17 @@ void Cpu::Serialize(class Serializer& serializer)
 	SERIALIZE(m_pendingIrq);
 	SERIALIZE(m_spriteDmaRegister);
 	serializer.SerializeObject(m_controllerPorts);
+
+	// Memory the loop and cached instructions depend on may differ in the loaded state
+	if (!serializer.IsSaving())
+	{
+		ResetIdleLoop();
+		m_instructionCache.InvalidateRam();
+
+		// Only loaded if writable (see Cartridge::Serialize), rare enough that flushing is fine
+		if (m_cpuMemoryBus->CanWritePrgMemory())
+			m_instructionCache.InvalidatePrg();
+	}
 }
 
 void Cpu::Nmi()
@@ -131,10 +224,91 @@ void Cpu::Irq()
 
 void Cpu::Execute(uint32& cpuCyclesElapsed)
 {
+	// Interpreting an instruction leaves the loop, e.g. if the caller doesn't use SkipIdleInstruction
+	if (m_idleLoopState == IdleLoopState::Idle)
+		ResetIdleLoop();
+
 	m_cycles = 0;
 	
 	ExecutePendingInterrupts(); // Handle when interrupts are called "between" CPU updates (e.g. PPU sends NMI)
 	
+	const uint16 interruptCycles = m_cycles;
+	const uint16 instructionPC = PC;
+
+	FetchInstruction();
+	UpdateOperandAddress();
+
+	if (m_instructionListener)
+		m_instructionListener->OnCpuInstruction(GetRegisters(), m_totalCycles + m_cycles);
+
+	if (m_instructionTrace)
+		RecordInstructionTrace();
+
+	if (m_idleLoopState == IdleLoopState::Recording)
+		PreIdleLoopInstruction();
+
+	Debugger::CheckBreakpoint(MemorySpace::Cpu, BreakpointFlag::Execute, PC);
+	Profiler::PreCpuInstruction();
+	ExecuteInstruction();
+	Profiler::PostCpuInstruction();
+	const uint16 instructionCycles = m_cycles - interruptCycles;
+	ExecutePendingInterrupts(); // Handle when instruction (memory read) causes interrupt
+
+	cpuCyclesElapsed = m_cycles;
+	m_totalCycles += m_cycles;
+
+#if IDLE_LOOP_SKIP_ENABLED
+	if (m_idleLoopSkipEnabled)
+		PostIdleLoopInstruction(instructionPC, instructionCycles, m_cycles != instructionCycles);
+#else
+	(void)instructionPC;
+	(void)instructionCycles;
+#endif
+}
+
+void Cpu::RecordInstructionTrace()
+{
+	InstructionTraceRecord& record = m_instructionTrace->Add();
+	record.cycle = m_totalCycles + m_cycles;
+	record.pc = PC;
+	record.operandAddress = m_operandAddress;
+	record.opCode = m_opCodeEntry->opCode;
+
+	// Immediate values aren't fetched until the instruction executes, so peek at them without going
+	// through the bus, which could have side-effects (or hit read breakpoints)
+	if (m_opCodeEntry->addrMode == AddressMode::Immedt)
+	{
+		const uint16 address = PC + 1;
+		const uint8* page = m_cpuMemoryBus->GetPagePtr(address);
+		record.operands[0] = page? page[address & 0xFF] : 0;
+		record.operands[1] = 0;
+	}
+	else
+	{
+		record.operands[0] = TO8(m_operands);
+		record.operands[1] = TO8(m_operands >> 8);
+	}
+
+	record.prgBank16k = PC >= CpuMemory::kPrgRomBase? static_cast<uint8>(m_cpuMemoryBus->GetPrgBankIndex16k(PC)) : InstructionTrace::kNoBank;
+	record.a = A;
+	record.x = X;
+	record.y = Y;
+	record.p = P.Value();
+	record.sp = SP;
+}
+
+void Cpu::FetchInstruction()
+{
+#if INSTRUCTION_CACHE_ENABLED
+	InstructionCache::Entry* entry = m_instructionCache.GetEntry(PC);
+	if (entry && *entry != 0)
+	{
+		m_opCodeEntry = g_opCodeTable[InstructionCache::GetOpCode(*entry)];
+		m_operands = InstructionCache::GetOperands(*entry);
+		return;
+	}
+#endif
+
 	const uint8 opCode = Read8(PC);
 	m_opCodeEntry = g_opCodeTable[opCode];
 
@@ -143,15 +317,149 @@ void Cpu::Execute(uint32& cpuCyclesElapsed)
 		FAIL("Unknown opcode");
 	}
 
-	UpdateOperandAddress();
+	// Immediate values are read when the instruction executes, so only read what addressing needs:
+	// reads have side-effects if PC is in I/O space
+	m_operands = 0;
+	if (m_opCodeEntry->numBytes == 3)
+		m_operands = Read16(PC + 1);
+	else if (m_opCodeEntry->numBytes == 2 && m_opCodeEntry->addrMode != AddressMode::Immedt)
+		m_operands = TO16(Read8(PC + 1));
+
+#if INSTRUCTION_CACHE_ENABLED
+	if (entry)
+		*entry = InstructionCache::MakeEntry(opCode, m_operands);
+#endif
+}
 
-	Debugger::PreCpuInstruction();
-	ExecuteInstruction();
-	ExecutePendingInterrupts(); // Handle when instruction (memory read) causes interrupt
-	Debugger::PostCpuInstruction();		
+CpuRegisters Cpu::GetRegisters() const
+{
+	CpuRegisters registers = { PC, SP, A, X, Y, P.Value() };
+	return registers;
+}
+
+void Cpu::SetIdleLoopSkipEnabled(bool enabled)
+{
+	m_idleLoopSkipEnabled = enabled;
+	ResetIdleLoop();
+}
+
+void Cpu::PreIdleLoopInstruction()
+{
+	const uint8 opCode = m_opCodeEntry->opCode;
+
+	if (m_numIdleLoopSteps == kMaxIdleLoopSteps || !g_idleLoopOpCodes.isSafe[opCode]
+		|| PC < m_idleLoopStart || PC - m_idleLoopStart >= kMaxIdleLoopBytes)
+	{
+		ResetIdleLoop();
+		return;
+	}
+
+	IdleLoopStep& step = m_idleLoopSteps[m_numIdleLoopSteps];
+	step.registers = GetRegisters();
+	step.readsPpuStatus = false;
+	step.ppuStatus = 0;
+
+	if (g_idleLoopOpCodes.readsMemory[opCode])
+	{
+		const uint16 address = m_operandAddress;
+		if (address == CpuMemory::kPpuStatusReg)
+		{
+			// Only if the read returns the same value without changing PPU state each iteration
+			if (!m_ppu->PeekStatusRead(step.ppuStatus))
+			{
+				ResetIdleLoop();
+				return;
+			}
+			step.readsPpuStatus = true;
+		}
+		else if (address >= CpuMemory::kPpuRegistersBase && address < CpuMemory::kSaveRamBase)
+		{
+			ResetIdleLoop(); // I/O or expansion
+		}
+	}
+}
+
+void Cpu::PostIdleLoopInstruction(uint16 instructionPC, uint16 instructionCycles, bool interrupted)
+{
+	if (m_idleLoopState == IdleLoopState::None)
+	{
+		// Polling loops end with a short backward branch or jump
+		if (PC < instructionPC && instructionPC - PC < kMaxIdleLoopBytes && !interrupted && !m_instructionListener)
+		{
+			m_idleLoopState = IdleLoopState::Recording;
+			m_idleLoopStart = PC;
+			m_numIdleLoopSteps = 0;
+			m_idleLoopAttempts = 0;
+		}
+		return;
+	}
+
+	// Recording (PreIdleLoopInstruction resets state if instruction isn't allowed)
+	if (interrupted || m_numIdleLoopSteps == kMaxIdleLoopSteps)
+	{
+		ResetIdleLoop();
+		return;
+	}
+
+	m_idleLoopSteps[m_numIdleLoopSteps++].cycles = instructionCycles;
+
+	if (PC != m_idleLoopStart)
+		return;
+
+	const CpuRegisters registers = GetRegisters();
+	const CpuRegisters& start = m_idleLoopSteps[0].registers;
+	if (registers.SP == start.SP && registers.A == start.A && registers.X == start.X && registers.Y == start.Y && registers.P == start.P)
+	{
+		m_idleLoopState = IdleLoopState::Idle;
+		m_idleLoopStep = 0;
+	}
+	else if (++m_idleLoopAttempts < kMaxIdleLoopAttempts)
+	{
+		m_numIdleLoopSteps = 0; // Registers may settle after the first iteration
+	}
+	else
+	{
+		ResetIdleLoop();
+	}
+}
+
+bool Cpu::SkipIdleLoopStep(uint32& cpuCyclesElapsed)
+{
+	const IdleLoopStep& step = m_idleLoopSteps[m_idleLoopStep];
 
+	uint8 ppuStatus;
+	if (m_pendingNmi || m_pendingIrq
+		|| (step.readsPpuStatus && (!m_ppu->PeekStatusRead(ppuStatus) || ppuStatus != step.ppuStatus)))
+	{
+		ResetIdleLoop();
+		return false;
+	}
+
+	m_cycles = step.cycles;
 	cpuCyclesElapsed = m_cycles;
 	m_totalCycles += m_cycles;
+
+	// Leave registers as they would be before the next instruction, e.g. for Irq() to test I
+	m_idleLoopStep = (m_idleLoopStep + 1) % m_numIdleLoopSteps;
+	const CpuRegisters& next = m_idleLoopSteps[m_idleLoopStep].registers;
+	PC = next.PC;
+	SP = next.SP;
+	A = next.A;
+	X = next.X;
+	Y = next.Y;
+	P.SetValue(next.P);
+	return true;
+}
+
+void Cpu::SetRegisters(const CpuRegisters& registers)
+{
+	PC = registers.PC;
+	SP = registers.SP;
+	A = registers.A;
+	X = registers.X;
+	Y = registers.Y;
+	P.SetValue(registers.P);
+	ResetIdleLoop();
 }
 
 uint8 Cpu::HandleCpuRead(uint16 cpuAddress)
@@ -182,30 +490,8 @@ void Cpu::HandleCpuWrite(uint16 cpuAddress, uint8 value)
 	switch (cpuAddress)
 	{
 	case CpuMemory::kSpriteDmaReg: // $4014
-		{
-			// Initiate a DMA transfer from the input page to sprite ram.
-
-			static auto SpriteDmaTransfer = [&] (uint16 cpuAddress)
-			{
-				for (uint16 i = 0; i < 256; ++i) //@TODO: Use constant for 256 (kSpriteMemorySize?)
-				{
-					const uint8 value = m_cpuMemoryBus->Read(cpuAddress + i);
-					m_cpuMemoryBus->Write(CpuMemory::kPpuSprRamIoReg, value);
-				}
-
-				// While DMA transfer occurs, the memory bus is in use, preventing CPU from fetching memory
-				m_cycles += 512;
-			};
-
-			m_spriteDmaRegister = value;
-			const uint16 srcCpuAddress = m_spriteDmaRegister * 0x100;
-
-			// Note: we perform the full DMA transfer right here instead of emulating the transfers over multiple frames.
-			// If we need to do it right, see http://wiki.nesdev.com/w/index.php/PPU_programmer_reference#DMA
-			SpriteDmaTransfer(srcCpuAddress);
-
-			return;
-		}
+		m_spriteDmaRegister = value;
+		SpriteDmaTransfer(m_spriteDmaRegister);
 		break;
 
 	case CpuMemory::kControllerPort1: // $4016
@@ -232,6 +518,10 @@ uint16 Cpu::Read16(uint16 address) const
 void Cpu::Write8(uint16 address, uint8 value)
 {
 	m_cpuMemoryBus->Write(address, value);
+
+#if INSTRUCTION_CACHE_ENABLED
+	m_instructionCache.OnCpuWrite(address);
+#endif
 }
 
 void Cpu::UpdateOperandAddress()
@@ -259,30 +549,30 @@ void Cpu::UpdateOperandAddress()
 			//@OPT: Lazily compute if branch condition succeeds
 
 			// For branch instructions, resolve the target address
-			const int8 offset = Read8(PC+1); // Signed offset in [-128,127]
+			const int8 offset = static_cast<int8>(m_operands); // Signed offset in [-128,127]
 			m_operandAddress = PC + m_opCodeEntry->numBytes + offset;
 		}
 		break;
 
 	case AddressMode::ZeroPg:
-		m_operandAddress = TO16(Read8(PC+1));
+		m_operandAddress = TO16(m_operands);
 		break;
 
 	case AddressMode::ZPIdxX:
-		m_operandAddress = TO16((Read8(PC+1) + X)) & 0x00FF; // Wrap around zero-page boundary
+		m_operandAddress = TO16((m_operands + X)) & 0x00FF; // Wrap around zero-page boundary
 		break;
 
 	case AddressMode::ZPIdxY:
-		m_operandAddress = TO16((Read8(PC+1) + Y)) & 0x00FF; // Wrap around zero-page boundary
+		m_operandAddress = TO16((m_operands + Y)) & 0x00FF; // Wrap around zero-page boundary
 		break;
 
 	case AddressMode::Absolu:
-		m_operandAddress = Read16(PC+1);
+		m_operandAddress = m_operands;
 		break;
 
 	case AddressMode::AbIdxX:
 		{
-			const uint16 baseAddress = Read16(PC+1);
+			const uint16 baseAddress = m_operands;
 			const uint16 basePage = GetPageAddress(baseAddress);
 			m_operandAddress = baseAddress + X;
 			m_operandReadCrossedPage = basePage != GetPageAddress(m_operandAddress);
@@ -291,7 +581,7 @@ void Cpu::UpdateOperandAddress()
 
 	case AddressMode::AbIdxY:
 		{
-			const uint16 baseAddress = Read16(PC+1);
+			const uint16 baseAddress = m_operands;
 			const uint16 basePage = GetPageAddress(baseAddress);
 			m_operandAddress = baseAddress + Y;
 			m_operandReadCrossedPage = basePage != GetPageAddress(m_operandAddress);
@@ -300,7 +590,7 @@ void Cpu::UpdateOperandAddress()
 
 	case AddressMode::Indrct: // for JMP only
 		{
-			uint16 low = Read16(PC+1);
+			uint16 low = m_operands;
 
 			// Handle the 6502 bug for when the low-byte of the effective address is FF,
 			// in which case the 2nd byte read does not correctly cross page boundaries.
@@ -313,7 +603,7 @@ void Cpu::UpdateOperandAddress()
 
 	case AddressMode::IdxInd:
 		{
-			uint16 low = TO16((Read8(PC+1) + X)) & 0x00FF; // Zero page low byte of operand address, wrap around zero page
+			uint16 low = TO16((m_operands + X)) & 0x00FF; // Zero page low byte of operand address, wrap around zero page
 			uint16 high = TO16(low + 1) & 0x00FF; // Wrap high byte around zero page
 			m_operandAddress = TO16(Read8(low)) | TO16(Read8(high)) << 8;
 		}
@@ -321,7 +611,7 @@ void Cpu::UpdateOperandAddress()
 
 	case AddressMode::IndIdx:
 		{
-			const uint16 low = TO16(Read8(PC+1)); // Zero page low byte of operand address
+			const uint16 low = TO16(m_operands); // Zero page low byte of operand address
 			const uint16 high = TO16(low + 1) & 0x00FF; // Wrap high byte around zero page
 			const uint16 baseAddress = (TO16(Read8(low)) | TO16(Read8(high)) << 8);
 			const uint16 basePage = GetPageAddress(baseAddress);
@@ -786,6 +1076,7 @@ void Cpu::ExecutePendingInterrupts()
 		m_cycles += kInterruptCycles * 2;
 		
 		m_pendingNmi = false;
+		Profiler::CpuInterrupt(true);
 	}
 	else if (m_pendingIrq)
 	{
@@ -796,7 +1087,44 @@ void Cpu::ExecutePendingInterrupts()
 		PC = Read16(CpuMemory::kIrqVector);
 		m_cycles += kInterruptCycles;
 		m_pendingIrq = false;
+		Profiler::CpuInterrupt(false);
+	}
+}
+
+void Cpu::SpriteDmaTransfer(uint8 page)
+{
+	// See http://wiki.nesdev.com/w/index.php/PPU_registers#OAMDMA
+
+	const uint16 srcCpuAddress = TO16(page) << 8;
+
+	// The CPU is halted for the whole transfer, so nothing can observe the intermediate state; we can
+	// copy the page in one go. Most games DMA from internal RAM, for which we can read the page directly.
+#if DIRECT_SPRITE_DMA_ENABLED
+	const uint8* srcPage = m_cpuMemoryBus->GetPagePtr(srcCpuAddress);
+#else
+	const uint8* srcPage = nullptr;
+#endif
+	if (srcPage)
+	{
+		m_ppu->OamDmaTransfer(srcPage);
+	}
+	else
+	{
+		// Page is (at least partly) memory-mapped registers, so go through the bus for side-effects (and
+		// read breakpoints when debugging)
+		uint8 srcBuffer[Ppu::kSpriteMemorySize];
+		for (uint16 i = 0; i < Ppu::kSpriteMemorySize; ++i)
+		{
+			srcBuffer[i] = m_cpuMemoryBus->Read(srcCpuAddress + i);
+		}
+		m_ppu->OamDmaTransfer(srcBuffer);
 	}
+
+	// The $4014 write happens on the last cycle of the instruction. DMA then takes 1 dummy cycle, plus 1
+	// more to align when starting on an odd CPU cycle, followed by 256 alternating read/write cycles.
+	const uint64 dmaStartCycle = m_totalCycles + m_cycles + m_opCodeEntry->numCycles;
+	const uint16 alignCycles = (dmaStartCycle & 1) ? 1 : 0;
+	m_cycles += static_cast<uint16>(1 + alignCycles + Ppu::kSpriteMemorySize * 2);
 }
 
 uint8 Cpu::GetAccumOrMemValue() const
@@ -3,9 +3,12 @@
 #include "Base.h"
 #include "Bitfield.h"
 #include "ControllerPorts.h"
+#include "InstructionCache.h"
 
 class CpuMemoryBus;
 class Apu;
+class Ppu;
+class InstructionTrace;
 struct OpCodeEntry;
 
 namespace StatusFlag
@@ -23,31 +26,83 @@ namespace StatusFlag
 	};
 }
 
+// Snapshot of CPU registers, e.g. for tracing
+struct CpuRegisters
+{
+	uint16 PC;
+	uint8 SP;
+	uint8 A;
+	uint8 X;
+	uint8 Y;
+	uint8 P;
+};
+
+// Notified before each instruction executes, after any pending interrupt has been serviced
+class CpuInstructionListener
+{
+public:
+	virtual ~CpuInstructionListener() {}
+	virtual void OnCpuInstruction(const CpuRegisters& registers, uint64 totalCycles) = 0;
+};
+
 class Cpu
 {
 public:
 	Cpu();
-	void Initialize(CpuMemoryBus& cpuMemoryBus, Apu& apu);
+	void Initialize(CpuMemoryBus& cpuMemoryBus, Apu& apu, Ppu& ppu);
 
 	void Reset();
 	void Serialize(class Serializer& serializer);
 
+	// Cached instructions refer to the cartridge's mapper, so call whenever a rom is loaded
+	void OnCartridgeLoaded();
+
 	void Nmi();
 	void Irq();
 
+	// Drops interrupts signaled while the CPU isn't executed, e.g. when clocking the PPU on its own
+	void ClearPendingInterrupts() { m_pendingNmi = m_pendingIrq = false; }
+
 	void Execute(uint32& cpuCyclesElapsed);
 
+	// If the CPU is spinning in an idle loop, advances it by one instruction without interpreting it
+	// and returns true. Returns false once the loop could observe a change (interrupt, PPU status),
+	// in which case Execute must be called instead.
+	FORCEINLINE bool SkipIdleInstruction(uint32& cpuCyclesElapsed)
+	{
+		return m_idleLoopState == IdleLoopState::Idle && SkipIdleLoopStep(cpuCyclesElapsed);
+	}
+
+	// Enabled by default. Skipped instructions are not passed to the instruction trace or profiler,
+	// and idle loops are never skipped while an instruction listener is set or in debugging builds.
+	void SetIdleLoopSkipEnabled(bool enabled);
+
 	uint8 HandleCpuRead(uint16 cpuAddress);
 	void HandleCpuWrite(uint16 cpuAddress, uint8 value);
 
+	void SetInputSource(InputSource* inputSource) { m_controllerPorts.SetInputSource(inputSource); }
+
+	CpuRegisters GetRegisters() const;
+	void SetRegisters(const CpuRegisters& registers);
+
+	// Set to nullptr to stop listening
+	void SetInstructionListener(CpuInstructionListener* listener) { m_instructionListener = listener; }
+
+	// Set to record every instruction into trace; nullptr to stop
+	void SetInstructionTrace(InstructionTrace* trace) { m_instructionTrace = trace; }
+
 private:
 	friend class DebuggerImpl;
+	friend class ProfilerImpl;
 
 	uint8 Read8(uint16 address) const;
 	uint16 Read16(uint16 address) const;
 	void Write8(uint16 address, uint8 value);
 
-	// Updates m_operandAddress for current instruction based on addressing mode. Operand data is assumed to be at PC + 1 if it exists.
+	// Sets m_opCodeEntry and m_operands for the instruction at PC, from m_instructionCache if possible
+	void FetchInstruction();
+
+	// Updates m_operandAddress for current instruction based on addressing mode, from m_operands
 	void UpdateOperandAddress();
 
 	// Executes current instruction and updates PC
@@ -56,6 +111,21 @@ private:
 	// Executes pending interrupts (if any)
 	void ExecutePendingInterrupts();
 
+	// Copies the input page to sprite memory (OAM DMA) and stalls the CPU for the duration of the transfer
+	void SpriteDmaTransfer(uint8 page);
+
+	// Adds the current instruction to m_instructionTrace
+	void RecordInstructionTrace();
+
+	// Idle loop detection: after a short backward branch or jump, instructions are recorded until PC
+	// returns to the loop start. If the registers are then unchanged and the loop only read memory
+	// that can't change while it runs (RAM, ROM, $2002), the loop is in a fixed point that only an
+	// interrupt or a PPU status change can break, so it can be replayed without being interpreted.
+	void PreIdleLoopInstruction();
+	void PostIdleLoopInstruction(uint16 instructionPC, uint16 instructionCycles, bool interrupted);
+	bool SkipIdleLoopStep(uint32& cpuCyclesElapsed);
+	void ResetIdleLoop() { m_idleLoopState = IdleLoopState::None; }
+
 	// For instructions that work on accumulator (A) or memory location
 	uint8 GetAccumOrMemValue() const;
 	void SetAccumOrMemValue(uint8 value);
@@ -79,7 +149,10 @@ private:
 
 	CpuMemoryBus* m_cpuMemoryBus;
 	Apu* m_apu;
+	Ppu* m_ppu;
 	OpCodeEntry* m_opCodeEntry; // Current opcode entry
+	uint16 m_operands; // Current operand bytes (little endian), except immediate values which are read on execute
+	InstructionCache m_instructionCache;
 	
 	// Registers - not using the usual m_ prefix because I find the code looks
 	// more straightforward when using the typical register names
@@ -103,4 +176,30 @@ private:
 	uint8 m_spriteDmaRegister; // $4014
 
 	ControllerPorts m_controllerPorts;
+
+	CpuInstructionListener* m_instructionListener;
+	InstructionTrace* m_instructionTrace;
+
+	struct IdleLoopState
+	{
+		enum Type : uint8 { None, Recording, Idle };
+	};
+
+	struct IdleLoopStep
+	{
+		CpuRegisters registers; // Before the instruction
+		uint16 cycles;
+		bool readsPpuStatus;
+		uint8 ppuStatus; // Value read from $2002 if readsPpuStatus
+	};
+
+	static const size_t kMaxIdleLoopSteps = 8;
+
+	IdleLoopStep m_idleLoopSteps[kMaxIdleLoopSteps];
+	size_t m_numIdleLoopSteps;
+	size_t m_idleLoopStep; // Next step to skip when idle
+	size_t m_idleLoopAttempts; // Iterations recorded without reaching a fixed point
+	uint16 m_idleLoopStart;
+	IdleLoopState::Type m_idleLoopState;
+	bool m_idleLoopSkipEnabled;
 };
@@ -2,19 +2,33 @@
 #include "Memory.h"
 #include "MemoryMap.h"
 #include "Serializer.h"
+#include "DirtyPageHash.h"
 
 class CpuInternalRam
 {
 public:
-	void Initialize()										{ m_memory.Initialize(); }
+	void Initialize()
+	{
+		m_memory.Initialize();
+		m_dirtyPages.Initialize(m_memory.Size());
+	}
 
 	void Serialize(class Serializer& serializer)
 	{
-		SERIALIZE(m_memory);
+		SERIALIZE_TRACKED(m_memory, m_dirtyPages);
 	}
 
 	uint8 HandleCpuRead(uint16 cpuAddress)					{ return m_memory.Read(MapCpuToInternalRam(cpuAddress)); }
-	void HandleCpuWrite(uint16 cpuAddress, uint8 value)		{ m_memory.Write(MapCpuToInternalRam(cpuAddress), value); }
+
+	void HandleCpuWrite(uint16 cpuAddress, uint8 value)
+	{
+		const uint16 address = MapCpuToInternalRam(cpuAddress);
+		m_memory.Write(address, value);
+		m_dirtyPages.MarkDirty(address);
+	}
+
+	const uint8* GetCpuPagePtr(uint16 cpuAddress)			{ return m_memory.RawPtr(MapCpuToInternalRam(cpuAddress & 0xFF00)); }
+	const uint8* GetRam() const								{ return m_memory.Begin(); } // CpuMemory::kInternalRamSize bytes
 
 private:
 	uint16 MapCpuToInternalRam(uint16 cpuAddress)
@@ -24,4 +38,5 @@ private:
 	}
 
 	Memory<FixedSizeStorage<KB(2)>> m_memory;
+	DirtyPageHash m_dirtyPages;
 };
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Base.h"
+#include "Breakpoints.h"
 
 // If set, debugging features are enabled for the emulator (slower)
 #define DEBUGGING_ENABLED 0
@@ -14,16 +15,31 @@ namespace Debugger
 	void Shutdown();
 	void Update();
 	void DumpMemory();
-	void PreCpuInstruction();
-	void PostCpuInstruction();
 	bool IsExecuting();
+
+	void AddBreakpoint(MemorySpace::Type space, uint16 address, uint8 flags, BreakpointCondition condition = BreakpointCondition());
+	void RemoveBreakpoint(MemorySpace::Type space, uint16 address, uint8 flags);
+
+	namespace Internal
+	{
+		extern BreakpointTable g_breakpoints;
+		void OnBreakpointHit(MemorySpace::Type space, BreakpointFlag::Type access, uint16 address);
+	}
+
+	// Called on every memory access, so only the bit test is inlined
+	FORCEINLINE void CheckBreakpoint(MemorySpace::Type space, BreakpointFlag::Type access, uint16 address)
+	{
+		if (Internal::g_breakpoints.Test(space, access, address))
+			Internal::OnBreakpointHit(space, access, address);
+	}
 #else
 	FORCEINLINE void Initialize(Nes&) {}
 	void Shutdown(); // Requires definition (cpp) because of FailHandler
 	FORCEINLINE void Update() {};
 	FORCEINLINE void DumpMemory() {}
-	FORCEINLINE void PreCpuInstruction() {}
-	FORCEINLINE void PostCpuInstruction() {}
 	FORCEINLINE bool IsExecuting() { return false; }
+	FORCEINLINE void AddBreakpoint(MemorySpace::Type, uint16, uint8, BreakpointCondition = BreakpointCondition()) {}
+	FORCEINLINE void RemoveBreakpoint(MemorySpace::Type, uint16, uint8) {}
+	FORCEINLINE void CheckBreakpoint(MemorySpace::Type, BreakpointFlag::Type, uint16) {}
 #endif
 }
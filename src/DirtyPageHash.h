@@ -0,0 +1,67 @@
+#pragma once
+
+#include "Base.h"
+#include "Hash.h"
+#include <vector>
+
+// Hash of a memory region maintained incrementally: writes mark the 256 byte pages they touch dirty,
+// and GetHash rehashes only those. Page hashes are seeded with their index and combined with xor, so
+// that updating one page doesn't touch the others.
+class DirtyPageHash
+{
+public:
+	static const size_t kPageSize = 256;
+
+	DirtyPageHash() : m_hash(0) {}
+
+	// Size must be a multiple of kPageSize. All pages start dirty.
+	void Initialize(size_t size)
+	{
+		assert(size % kPageSize == 0);
+		m_pageHashes.assign(size / kPageSize, 0);
+		m_dirtyBits.assign((m_pageHashes.size() + 63) / 64, 0);
+		m_hash = 0;
+		MarkAllDirty();
+	}
+
+	size_t Size() const { return m_pageHashes.size() * kPageSize; }
+
+	FORCEINLINE void MarkDirty(size_t offset)
+	{
+		assert(offset < Size());
+		const size_t page = offset / kPageSize;
+		m_dirtyBits[page / 64] |= 1ull << (page % 64);
+	}
+
+	// For writes that bypass MarkDirty, e.g. loading a state
+	void MarkAllDirty()
+	{
+		for (size_t page = 0; page < m_pageHashes.size(); ++page)
+			m_dirtyBits[page / 64] |= 1ull << (page % 64);
+	}
+
+	// Memory is the region of Size() bytes being tracked
+	uint64 GetHash(const uint8* memory)
+	{
+		for (size_t word = 0; word < m_dirtyBits.size(); ++word)
+		{
+			size_t page = word * 64;
+			for (uint64 bits = m_dirtyBits[word]; bits != 0; bits >>= 1, ++page)
+			{
+				if (bits & 1)
+				{
+					const uint64 pageHash = HashBlocks64(memory + page * kPageSize, kPageSize, page);
+					m_hash ^= m_pageHashes[page] ^ pageHash;
+					m_pageHashes[page] = pageHash;
+				}
+			}
+			m_dirtyBits[word] = 0;
+		}
+		return m_hash;
+	}
+
+private:
+	std::vector<uint64> m_pageHashes;
+	std::vector<uint64> m_dirtyBits; // Bit N of word W is page W * 64 + N
+	uint64 m_hash; // Xor of m_pageHashes
+};
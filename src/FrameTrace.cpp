@@ -0,0 +1,236 @@
+#include "FrameTrace.h"
+
+#if FRAME_TRACING_ENABLED
+
+#include "System.h"
+#include "Stream.h"
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#define WRITE_CHROME_TRACE 1
+
+namespace
+{
+	using namespace FrameTrace;
+
+	typedef std::chrono::duration<uint64, std::nano> Nanoseconds;
+
+	uint64 ElapsedNs(const Tick& from, const Tick& to)
+	{
+		return std::chrono::duration_cast<Nanoseconds>(to - from).count();
+	}
+
+	// Fixed-size histogram of durations, so we can keep stats for arbitrarily long sessions
+	class Histogram
+	{
+	public:
+		Histogram() : m_count(0), m_maxNs(0)
+		{
+			std::fill(std::begin(m_buckets), std::end(m_buckets), 0);
+		}
+
+		void Add(uint64 ns)
+		{
+			const size_t index = std::min(static_cast<size_t>(ns / kBucketSizeNs), kNumBuckets - 1);
+			++m_buckets[index];
+			++m_count;
+			m_maxNs = std::max(m_maxNs, ns);
+		}
+
+		float64 GetPercentileMs(float64 percentile) const
+		{
+			if (m_count == 0)
+				return 0.0;
+
+			const uint64 target = static_cast<uint64>(percentile * (m_count - 1));
+			uint64 accum = 0;
+			for (size_t i = 0; i < kNumBuckets - 1; ++i)
+			{
+				accum += m_buckets[i];
+				if (accum > target)
+					return std::min(static_cast<uint64>(i + 1) * kBucketSizeNs, m_maxNs) / 1000000.0; // Upper bound of bucket
+			}
+			return GetMaxMs(); // Overflow bucket
+		}
+
+		float64 GetMaxMs() const { return m_maxNs / 1000000.0; }
+		uint64 GetCount() const { return m_count; }
+
+	private:
+		static const uint64 kBucketSizeNs = 10 * 1000;
+		static const size_t kNumBuckets = 10000 + 1; // Up to 100 ms, plus overflow
+
+		uint32 m_buckets[kNumBuckets];
+		uint64 m_count;
+		uint64 m_maxNs;
+	};
+
+	struct FrameRecord
+	{
+		uint64 startNs;
+		uint64 durationNs;
+		uint64 sectionNs[Section::NumTypes];
+	};
+
+	struct SectionEvent
+	{
+		Section::Type section;
+		uint64 startNs;
+		uint64 durationNs;
+	};
+
+	const size_t kMaxTraceFrames = 60 * 60 * 5; // Keep trace files to a manageable size (5 minutes at 60 FPS)
+	const size_t kMaxTraceEvents = kMaxTraceFrames * 8;
+
+	bool g_firstFrame = true;
+	Tick g_traceStart;
+	Tick g_frameStart;
+	uint64 g_frameSectionNs[Section::NumTypes];
+
+	Histogram g_sectionHistograms[Section::NumTypes];
+	Histogram g_frameHistogram;
+	Histogram g_workHistogram; // Frame time minus throttling
+
+	std::vector<FrameRecord> g_frameRecords;
+	std::vector<SectionEvent> g_sectionEvents;
+}
+
+namespace FrameTrace
+{
+	void Shutdown()
+	{
+		if (g_frameHistogram.GetCount() == 0)
+			return;
+
+		PrintStats();
+
+	#if WRITE_CHROME_TRACE
+		const std::string& traceFile = System::GetAppDirectory() + std::string("frametrace.json");
+		WriteChromeTrace(traceFile.c_str());
+	#endif
+	}
+
+	void BeginFrame()
+	{
+		g_frameStart = Now();
+		if (g_firstFrame)
+		{
+			g_traceStart = g_frameStart;
+			g_firstFrame = false;
+		}
+
+		std::fill(std::begin(g_frameSectionNs), std::end(g_frameSectionNs), 0);
+	}
+
+	void EndFrame()
+	{
+		const uint64 frameNs = ElapsedNs(g_frameStart, Now());
+
+		g_frameHistogram.Add(frameNs);
+		g_workHistogram.Add(frameNs - std::min(frameNs, g_frameSectionNs[Section::Throttle]));
+		for (size_t i = 0; i < Section::NumTypes; ++i)
+		{
+			g_sectionHistograms[i].Add(g_frameSectionNs[i]);
+		}
+
+	#if WRITE_CHROME_TRACE
+		if (g_frameRecords.size() < kMaxTraceFrames)
+		{
+			FrameRecord record;
+			record.startNs = ElapsedNs(g_traceStart, g_frameStart);
+			record.durationNs = frameNs;
+			std::copy(std::begin(g_frameSectionNs), std::end(g_frameSectionNs), std::begin(record.sectionNs));
+			g_frameRecords.push_back(record);
+		}
+	#endif
+	}
+
+	void Accumulate(Section::Type section, Tick& start)
+	{
+		const Tick now = Now();
+		g_frameSectionNs[section] += ElapsedNs(start, now);
+		start = now;
+	}
+
+	ScopedSection::ScopedSection(Section::Type section)
+		: m_section(section)
+		, m_start(Now())
+	{
+	}
+
+	ScopedSection::~ScopedSection()
+	{
+		const uint64 durationNs = ElapsedNs(m_start, Now());
+		g_frameSectionNs[m_section] += durationNs;
+
+	#if WRITE_CHROME_TRACE
+		if (g_sectionEvents.size() < kMaxTraceEvents && !g_firstFrame)
+		{
+			SectionEvent event = { m_section, ElapsedNs(g_traceStart, m_start), durationNs };
+			g_sectionEvents.push_back(event);
+		}
+	#endif
+	}
+
+	void PrintStats()
+	{
+		printf("[Frame Trace: %llu frames]\n", g_frameHistogram.GetCount());
+		printf("  %-10s %10s %10s %10s\n", "Section", "p50 (ms)", "p99 (ms)", "max (ms)");
+
+		auto printRow = [] (const char* name, const Histogram& histogram)
+		{
+			printf("  %-10s %10.3f %10.3f %10.3f\n", name,
+				histogram.GetPercentileMs(0.50), histogram.GetPercentileMs(0.99), histogram.GetMaxMs());
+		};
+
+		for (size_t i = 0; i < Section::NumTypes; ++i)
+		{
+			printRow(Section::String[i], g_sectionHistograms[i]);
+		}
+		printRow("Work", g_workHistogram);
+		printRow("Frame", g_frameHistogram);
+	}
+
+	// See "Trace Event Format" document for details
+	void WriteChromeTrace(const char* file)
+	{
+		FileStream fs;
+		if (!fs.Open(file, "w"))
+		{
+			printf("Failed to open frame trace file: %s\n", file);
+			return;
+		}
+
+		auto toUs = [] (uint64 ns) { return ns / 1000.0; };
+
+		fs.Printf("{\"traceEvents\":[\n");
+		fs.Printf("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"%s\"}}", APP_NAME);
+
+		for (const auto& record : g_frameRecords)
+		{
+			fs.Printf(",\n{\"name\":\"Frame\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+				toUs(record.startNs), toUs(record.durationNs));
+			for (size_t i = 0; i < Section::NumTypes; ++i)
+			{
+				fs.Printf("%s\"%s\":%.3f", i > 0? "," : "", Section::String[i], toUs(record.sectionNs[i]));
+			}
+			fs.Printf("}}");
+
+			// CPU, PPU and APU are interleaved every instruction, so they're reported as per-frame counters
+			fs.Printf(",\n{\"name\":\"Emulation (us)\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"Cpu\":%.3f,\"Ppu\":%.3f,\"Apu\":%.3f}}",
+				toUs(record.startNs), toUs(record.sectionNs[Section::Cpu]), toUs(record.sectionNs[Section::Ppu]), toUs(record.sectionNs[Section::Apu]));
+		}
+
+		for (const auto& event : g_sectionEvents)
+		{
+			fs.Printf(",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":2,\"ts\":%.3f,\"dur\":%.3f}",
+				Section::String[event.section], toUs(event.startNs), toUs(event.durationNs));
+		}
+
+		fs.Printf("\n]}\n");
+		printf("Wrote frame trace: %s\n", file);
+	}
+}
+
+#endif // FRAME_TRACING_ENABLED
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "Base.h"
+
+// If set, host time spent per frame in each emulator subsystem is recorded. Percentiles are printed
+// on shutdown, and a Chrome trace (chrome://tracing, Perfetto) is written to the app directory.
+#define FRAME_TRACING_ENABLED 0
+
+#if FRAME_TRACING_ENABLED
+#include <chrono>
+#endif
+
+namespace FrameTrace
+{
+	namespace Section
+	{
+		enum Type
+		{
+			Cpu,
+			Ppu,
+			Apu,
+			Rewind, // Rewind state capture or restore
+			RunAhead, // Run-ahead state capture and restore, hidden frames count as Cpu/Ppu/Apu
+			SaveRam, // Periodic SRAM autosave
+			Present,
+			Throttle, // FrameTimer waiting to hit target frame rate
+
+			NumTypes
+		};
+
+		static const char* String[] =
+		{
+			"Cpu", "Ppu", "Apu", "Rewind", "RunAhead", "SaveRam", "Present", "Throttle"
+		};
+
+		static_assert(NumTypes == ARRAYSIZE(String), "Size mismatch");
+	}
+
+#if FRAME_TRACING_ENABLED
+	typedef std::chrono::steady_clock::time_point Tick;
+
+	FORCEINLINE Tick Now() { return std::chrono::steady_clock::now(); }
+
+	void Shutdown();
+	void BeginFrame();
+	void EndFrame();
+
+	// Adds time elapsed since 'start' to section, and resets 'start' to now. Use this for sections that
+	// are interleaved with each other (CPU, PPU, APU), and ScopedSection for the others.
+	void Accumulate(Section::Type section, Tick& start);
+
+	void PrintStats();
+	void WriteChromeTrace(const char* file);
+
+	class ScopedSection
+	{
+	public:
+		ScopedSection(Section::Type section);
+		~ScopedSection();
+
+	private:
+		Section::Type m_section;
+		Tick m_start;
+	};
+#else
+	struct Tick {};
+
+	FORCEINLINE Tick Now() { return Tick(); }
+	FORCEINLINE void Shutdown() {}
+	FORCEINLINE void BeginFrame() {}
+	FORCEINLINE void EndFrame() {}
+	FORCEINLINE void Accumulate(Section::Type, Tick&) {}
+	FORCEINLINE void PrintStats() {}
+	FORCEINLINE void WriteChromeTrace(const char*) {}
+
+	class ScopedSection
+	{
+	public:
+		FORCEINLINE ScopedSection(Section::Type) {}
+	};
+#endif
+}
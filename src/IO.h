@@ -66,7 +66,8 @@ namespace IO
 		{
 			if (path1.empty()) return path2;
 			if (path2.empty()) return path1;
-			return path1 + DirectorySeparatorChar + path2;
+			if (path1.find_last_of(DirectorySeparatorChars) == path1.size() - 1) return path1 + path2;
+			return path1 + AltDirectorySeparatorChar + path2; // Understood on all platforms
 		}
 
 		inline string ChangeExtension(const string& path, const string& extension)
@@ -0,0 +1,103 @@
+#pragma once
+
+#include "Base.h"
+#include "MemoryMap.h"
+#include "Mapper.h"
+#include <vector>
+#include <algorithm>
+
+// Opcode and operand bytes of instructions fetched from internal RAM or PRG-ROM, so that executing
+// them again doesn't go through the bus. PRG-ROM entries are keyed by the cartridge bank mapped at the
+// time of the fetch, so a bank switch selects other entries rather than flushing the cache. Entries
+// are invalidated when the CPU writes to any of their bytes (RAM-resident code, writable PRG).
+class InstructionCache
+{
+public:
+	// An entry is the opcode in bits 0-7 and the operand bytes in bits 8-23, or 0 if not cached
+	typedef uint32 Entry;
+
+	static const uint8 kMaxInstructionBytes = 3;
+
+	InstructionCache()
+		: m_prgBankIndices(nullptr)
+	{
+	}
+
+	// prgBankIndices must remain valid until the next Initialize (see Mapper::GetPrgBankIndices)
+	void Initialize(const size_t* prgBankIndices, size_t prgMemorySize)
+	{
+		m_prgBankIndices = prgBankIndices;
+		m_prgEntries.assign(prgMemorySize, 0);
+		InvalidateRam();
+	}
+
+	// Call when RAM is modified other than by CPU writes, e.g. when loading state
+	void InvalidateRam()
+	{
+		std::fill(std::begin(m_ramEntries), std::end(m_ramEntries), 0);
+	}
+
+	// Same for writable PRG memory. Entries are keyed by bank index only, so they'd otherwise hold
+	// instructions of the previous contents.
+	void InvalidatePrg()
+	{
+		std::fill(m_prgEntries.begin(), m_prgEntries.end(), 0);
+	}
+
+	// Returns the entry for the instruction at cpuAddress, or nullptr if instructions there can't be
+	// cached: I/O, save RAM, or the operand bytes may be in another (RAM mirror or PRG) bank.
+	FORCEINLINE Entry* GetEntry(uint16 cpuAddress)
+	{
+		if (cpuAddress >= CpuMemory::kPrgRomBase)
+		{
+			const size_t offset = cpuAddress & (kPrgBankSize - 1);
+			if (offset > kPrgBankSize - kMaxInstructionBytes)
+				return nullptr;
+
+			return &m_prgEntries[MapPrgAddress(cpuAddress)];
+		}
+		else if (cpuAddress <= CpuMemory::kInternalRamEnd - kMaxInstructionBytes)
+		{
+			return &m_ramEntries[cpuAddress & (CpuMemory::kInternalRamSize - 1)];
+		}
+		return nullptr;
+	}
+
+	// Invalidates every entry that includes the byte at cpuAddress. Must be called after the write
+	// reaches the bus, as a PRG write goes to the bank mapped after the mapper has seen it.
+	FORCEINLINE void OnCpuWrite(uint16 cpuAddress)
+	{
+		if (cpuAddress < CpuMemory::kInternalRamEnd)
+		{
+			// RAM mirrors wrap, so instructions ending in the next mirror are found too
+			for (uint16 i = 0; i < kMaxInstructionBytes; ++i)
+				m_ramEntries[(cpuAddress - i) & (CpuMemory::kInternalRamSize - 1)] = 0;
+		}
+		else if (cpuAddress >= CpuMemory::kPrgRomBase)
+		{
+			for (uint16 i = 0; i < kMaxInstructionBytes && cpuAddress - i >= CpuMemory::kPrgRomBase; ++i)
+				m_prgEntries[MapPrgAddress(cpuAddress - i)] = 0;
+		}
+	}
+
+	FORCEINLINE static Entry MakeEntry(uint8 opCode, uint16 operands)
+	{
+		return kValidBit | (static_cast<uint32>(operands) << 8) | opCode;
+	}
+
+	FORCEINLINE static uint8 GetOpCode(Entry entry) { return static_cast<uint8>(entry); }
+	FORCEINLINE static uint16 GetOperands(Entry entry) { return static_cast<uint16>(entry >> 8); }
+
+private:
+	static const Entry kValidBit = BIT(24);
+
+	FORCEINLINE size_t MapPrgAddress(uint16 cpuAddress) const
+	{
+		const size_t bankIndex = (cpuAddress - CpuMemory::kPrgRomBase) / kPrgBankSize;
+		return m_prgBankIndices[bankIndex] * kPrgBankSize + (cpuAddress & (kPrgBankSize - 1));
+	}
+
+	const size_t* m_prgBankIndices;
+	std::vector<Entry> m_prgEntries;
+	Entry m_ramEntries[CpuMemory::kInternalRamSize];
+};
@@ -0,0 +1,173 @@
+#include "InstructionTrace.h"
+#include "OpCodeTable.h"
+#include "Stream.h"
+#include <algorithm>
+#include <cctype>
+
+namespace
+{
+	// File layout (little endian):
+	//  Header
+	//  InstructionTraceRecord records[header.numRecords] (oldest first)
+	struct TraceFileHeader
+	{
+		char magic[4];
+		uint32 version;
+		uint32 recordSize;
+		uint32 numRecords;
+		uint64 numRecorded;
+	};
+
+	const char kTraceFileMagic[4] = { 'N', 'E', 'S', 'T' };
+	const uint32 kTraceFileVersion = 1;
+
+	size_t RoundUpToPowerOf2(size_t value)
+	{
+		size_t result = 1;
+		while (result < value)
+			result <<= 1;
+		return result;
+	}
+}
+
+InstructionTrace::InstructionTrace()
+	: m_mask(0)
+	, m_numRecorded(0)
+{
+}
+
+void InstructionTrace::Initialize(size_t numRecords)
+{
+	if (numRecords == 0)
+		std::vector<InstructionTraceRecord>().swap(m_records);
+	else
+		m_records.resize(RoundUpToPowerOf2(numRecords));
+
+	m_mask = m_records.empty()? 0 : m_records.size() - 1;
+	Clear();
+}
+
+size_t InstructionTrace::GetNumRecords() const
+{
+	return static_cast<size_t>(std::min<uint64>(m_numRecorded, m_records.size()));
+}
+
+const InstructionTraceRecord& InstructionTrace::GetRecord(size_t index) const
+{
+	assert(index < GetNumRecords());
+	const uint64 oldest = m_numRecorded - GetNumRecords();
+	return m_records[static_cast<size_t>(oldest + index) & m_mask];
+}
+
+bool InstructionTrace::Save(const char* file) const
+{
+	FileStream fs;
+	if (!fs.Open(file, "wb"))
+	{
+		printf("Failed to open trace file for save: %s\n", file);
+		return false;
+	}
+
+	const size_t numRecords = GetNumRecords();
+
+	TraceFileHeader header = {};
+	std::copy(std::begin(kTraceFileMagic), std::end(kTraceFileMagic), header.magic);
+	header.version = kTraceFileVersion;
+	header.recordSize = sizeof(InstructionTraceRecord);
+	header.numRecords = static_cast<uint32>(numRecords);
+	header.numRecorded = m_numRecorded;
+	fs.WriteValue(header);
+
+	// At most two contiguous runs: from the oldest record to the end of the ring, then from the start
+	const size_t first = static_cast<size_t>(m_numRecorded - numRecords) & m_mask;
+	const size_t firstCount = std::min(numRecords, m_records.size() - first);
+	if (firstCount > 0)
+		fs.Write(&m_records[first], firstCount);
+	if (numRecords > firstCount)
+		fs.Write(&m_records[0], numRecords - firstCount);
+
+	printf("Saved instruction trace: %s (%d instructions)\n", file, static_cast<int32>(numRecords));
+	return true;
+}
+
+bool InstructionTrace::Load(const char* file)
+{
+	FileStream fs;
+	if (!fs.Open(file, "rb"))
+	{
+		printf("Failed to open trace file for load: %s\n", file);
+		return false;
+	}
+
+	TraceFileHeader header;
+	if (fs.ReadValue(header) != 1
+		|| !std::equal(std::begin(kTraceFileMagic), std::end(kTraceFileMagic), header.magic)
+		|| header.version != kTraceFileVersion
+		|| header.recordSize != sizeof(InstructionTraceRecord))
+	{
+		printf("Invalid trace file: %s\n", file);
+		return false;
+	}
+
+	// Read as bytes as IStream::Read checks the byte count against fread's element count
+	Initialize(header.numRecords);
+	if (header.numRecords > 0 && !fs.Read(reinterpret_cast<uint8*>(m_records.data()), header.numRecords * sizeof(InstructionTraceRecord)))
+	{
+		printf("Truncated trace file: %s\n", file);
+		return false;
+	}
+
+	// Records were saved oldest first, so the ring starts at index 0
+	m_numRecorded = header.numRecords;
+	return true;
+}
+
+std::string InstructionTrace::Format(const InstructionTraceRecord& record)
+{
+	static OpCodeEntry** opCodeTable = GetOpCodeTable();
+	const OpCodeEntry* entry = opCodeTable[record.opCode];
+
+	char bankText[8] = "  ";
+	if (record.prgBank16k != kNoBank)
+		sprintf(bankText, "%02X", record.prgBank16k);
+
+	char bytesText[32];
+	const size_t numBytes = entry? entry->numBytes : 1;
+	snprintf(bytesText, sizeof(bytesText), "%02X %s %s", record.opCode,
+		numBytes > 1? FormattedString<8>("%02X", record.operands[0]).Value() : "  ",
+		numBytes > 2? FormattedString<8>("%02X", record.operands[1]).Value() : "  ");
+
+	const uint16 operand16 = TO16(record.operands[0]) | (TO16(record.operands[1]) << 8);
+	const uint16 address = record.operandAddress;
+
+	char operandText[64] = {0};
+	switch (entry? entry->addrMode : AddressMode::Implid)
+	{
+	case AddressMode::Immedt: sprintf(operandText, "#" ADDR_8, record.operands[0]); break;
+	case AddressMode::Implid: break;
+	case AddressMode::Accumu: sprintf(operandText, "A"); break;
+	case AddressMode::Relatv: sprintf(operandText, ADDR_8 " ; " ADDR_16 " (%d)", record.operands[0], address, static_cast<int8>(record.operands[0])); break;
+	case AddressMode::ZeroPg: sprintf(operandText, ADDR_16, address); break;
+	case AddressMode::ZPIdxX: sprintf(operandText, ADDR_8 ",X @ " ADDR_16, record.operands[0], address); break;
+	case AddressMode::ZPIdxY: sprintf(operandText, ADDR_8 ",Y @ " ADDR_16, record.operands[0], address); break;
+	case AddressMode::Absolu: sprintf(operandText, ADDR_16, address); break;
+	case AddressMode::AbIdxX: sprintf(operandText, ADDR_16 ",X @ " ADDR_16, operand16, address); break;
+	case AddressMode::AbIdxY: sprintf(operandText, ADDR_16 ",Y @ " ADDR_16, operand16, address); break;
+	case AddressMode::Indrct: sprintf(operandText, "(" ADDR_16 ") @ " ADDR_16, operand16, address); break;
+	case AddressMode::IdxInd: sprintf(operandText, "(" ADDR_8 ",X) @ " ADDR_16, record.operands[0], address); break;
+	case AddressMode::IndIdx: sprintf(operandText, "(" ADDR_8 "),Y @ " ADDR_16, record.operands[0], address); break;
+	}
+
+	// Same flag order as P, upper case if set
+	static const char kFlagNames[] = "NVUBDIZC";
+	char flagsText[9] = {0};
+	for (size_t i = 0; i < 8; ++i)
+	{
+		const bool set = (record.p & (1 << (7 - i))) != 0;
+		flagsText[i] = set? kFlagNames[i] : static_cast<char>(tolower(kFlagNames[i]));
+	}
+
+	return FormattedString<256>("c%-12llu %s:%04X:%s  %s %-28s A:%02X X:%02X Y:%02X S:%02X P:%s",
+		record.cycle, bankText, record.pc, bytesText, entry? OpCodeName::String[entry->opCodeName] : "???",
+		operandText, record.a, record.x, record.y, record.sp, flagsText).Value();
+}
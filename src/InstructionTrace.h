@@ -0,0 +1,59 @@
+#pragma once
+
+#include "Base.h"
+#include <vector>
+#include <string>
+
+// CPU state before an instruction executes, recorded as-is and formatted to text offline
+struct InstructionTraceRecord
+{
+	uint64 cycle;
+	uint16 pc;
+	uint16 operandAddress; // Effective address
+	uint8 opCode;
+	uint8 operands[2]; // Valid up to the instruction size
+	uint8 prgBank16k; // kNoBank if not executing from PRG-ROM
+	uint8 a;
+	uint8 x;
+	uint8 y;
+	uint8 p;
+	uint8 sp;
+	uint8 reserved[3];
+};
+static_assert(sizeof(InstructionTraceRecord) == 24, "Trace files depend on the record layout");
+
+// Fixed-size ring of the most recently executed instructions. Recording is a plain struct store,
+// cheap enough to leave enabled so that the trace can be saved after a FAIL.
+class InstructionTrace
+{
+public:
+	static const uint8 kNoBank = 0xFF;
+
+	InstructionTrace();
+
+	// Capacity is rounded up to a power of 2; 0 releases the ring
+	void Initialize(size_t numRecords);
+	bool IsEnabled() const { return !m_records.empty(); }
+	void Clear() { m_numRecorded = 0; }
+
+	// Returns the record to fill in, overwriting the oldest one once the ring is full
+	FORCEINLINE InstructionTraceRecord& Add() { return m_records[static_cast<size_t>(m_numRecorded++) & m_mask]; }
+
+	size_t GetNumRecords() const;
+	uint64 GetNumRecorded() const { return m_numRecorded; } // Including overwritten records
+
+	// Index 0 is the oldest record still in the ring
+	const InstructionTraceRecord& GetRecord(size_t index) const;
+
+	// Records are saved oldest first
+	bool Save(const char* file) const;
+	bool Load(const char* file);
+
+	// Disassembles record to a single line of text
+	static std::string Format(const InstructionTraceRecord& record);
+
+private:
+	std::vector<InstructionTraceRecord> m_records;
+	size_t m_mask;
+	uint64 m_numRecorded;
+};
@@ -64,6 +64,9 @@ public:
 	size_t GetMappedChrBankIndex(size_t ppuBankIndex) { return m_chrBankIndices[ppuBankIndex]; }
 	size_t GetMappedSavBankIndex(size_t cpuBankIndex) { return m_savBankIndices[cpuBankIndex]; }
 
+	// For lookups that can't afford a call per access, valid for the lifetime of the mapper
+	const size_t* GetPrgBankIndices() const { return m_prgBankIndices.data(); }
+
 	size_t PrgMemorySize() const { return m_numPrgBanks * kPrgBankSize; }
 	size_t ChrMemorySize() const { return m_numChrBanks * kChrBankSize; }
 	size_t SavMemorySize() const { return m_numSavBanks * kSavBankSize; }
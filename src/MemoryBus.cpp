@@ -4,6 +4,7 @@
 #include "Cartridge.h"
 #include "CpuInternalRam.h"
 #include "MemoryMap.h"
+#include "Debugger.h"
 
 CpuMemoryBus::CpuMemoryBus()
 	: m_ppu(nullptr)
@@ -22,6 +23,8 @@ void CpuMemoryBus::Initialize(Cpu& cpu, Ppu& ppu, Cartridge& cartridge, CpuInter
 
 uint8 CpuMemoryBus::Read(uint16 cpuAddress)
 {
+	Debugger::CheckBreakpoint(MemorySpace::Cpu, BreakpointFlag::Read, cpuAddress);
+
 	if (cpuAddress >= CpuMemory::kExpansionRomBase)
 	{
 		return m_cartridge->HandleCpuRead(cpuAddress);
@@ -40,6 +43,8 @@ uint8 CpuMemoryBus::Read(uint16 cpuAddress)
 
 void CpuMemoryBus::Write(uint16 cpuAddress, uint8 value)
 {
+	Debugger::CheckBreakpoint(MemorySpace::Cpu, BreakpointFlag::Write, cpuAddress);
+
 	if (cpuAddress >= CpuMemory::kExpansionRomBase)
 	{
 		m_cartridge->HandleCpuWrite(cpuAddress, value);
@@ -59,6 +64,40 @@ void CpuMemoryBus::Write(uint16 cpuAddress, uint8 value)
 	m_cpuInternalRam->HandleCpuWrite(cpuAddress, value);
 }
 
+const uint8* CpuMemoryBus::GetPagePtr(uint16 cpuAddress)
+{
+	if (cpuAddress >= CpuMemory::kExpansionRomBase)
+	{
+		return m_cartridge->GetCpuPagePtr(cpuAddress);
+	}
+	else if (cpuAddress >= CpuMemory::kPpuRegistersBase)
+	{
+		return nullptr;
+	}
+
+	return m_cpuInternalRam->GetCpuPagePtr(cpuAddress);
+}
+
+size_t CpuMemoryBus::GetPrgBankIndex16k(uint16 cpuAddress) const
+{
+	return m_cartridge->GetPrgBankIndex16k(cpuAddress);
+}
+
+const size_t* CpuMemoryBus::GetPrgBankIndices() const
+{
+	return m_cartridge->GetPrgBankIndices();
+}
+
+size_t CpuMemoryBus::GetPrgMemorySize() const
+{
+	return m_cartridge->GetPrgMemorySize();
+}
+
+bool CpuMemoryBus::CanWritePrgMemory() const
+{
+	return m_cartridge->CanWritePrgMemory();
+}
+
 
 PpuMemoryBus::PpuMemoryBus()
 	: m_ppu(nullptr)
@@ -75,6 +114,7 @@ void PpuMemoryBus::Initialize(Ppu& ppu, Cartridge& cartridge)
 uint8 PpuMemoryBus::Read(uint16 ppuAddress)
 {
 	ppuAddress %= PpuMemory::kPpuMemorySize; // Handle mirroring above 16K to 64K
+	Debugger::CheckBreakpoint(MemorySpace::Ppu, BreakpointFlag::Read, ppuAddress);
 
 	if (ppuAddress >= PpuMemory::kVRamBase)
 	{
@@ -87,6 +127,7 @@ uint8 PpuMemoryBus::Read(uint16 ppuAddress)
 void PpuMemoryBus::Write(uint16 ppuAddress, uint8 value)
 {
 	ppuAddress %= PpuMemory::kPpuMemorySize; // Handle mirroring above 16K to 64K
+	Debugger::CheckBreakpoint(MemorySpace::Ppu, BreakpointFlag::Write, ppuAddress);
 
 	if (ppuAddress >= PpuMemory::kVRamBase)
 	{
@@ -17,6 +17,18 @@ public:
 	uint8 Read(uint16 cpuAddress);
 	void Write(uint16 cpuAddress, uint8 value);
 
+	// Returns pointer to the 256 byte page containing cpuAddress if it is backed by plain memory
+	// (internal RAM, save RAM or PRG-ROM), or nullptr if reading it may have side-effects.
+	const uint8* GetPagePtr(uint16 cpuAddress);
+
+	// Index of the 16K PRG-ROM bank mapped at cpuAddress, which must be >= $8000
+	size_t GetPrgBankIndex16k(uint16 cpuAddress) const;
+
+	// See Cartridge::GetPrgBankIndices
+	const size_t* GetPrgBankIndices() const;
+	size_t GetPrgMemorySize() const;
+	bool CanWritePrgMemory() const;
+
 private:
 	Cpu* m_cpu;
 	Ppu* m_ppu;
@@ -0,0 +1,182 @@
+#include "Movie.h"
+#include "Nes.h"
+#include "Stream.h"
+#include <algorithm>
+
+namespace
+{
+	// File layout (little endian):
+	//  Header
+	//  uint8  state[header.stateSize]
+	//  uint8  buttons[header.numFrames][header.numControllers]
+	struct MovieFileHeader
+	{
+		char magic[4];
+		uint32 version;
+		uint64 romHash;
+		uint8 anchor;
+		uint8 numControllers;
+		uint8 reserved[2];
+		uint32 stateSize;
+		uint32 numFrames;
+	};
+
+	const char kMovieFileMagic[4] = { 'N', 'E', 'S', 'M' };
+	const uint32 kMovieFileVersion = 1;
+}
+
+Movie::Movie()
+	: m_romHash(0)
+	, m_anchor(MovieAnchor::PowerOn)
+{
+}
+
+void Movie::Begin(Nes& nes, MovieAnchor::Type anchor)
+{
+	m_romHash = nes.GetRomHash();
+	m_anchor = anchor;
+	m_state.clear();
+	m_frames.clear();
+
+	if (m_anchor == MovieAnchor::PowerOn)
+	{
+		nes.PowerOn();
+	}
+	else
+	{
+		nes.SaveState(m_state);
+	}
+}
+
+bool Movie::Restore(Nes& nes) const
+{
+	if (nes.GetRomHash() != m_romHash)
+	{
+		printf("Movie was recorded with a different rom\n");
+		return false;
+	}
+
+	if (m_anchor == MovieAnchor::PowerOn)
+	{
+		nes.PowerOn();
+	}
+	else
+	{
+		nes.LoadState(m_state);
+	}
+	return true;
+}
+
+bool Movie::Save(const char* file) const
+{
+	FileStream fs;
+	if (!fs.Open(file, "wb"))
+	{
+		printf("Failed to open movie file for save: %s\n", file);
+		return false;
+	}
+
+	MovieFileHeader header = {};
+	std::copy(std::begin(kMovieFileMagic), std::end(kMovieFileMagic), header.magic);
+	header.version = kMovieFileVersion;
+	header.romHash = m_romHash;
+	header.anchor = m_anchor;
+	header.numControllers = kNumControllers;
+	header.stateSize = static_cast<uint32>(m_state.size());
+	header.numFrames = static_cast<uint32>(GetNumFrames());
+
+	if (fs.WriteValue(header) != 1
+		|| fs.Write(m_state.data(), m_state.size()) != m_state.size()
+		|| fs.Write(m_frames.data(), m_frames.size()) != m_frames.size())
+	{
+		printf("Failed to write movie file: %s\n", file);
+		return false;
+	}
+
+	printf("Saved movie: %s (%d frames)\n", file, header.numFrames);
+	return true;
+}
+
+bool Movie::Load(const char* file)
+{
+	FileStream fs;
+	if (!fs.Open(file, "rb"))
+	{
+		printf("Failed to open movie file for load: %s\n", file);
+		return false;
+	}
+
+	MovieFileHeader header;
+	if (fs.ReadValue(header) != 1
+		|| !std::equal(std::begin(kMovieFileMagic), std::end(kMovieFileMagic), header.magic)
+		|| header.version != kMovieFileVersion
+		|| header.anchor >= MovieAnchor::NumTypes
+		|| header.numControllers != kNumControllers)
+	{
+		printf("Invalid movie file: %s\n", file);
+		return false;
+	}
+
+	m_romHash = header.romHash;
+	m_anchor = static_cast<MovieAnchor::Type>(header.anchor);
+	m_state.resize(header.stateSize);
+	m_frames.resize(header.numFrames * kNumControllers);
+
+	if ( (!m_state.empty() && !fs.Read(m_state.data(), m_state.size()))
+		|| (!m_frames.empty() && !fs.Read(m_frames.data(), m_frames.size())) )
+	{
+		printf("Truncated movie file: %s\n", file);
+		return false;
+	}
+
+	return true;
+}
+
+void Movie::AddFrame(const uint8 (&buttons)[kNumControllers])
+{
+	m_frames.insert(m_frames.end(), std::begin(buttons), std::end(buttons));
+}
+
+MovieRecorder::MovieRecorder(Movie& movie, InputSource& source)
+	: m_movie(&movie)
+	, m_source(&source)
+{
+	std::fill(std::begin(m_buttons), std::end(m_buttons), 0);
+}
+
+void MovieRecorder::NextFrame()
+{
+	m_source->NextFrame();
+
+	for (size_t i = 0; i < Movie::kNumControllers; ++i)
+	{
+		m_buttons[i] = m_source->GetButtons(i);
+	}
+	m_movie->AddFrame(m_buttons);
+}
+
+uint8 MovieRecorder::GetButtons(size_t controllerIndex)
+{
+	return m_buttons[controllerIndex];
+}
+
+MoviePlayer::MoviePlayer(const Movie& movie)
+	: m_movie(&movie)
+	, m_numFramesPlayed(0)
+{
+}
+
+void MoviePlayer::NextFrame()
+{
+	++m_numFramesPlayed;
+}
+
+uint8 MoviePlayer::GetButtons(size_t controllerIndex)
+{
+	// Return buttons of the frame being played, or none if we're outside of the movie
+	const size_t frame = m_numFramesPlayed - 1;
+	if (m_numFramesPlayed == 0 || frame >= m_movie->GetNumFrames())
+		return 0;
+
+	return m_movie->GetButtons(frame, controllerIndex);
+}
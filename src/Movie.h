@@ -0,0 +1,83 @@
+#pragma once
+
+#include "Base.h"
+#include "ControllerPorts.h"
+#include <vector>
+
+class Nes;
+
+namespace MovieAnchor
+{
+	enum Type : uint8
+	{
+		PowerOn, // Movie starts from Nes::PowerOn
+		SaveState, // Movie starts from a save state stored in the movie
+
+		NumTypes
+	};
+}
+
+// Recorded controller input: one button mask per controller per frame, along with the point to
+// start playback from, and the hash of the rom it was recorded with.
+class Movie
+{
+public:
+	static const size_t kNumControllers = ControllerPorts::kNumControllers;
+
+	Movie();
+
+	// Starts a new empty movie for the rom loaded in nes. For PowerOn, nes is powered on.
+	void Begin(Nes& nes, MovieAnchor::Type anchor);
+
+	// Puts nes at the start of the movie. Returns false if nes doesn't have the movie's rom loaded.
+	bool Restore(Nes& nes) const;
+
+	bool Save(const char* file) const;
+	bool Load(const char* file);
+
+	void AddFrame(const uint8 (&buttons)[kNumControllers]);
+	size_t GetNumFrames() const { return m_frames.size() / kNumControllers; }
+	uint8 GetButtons(size_t frame, size_t controllerIndex) const { return m_frames[frame * kNumControllers + controllerIndex]; }
+
+	MovieAnchor::Type GetAnchor() const { return m_anchor; }
+	uint64 GetRomHash() const { return m_romHash; }
+
+private:
+	uint64 m_romHash;
+	MovieAnchor::Type m_anchor;
+	std::vector<uint8> m_state; // SaveState anchor only
+	std::vector<uint8> m_frames;
+};
+
+// Records buttons from source into movie, once per frame
+class MovieRecorder : public InputSource
+{
+public:
+	MovieRecorder(Movie& movie, InputSource& source);
+
+	virtual void NextFrame();
+	virtual uint8 GetButtons(size_t controllerIndex);
+
+private:
+	Movie* m_movie;
+	InputSource* m_source;
+	uint8 m_buttons[Movie::kNumControllers];
+};
+
+// Plays back buttons from movie, once per frame
+class MoviePlayer : public InputSource
+{
+public:
+	MoviePlayer(const Movie& movie);
+
+	// True once all frames of the movie have been played
+	bool IsFinished() const { return m_numFramesPlayed >= m_movie->GetNumFrames(); }
+	size_t GetNumFramesPlayed() const { return m_numFramesPlayed; }
+
+	virtual void NextFrame();
+	virtual uint8 GetButtons(size_t controllerIndex);
+
+private:
+	const Movie* m_movie;
+	size_t m_numFramesPlayed;
+};
@@ -6,6 +6,9 @@
 #include "Renderer.h"
 #include "IO.h"
 #include "CircularBuffer.h"
+#include "FrameTrace.h"
+#include "AvOutput.h"
+#include <algorithm>
 
 Nes::~Nes()
 {
@@ -13,40 +16,67 @@ Nes::~Nes()
 	SerializeSaveRam(true);
 }
 
-void Nes::Initialize()
+void Nes::Initialize(bool headless)
 {
-	m_apu.Initialize();
-	m_cpu.Initialize(m_cpuMemoryBus, m_apu);
+	m_headless = headless;
+	m_saveRamFilesEnabled = !m_headless;
+	m_inputSource = nullptr;
+	m_avOutputListeners.clear();
+
+	m_apu.Initialize(m_headless);
+	m_apu.SetOutputListeners(&m_avOutputListeners);
+	m_cpu.Initialize(m_cpuMemoryBus, m_apu, m_ppu);
 	m_ppu.Initialize(m_ppuMemoryBus, *this);
 	m_cartridge.Initialize(*this);
 	m_cpuInternalRam.Initialize();
 	m_cpuMemoryBus.Initialize(m_cpu, m_ppu, m_cartridge, m_cpuInternalRam);
 	m_ppuMemoryBus.Initialize(m_ppu, m_cartridge);
 	m_turbo = false;
+	m_frameSkip = 0;
+	m_numFramesSkipped = 0;
+	m_runAheadFrames = 0;
+	m_snapshotSize = 0;
 
 	// Create directories
-	const std::string& appDir = System::GetAppDirectory();
-	m_saveDir = appDir + "saves/";
-	System::CreateDirectory(m_saveDir.c_str());
+	if (!m_headless)
+	{
+		const std::string& appDir = System::GetAppDirectory();
+		m_saveDir = appDir + "saves/";
+		System::CreateDirectory(m_saveDir.c_str());
+	}
 }
 
 RomHeader Nes::LoadRom(const char* file)
 {
 	// Save sram of current cart before loading a new one
 	SerializeSaveRam(true);
+	m_saveRamFilesEnabled = !m_headless;
 
+	m_romFile = file;
 	m_romName = IO::Path::GetFileNameWithoutExtension(file);
 
 	// Load rom and last sram state, if any
 	RomHeader romHeader = m_cartridge.LoadRom(file);
 	SerializeSaveRam(false);
-
-	// Initialize rewind buffer
-	m_rewindManager.Initialize(*this);
+	OnRomLoaded();
 
 	return romHeader;
 }
 
+void Nes::OnRomLoaded()
+{
+	m_cpu.OnCartridgeLoaded();
+
+	// State size depends on the rom
+	ByteCounterStream bcs;
+	Serializer::SaveRootObject(bcs, *this, false);
+	m_snapshotSize = sizeof(uint64) + bcs.GetStreamSize();
+
+	// Initialize rewind buffer
+	if (!m_headless)
+		m_rewindManager.Initialize(*this);
+}
+
 void Nes::Reset()
 {
 	m_frameTimer.Reset();
@@ -58,9 +88,52 @@ void Nes::Reset()
 	m_lastSaveRamTime = System::GetTimeSec();
 }
 
+void Nes::PowerOn()
+{
+	assert(m_cartridge.IsRomLoaded());
+
+	// Save sram before it gets cleared
+	SerializeSaveRam(true);
+
+	// Copy the state of a freshly loaded headless system, which resets every subsystem, including
+	// the ones that Reset doesn't touch (memory, mapper, apu channels). The rom is copied from memory,
+	// unless the game could have written to it.
+	std::vector<uint8> state;
+	{
+		std::shared_ptr<Nes> powerOnNes = std::make_shared<Nes>();
+		powerOnNes->Initialize(true);
+		if (m_cartridge.CanWritePrgMemory())
+		{
+			powerOnNes->LoadRom(m_romFile.c_str());
+		}
+		else
+		{
+			powerOnNes->LoadRomFrom(*this);
+			powerOnNes->m_cartridge.ClearRam();
+		}
+		powerOnNes->Reset();
+		powerOnNes->SaveState(state);
+	}
+
+	const bool turbo = m_turbo;
+	LoadState(state);
+	m_turbo = turbo;
+
+	m_rewindManager.ClearRewindStates();
+
+	// Don't overwrite the sram file with cleared sram
+	m_saveRamFilesEnabled = false;
+}
+
+void Nes::EnableInstructionTrace(size_t numRecords)
+{
+	m_instructionTrace.Initialize(numRecords);
+	m_cpu.SetInstructionTrace(m_instructionTrace.IsEnabled()? &m_instructionTrace : nullptr);
+}
+
 void Nes::SerializeSaveRam(bool save)
 {
-	if (!m_cartridge.IsRomLoaded())
+	if (!m_cartridge.IsRomLoaded() || !m_saveRamFilesEnabled)
 		return;
 
 	assert(!m_romName.empty());
@@ -115,6 +188,77 @@ bool Nes::SerializeSaveState(bool save)
 	return false;
 }
 
+void Nes::SaveState(std::vector<uint8>& state)
+{
+	ByteCounterStream bcs;
+	Serializer::SaveRootObject(bcs, *this);
+
+	state.resize(bcs.GetStreamSize());
+	MemoryStream ms;
+	ms.Open(state.data(), state.size());
+	Serializer::SaveRootObject(ms, *this);
+}
+
+void Nes::LoadState(const std::vector<uint8>& state)
+{
+	MemoryStream ms;
+	ms.Open(const_cast<uint8*>(state.data()), state.size()); // Only read from
+	Reset();
+	Serializer::LoadRootObject(ms, *this);
+}
+
+void Nes::SaveSnapshot(std::vector<uint8>& snapshot) const
+{
+	assert(m_cartridge.IsRomLoaded());
+	snapshot.resize(m_snapshotSize);
+
+	MemoryStream ms;
+	ms.Open(snapshot.data(), snapshot.size());
+	uint64 romHash = GetRomHash();
+	ms.WriteValue(romHash);
+	Serializer::SaveRootObject(ms, const_cast<Nes&>(*this), false); // Saving only reads
+}
+
+void Nes::LoadSnapshot(const std::vector<uint8>& snapshot)
+{
+	if (snapshot.size() != m_snapshotSize)
+		FAIL("Snapshot size mismatch! Expecting %d, got %d", m_snapshotSize, snapshot.size());
+
+	MemoryStream ms;
+	ms.Open(const_cast<uint8*>(snapshot.data()), snapshot.size()); // Only read from
+	uint64 romHash;
+	ms.ReadValue(romHash);
+	if (romHash != GetRomHash())
+		FAIL("Snapshot is of another rom");
+
+	// Untagged loads overwrite every serialized value, and subsystems invalidate what depends on them
+	// (see Cpu::Serialize), so unlike LoadState, no Reset is needed
+	Serializer::LoadRootObject(ms, *this, false);
+}
+
+void Nes::LoadRomFrom(const Nes& other)
+{
+	// Sram files belong to other
+	SerializeSaveRam(true);
+	m_saveRamFilesEnabled = false;
+
+	m_romFile = other.m_romFile;
+	m_romName = other.m_romName;
+	m_cartridge.LoadRomFrom(other.m_cartridge);
+	OnRomLoaded();
+}
+
+void Nes::CloneFrom(const Nes& other)
+{
+	assert(other.m_cartridge.IsRomLoaded());
+
+	if (!m_cartridge.IsRomLoaded() || GetRomHash() != other.GetRomHash())
+		LoadRomFrom(other);
+
+	other.SaveSnapshot(m_cloneSnapshot);
+	LoadSnapshot(m_cloneSnapshot);
+}
+
 void Nes::Serialize(class Serializer& serializer)
 {
 	SERIALIZE(m_turbo);
@@ -127,58 +271,152 @@ void Nes::Serialize(class Serializer& serializer)
 
 void Nes::RewindSaveStates(bool enable)
 {
-	m_rewindManager.SetRewinding(enable);
+	m_rewindManager.SetRewinding(enable && !m_headless);
+}
+
+void Nes::SetInputSource(InputSource* inputSource)
+{
+	m_inputSource = inputSource;
+	m_cpu.SetInputSource(inputSource);
+}
+
+void Nes::AddAvOutputListener(AvOutputListener* listener)
+{
+	assert(std::find(m_avOutputListeners.begin(), m_avOutputListeners.end(), listener) == m_avOutputListeners.end());
+	m_avOutputListeners.push_back(listener);
+}
+
+void Nes::RemoveAvOutputListener(AvOutputListener* listener)
+{
+	m_avOutputListeners.erase(std::remove(m_avOutputListeners.begin(), m_avOutputListeners.end(), listener), m_avOutputListeners.end());
+}
+
+void Nes::EndAvOutputFrame(bool presented)
+{
+	for (auto listener : m_avOutputListeners)
+		listener->OnFrameEnd(presented? m_ppu.GetFramePixels() : nullptr);
 }
 
 void Nes::ExecuteFrame(bool paused)
 {
+	FrameTrace::BeginFrame();
+
 	if (m_rewindManager.IsRewinding())
 	{
-		if (m_rewindManager.RewindFrame())
+		bool rewound;
+		{
+			FrameTrace::ScopedSection section(FrameTrace::Section::Rewind);
+			rewound = m_rewindManager.RewindFrame();
+		}
+
+		if (rewound)
 		{
 			// Execute a single frame so that we can render it and play audio
+			m_ppu.SetPixelCompositionEnabled(true);
 			ExecuteCpuAndPpuFrame();
-			m_ppu.RenderFrame();
+			RenderFrame();
+			EndAvOutputFrame(true);
 		}
+
+		FrameTrace::EndFrame();
 		return;
 	}
 
 	if (!paused)
 	{
+		if (m_inputSource)
+			m_inputSource->NextFrame();
+
+		const bool present = m_numFramesSkipped >= m_frameSkip;
+		m_numFramesSkipped = present? 0 : m_numFramesSkipped + 1;
+
+		// With run-ahead, the frame presented is the last hidden one
+		const bool runAhead = present && m_runAheadFrames > 0;
+		m_ppu.SetPixelCompositionEnabled(present && !runAhead);
 		ExecuteCpuAndPpuFrame();
-		m_ppu.RenderFrame();
 
-		m_rewindManager.SaveRewindState();
+		if (runAhead)
+			ExecuteRunAheadFrames();
+		else if (present)
+			RenderFrame();
+
+		EndAvOutputFrame(present);
+
+		if (!m_headless)
+		{
+			FrameTrace::ScopedSection section(FrameTrace::Section::Rewind);
+			m_rewindManager.SaveRewindState();
+		}
 	}
 
 	// Just rendered a screen; FrameTimer will wait until we hit 60 FPS (if machine is too fast).
-	// If turbo mode is enabled, it won't wait.
-	const float32 minFrameTime = 1.0f/60.0f;
-	m_frameTimer.Update(m_turbo? 0.f: minFrameTime);
+	// If turbo mode is enabled, or we're headless, it won't wait.
+	{
+		FrameTrace::ScopedSection section(FrameTrace::Section::Throttle);
+		const float32 minFrameTime = 1.0f/60.0f;
+		m_frameTimer.Update(m_turbo || m_headless? 0.f: minFrameTime);
+	}
 
 	// Auto-save sram at fixed intervals
 	const float64 saveInterval = 5.0;
 	const float64 currTime = System::GetTimeSec();
 	if (currTime - m_lastSaveRamTime >= saveInterval)
 	{
+		FrameTrace::ScopedSection section(FrameTrace::Section::SaveRam);
 		SerializeSaveRam(true);
 		m_lastSaveRamTime = currTime;
 	}
+
+	FrameTrace::EndFrame();
+}
+
+void Nes::ExecuteRunAheadFrames()
+{
+	{
+		FrameTrace::ScopedSection section(FrameTrace::Section::RunAhead);
+		SaveSnapshot(m_runAheadState);
+	}
+
+	m_apu.SetOutputEnabled(false);
+	for (size_t i = 0; i < m_runAheadFrames; ++i)
+	{
+		m_ppu.SetPixelCompositionEnabled(i + 1 == m_runAheadFrames);
+		ExecuteCpuAndPpuFrame();
+	}
+	m_apu.SetOutputEnabled(true);
+
+	RenderFrame();
+
+	{
+		FrameTrace::ScopedSection section(FrameTrace::Section::RunAhead);
+		LoadSnapshot(m_runAheadState);
+	}
+}
+
+void Nes::RenderFrame()
+{
+	FrameTrace::ScopedSection section(FrameTrace::Section::Present);
+	m_ppu.RenderFrame();
 }
 
 void Nes::ExecuteCpuAndPpuFrame()
 {
 	bool completedFrame = false;
+	FrameTrace::Tick tick = FrameTrace::Now();
 
 	while (!completedFrame)
 	{
 		// Update CPU, get number of cycles elapsed
 		uint32 cpuCycles;
-		m_cpu.Execute(cpuCycles);
+		if (!m_cpu.SkipIdleInstruction(cpuCycles))
+			m_cpu.Execute(cpuCycles);
+		FrameTrace::Accumulate(FrameTrace::Section::Cpu, tick);
 
 		// Update PPU with that many cycles
 		m_ppu.Execute(cpuCycles, completedFrame);
+		FrameTrace::Accumulate(FrameTrace::Section::Ppu, tick);
 
 		m_apu.Execute(cpuCycles);
+		FrameTrace::Accumulate(FrameTrace::Section::Apu, tick);
 	}
 }
@@ -9,27 +9,108 @@
 #include "MemoryBus.h"
 #include "FrameTimer.h"
 #include "RewindManager.h"
+#include "InstructionTrace.h"
+#include "Serializer.h"
+#include <vector>
+
+class AvOutputListener;
 
 class Nes
 {
 public:
 	~Nes();
 
-	void Initialize();
+	// If headless, no window or audio device is created, sram is not read from or written to file,
+	// rewind is disabled, and frames execute as fast as possible.
+	void Initialize(bool headless = false);
+	bool IsHeadless() const { return m_headless; }
 	
 	RomHeader LoadRom(const char* file);
 	void Reset();
 
+	// Puts the system in the same state as a freshly loaded rom with cleared sram, regardless of what
+	// ran before. Sram files are not written until ResumeSaveRamFiles or the next LoadRom.
+	void PowerOn();
+
+	// Writes sram files again after PowerOn, e.g. once a movie recorded from power on ends
+	void ResumeSaveRamFiles() { m_saveRamFilesEnabled = !m_headless; }
+
 	bool SerializeSaveState(bool save);
+	void SaveState(std::vector<uint8>& state);
+	void LoadState(const std::vector<uint8>& state);
 	void Serialize(class Serializer& serializer);
 
+	// Snapshots hold the same state as save states, untagged, and are loaded without a Reset, which
+	// makes them several times faster (see Serializer). Only valid for the same build and rom.
+	void SaveSnapshot(std::vector<uint8>& snapshot) const;
+	void LoadSnapshot(const std::vector<uint8>& snapshot);
+
+	// Puts this instance in the state of other, e.g. to branch from it in tree search. Only emulation
+	// state is copied: settings, input source, listeners and the last composed frame are this
+	// instance's own. The rom is copied from other the first time, and sram files are disabled, as
+	// they belong to other.
+	void CloneFrom(const Nes& other);
+
+	// Fingerprint of the emulation state (what save states hold), e.g. to detect desyncs in netplay and
+	// replays, or to find duplicate states in search. Equal states hash equal across instances of the
+	// same build. Memory is tracked by page as it's written, so only pages written since the last call
+	// are rehashed.
+	uint64 GetStateHash() { return Serializer::HashRootObject(*this, m_stateHashBuffer); }
+
 	void RewindSaveStates(bool enable);
 
 	void ExecuteFrame(bool paused);
 
 	void SetTurboEnabled(bool enabled) { m_turbo = enabled; }
+
+	// For fast-forward: only one in every numFrames + 1 frames is composed and presented, the others
+	// are still emulated exactly. 0 to present every frame.
+	void SetFrameSkip(size_t numFrames) { m_frameSkip = numFrames; }
+
+	// Hides input lag built into games: each frame is executed, then numFrames more with the same
+	// input and no audio, the last of which is presented before the state is restored. 0 to disable.
+	void SetRunAheadFrames(size_t numFrames) { m_runAheadFrames = numFrames; }
+	size_t GetRunAheadFrames() const { return m_runAheadFrames; }
+
+	// Filter applied to frames shown in the window, on the CPU (see Upscaler)
+	void SetUpscaleFilter(UpscaleFilter::Type filter) { m_ppu.SetUpscaleFilter(filter); }
+
+	// Set to nullptr to read from the keyboard. Source is advanced once per emulated frame.
+	void SetInputSource(InputSource* inputSource);
+
+	// Set to nullptr to stop listening
+	void SetSaveRamWriteListener(SaveRamWriteListener* listener) { m_cartridge.SetSaveRamWriteListener(listener); }
+	void SetCpuInstructionListener(CpuInstructionListener* listener) { m_cpu.SetInstructionListener(listener); }
+
+	CpuRegisters GetCpuRegisters() const { return m_cpu.GetRegisters(); }
+	void SetCpuRegisters(const CpuRegisters& registers) { m_cpu.SetRegisters(registers); }
+
+	// Skipping idle loops doesn't change emulation results, disable to compare performance
+	void SetIdleLoopSkipEnabled(bool enabled) { m_cpu.SetIdleLoopSkipEnabled(enabled); }
+
+	// Keeps the last numRecords executed instructions in memory for post-mortem dumps; 0 to disable
+	void EnableInstructionTrace(size_t numRecords);
+	bool IsInstructionTraceEnabled() const { return m_instructionTrace.IsEnabled(); }
+	bool SaveInstructionTrace(const char* file) const { return m_instructionTrace.Save(file); }
+
+	uint64 GetRomHash() const { return m_cartridge.GetRomHash(); }
+	const uint8* GetCpuInternalRam() const { return m_cpuInternalRam.GetRam(); } // CpuMemory::kInternalRamSize bytes
 	void SetChannelVolume(ApuChannel::Type type, float32 volume) { m_apu.SetChannelVolume(type, volume); }
 
+	// Last rendered frame as ARGB8888 rows 'pitch' bytes apart. Headless only.
+	const uint8* GetFrameBuffer(size_t& pitch) const { return m_ppu.GetFrameBuffer(pitch); }
+
+	// PPU output of the last composed frame, 256x240 (see PixelConverter)
+	const PpuPixel* GetFramePixels() const { return m_ppu.GetFramePixels(); }
+
+	// Set to receive audio samples generated while executing frames; nullptr to stop
+	void SetAudioCapture(std::vector<float32>* samples) { m_apu.SetSampleCapture(samples); }
+	size_t GetAudioSampleRate() const { return m_apu.GetSampleRate(); }
+
+	// Listeners receive audio and video as they are output, e.g. to export or capture them
+	void AddAvOutputListener(AvOutputListener* listener);
+	void RemoveAvOutputListener(AvOutputListener* listener);
+
 	void SignalCpuNmi() { m_cpu.Nmi(); }
 	void SignalCpuIrq() { m_cpu.Irq(); }
 
@@ -39,9 +120,16 @@ public:
 
 private:
 	friend class DebuggerImpl;
+	friend class ProfilerImpl;
+	friend class NesBench;
 
 	void ExecuteCpuAndPpuFrame();
+	void ExecuteRunAheadFrames();
+	void RenderFrame();
+	void EndAvOutputFrame(bool presented);
 	void SerializeSaveRam(bool save);
+	void LoadRomFrom(const Nes& other);
+	void OnRomLoaded();
 
 	Cpu m_cpu;
 	Ppu m_ppu;
@@ -53,10 +141,27 @@ private:
 
 	FrameTimer m_frameTimer;
 	RewindManager m_rewindManager;
+	InstructionTrace m_instructionTrace;
+
+	InputSource* m_inputSource;
+	std::vector<AvOutputListener*> m_avOutputListeners;
+
+	size_t m_frameSkip;
+	size_t m_numFramesSkipped; // Since the last presented frame
+
+	size_t m_runAheadFrames;
+	std::vector<uint8> m_runAheadState;
+
+	size_t m_snapshotSize; // Depends on the rom
+	std::vector<uint8> m_cloneSnapshot;
+	std::vector<uint8> m_stateHashBuffer;
 
+	std::string m_romFile;
 	std::string m_romName;
 	std::string m_saveDir;
 
 	float64 m_lastSaveRamTime;
 	bool m_turbo;
+	bool m_headless;
+	bool m_saveRamFilesEnabled;
 };
@@ -0,0 +1,178 @@
+#include "NesEnv.h"
+#include "Nes.h"
+#include "ControllerPorts.h"
+#include "PixelConverter.h"
+#include "MemoryMap.h"
+#include <cstring>
+#include <algorithm>
+
+namespace
+{
+	const size_t kScreenWidth = 256;
+	const size_t kScreenHeight = 240;
+
+	static_assert(NesEnvBatch::kRamSize == CpuMemory::kInternalRamSize, "Size mismatch");
+}
+
+// Controller 1 presses the buttons of the current action, controller 2 nothing
+class NesEnvBatch::ActionInputSource : public InputSource
+{
+public:
+	ActionInputSource() : m_buttons(0) {}
+
+	void SetButtons(uint8 buttons) { m_buttons = buttons; }
+	virtual uint8 GetButtons(size_t controllerIndex) { return controllerIndex == 0? m_buttons : 0; }
+
+private:
+	uint8 m_buttons;
+};
+
+NesEnvBatch::NesEnvBatch()
+	: m_observationSize(0)
+	, m_actions(nullptr)
+{
+}
+
+NesEnvBatch::~NesEnvBatch()
+{
+}
+
+void NesEnvBatch::Initialize(const NesEnvConfig& config, size_t numEnvs, size_t numThreads)
+{
+	assert(numEnvs > 0 && config.framesPerStep > 0);
+	m_config = config;
+
+	m_envs.resize(numEnvs);
+	for (auto& env : m_envs)
+	{
+		env.nes = std::make_shared<Nes>();
+		env.nes->Initialize(true);
+		env.nes->LoadRom(m_config.romFile.c_str());
+		env.nes->Reset();
+
+		// Frame skip starts counting from the env's first frame, so with steps of framesPerStep frames,
+		// only the last frame of each step is composed
+		env.nes->SetFrameSkip(m_config.framesPerStep - 1);
+
+		env.input = std::make_shared<ActionInputSource>();
+		env.nes->SetInputSource(env.input.get());
+		env.episodeSteps = 0;
+
+		if (m_config.observationType == ObservationType::Gray8Half)
+			env.grayFrame.resize(kScreenWidth * kScreenHeight);
+	}
+
+	// Freshly loaded, every instance is in the same state
+	m_envs[0].nes->SaveState(m_resetState);
+
+	m_observationSize = ObservationType::Width[m_config.observationType] * ObservationType::Height[m_config.observationType];
+	m_observations.assign(numEnvs * m_observationSize, 0);
+	m_ram.assign(numEnvs * kRamSize, 0);
+	m_done.assign(numEnvs, 0);
+
+	// No more threads than envs, each thread steps a range of envs
+	m_workerPool.SetNumThreads(numThreads);
+	m_workerPool.SetNumThreads(std::min(m_workerPool.GetNumThreads(), numEnvs));
+	m_stepJob = [this] (size_t begin, size_t end) { StepEnvs(begin, end); };
+
+	ResetAll();
+}
+
+void NesEnvBatch::SetResetState(const std::vector<uint8>& state)
+{
+	m_resetState = state;
+}
+
+void NesEnvBatch::ResetAll()
+{
+	for (size_t i = 0; i < m_envs.size(); ++i)
+		Reset(i);
+}
+
+void NesEnvBatch::Reset(size_t envIndex)
+{
+	ResetEnv(envIndex);
+	Observe(envIndex);
+}
+
+void NesEnvBatch::Step(const uint8* actions)
+{
+	m_actions = actions;
+	m_workerPool.Run(m_envs.size(), m_stepJob);
+	m_actions = nullptr;
+}
+
+void NesEnvBatch::StepEnvs(size_t begin, size_t end)
+{
+	for (size_t i = begin; i < end; ++i)
+	{
+		Env& env = m_envs[i];
+		if (m_done[i])
+			ResetEnv(i);
+
+		env.input->SetButtons(m_actions[i]);
+		for (size_t frame = 0; frame < m_config.framesPerStep; ++frame)
+			env.nes->ExecuteFrame(false);
+		++env.episodeSteps;
+
+		Observe(i);
+	}
+}
+
+void NesEnvBatch::ResetEnv(size_t envIndex)
+{
+	Env& env = m_envs[envIndex];
+	env.nes->LoadState(m_resetState);
+	env.episodeSteps = 0;
+
+	// States don't hold the frame buffer, which still shows the previous episode, so compose one frame
+	// to observe. A composed frame restarts the frame skip count, keeping steps aligned.
+	env.input->SetButtons(0);
+	env.nes->SetFrameSkip(0);
+	env.nes->ExecuteFrame(false);
+	env.nes->SetFrameSkip(m_config.framesPerStep - 1);
+}
+
+void NesEnvBatch::Observe(size_t envIndex)
+{
+	Env& env = m_envs[envIndex];
+	const Nes& nes = *env.nes;
+	uint8* observation = m_observations.data() + envIndex * m_observationSize;
+
+	switch (m_config.observationType)
+	{
+	case ObservationType::None:
+		break;
+
+	case ObservationType::Palette8:
+		PixelConverter::Get().Convert(nes.GetFramePixels(), kScreenWidth, kScreenHeight, PixelFormat::Palette8, observation, kScreenWidth);
+		break;
+
+	case ObservationType::Gray8:
+		PixelConverter::Get().Convert(nes.GetFramePixels(), kScreenWidth, kScreenHeight, PixelFormat::Gray8, observation, kScreenWidth);
+		break;
+
+	case ObservationType::Gray8Half:
+		{
+			PixelConverter::Get().Convert(nes.GetFramePixels(), kScreenWidth, kScreenHeight, PixelFormat::Gray8, env.grayFrame.data(), kScreenWidth);
+			for (size_t y = 0; y < kScreenHeight / 2; ++y)
+			{
+				const uint8* row0 = &env.grayFrame[y * 2 * kScreenWidth];
+				const uint8* row1 = row0 + kScreenWidth;
+				for (size_t x = 0; x < kScreenWidth / 2; ++x)
+					*observation++ = static_cast<uint8>((row0[x * 2] + row0[x * 2 + 1] + row1[x * 2] + row1[x * 2 + 1] + 2) / 4);
+			}
+		}
+		break;
+
+	default:
+		assert(false);
+	}
+
+	const uint8* ram = nes.GetCpuInternalRam();
+	memcpy(m_ram.data() + envIndex * kRamSize, ram, kRamSize);
+
+	const bool ramDone = m_config.doneMask != 0 && (ram[m_config.doneAddress % kRamSize] & m_config.doneMask) == m_config.doneValue;
+	const bool timeUp = m_config.maxEpisodeSteps != 0 && env.episodeSteps >= m_config.maxEpisodeSteps;
+	m_done[envIndex] = ramDone || timeUp;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "Base.h"
+#include "WorkerPool.h"
+#include <string>
+#include <vector>
+#include <memory>
+
+class Nes;
+
+namespace ObservationType
+{
+	enum Type
+	{
+		None,		// Only RAM is observed
+		Palette8,	// 256x240, the 6-bit palette color of each pixel
+		Gray8,		// 256x240 luma
+		Gray8Half,	// 128x120 luma, each pixel the average of 2x2 pixels
+
+		NumTypes
+	};
+
+	static const char* String[] = { "None", "Palette8", "Gray8", "Gray8Half" };
+	static_assert(NumTypes == ARRAYSIZE(String), "Size mismatch");
+
+	static const size_t Width[] = { 0, 256, 256, 128 };
+	static_assert(NumTypes == ARRAYSIZE(Width), "Size mismatch");
+
+	static const size_t Height[] = { 0, 240, 240, 120 };
+	static_assert(NumTypes == ARRAYSIZE(Height), "Size mismatch");
+}
+
+struct NesEnvConfig
+{
+	NesEnvConfig()
+		: framesPerStep(4)
+		, observationType(ObservationType::Gray8Half)
+		, doneAddress(0)
+		, doneMask(0)
+		, doneValue(0)
+		, maxEpisodeSteps(0)
+	{
+	}
+
+	std::string romFile;
+	size_t framesPerStep; // Frames executed with the same action per step, only the last one is composed
+	ObservationType::Type observationType;
+
+	// An episode is done when (RAM[doneAddress] & doneMask) == doneValue after a step (never if doneMask
+	// is 0), or after maxEpisodeSteps steps (never if 0)
+	uint16 doneAddress;
+	uint8 doneMask;
+	uint8 doneValue;
+	size_t maxEpisodeSteps;
+};
+
+// Reinforcement learning environments: a batch of headless Nes instances running the same rom, stepped
+// together with one action each. Step runs the envs in parallel on a worker pool, and writes their
+// observations, 2 KB of CPU RAM (to compute rewards from) and done flags to buffers allocated once by
+// Initialize, each holding one entry per env, contiguously.
+class NesEnvBatch
+{
+public:
+	static const size_t kRamSize = KB(2);
+
+	NesEnvBatch();
+	~NesEnvBatch();
+
+	// Loads the rom in numEnvs instances, and resets them all. numThreads includes the calling thread,
+	// 0 to use one per hardware thread.
+	void Initialize(const NesEnvConfig& config, size_t numEnvs, size_t numThreads = 0);
+
+	// Episodes start from this state (see Nes::SaveState) instead of power on, e.g. at a given level
+	void SetResetState(const std::vector<uint8>& state);
+
+	// Loads the reset state, then executes one frame with no buttons down, as states don't hold the
+	// frame buffer: that frame is the episode's first observation.
+	void ResetAll();
+	void Reset(size_t envIndex);
+
+	// actions[i] is the controller 1 buttons of env i (bit N set if ControllerButtons::Type N is down).
+	// Envs done after the previous step are reset first, so the observation returned with done set is
+	// the last one of the episode.
+	void Step(const uint8* actions);
+
+	size_t GetNumEnvs() const { return m_envs.size(); }
+	size_t GetObservationSize() const { return m_observationSize; }
+
+	const uint8* GetObservation(size_t envIndex) const { return m_observations.data() + envIndex * m_observationSize; }
+	const uint8* GetRam(size_t envIndex) const { return m_ram.data() + envIndex * kRamSize; }
+	bool IsDone(size_t envIndex) const { return m_done[envIndex] != 0; }
+
+	// All envs' buffers at once, e.g. to hand to a training framework without copies
+	const uint8* GetObservations() const { return m_observations.data(); }
+	const uint8* GetRams() const { return m_ram.data(); }
+	const uint8* GetDoneFlags() const { return m_done.data(); }
+
+	Nes& GetNes(size_t envIndex) { return *m_envs[envIndex].nes; }
+
+private:
+	NesEnvBatch(const NesEnvBatch&);
+	NesEnvBatch& operator=(const NesEnvBatch&);
+
+	class ActionInputSource;
+
+	struct Env
+	{
+		std::shared_ptr<Nes> nes;
+		std::shared_ptr<ActionInputSource> input;
+		size_t episodeSteps;
+		std::vector<uint8> grayFrame; // Downsampled to the observation
+	};
+
+	void StepEnvs(size_t begin, size_t end);
+	void ResetEnv(size_t envIndex);
+	void Observe(size_t envIndex);
+
+	NesEnvConfig m_config;
+	std::vector<Env> m_envs;
+	std::vector<uint8> m_resetState;
+	size_t m_observationSize;
+	std::vector<uint8> m_observations;
+	std::vector<uint8> m_ram;
+	std::vector<uint8> m_done;
+
+	WorkerPool m_workerPool;
+	WorkerPool::RangeJob m_stepJob; // Created once, so that stepping doesn't allocate
+	const uint8* m_actions;
+};
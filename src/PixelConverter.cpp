@@ -0,0 +1,212 @@
+#include "PixelConverter.h"
+#include <algorithm>
+#include <cstring>
+
+// AVX2 is only used if the CPU supports it. GCC and Clang can compile it per function; other
+// compilers need it enabled for the whole build (e.g. /arch:AVX2).
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+	#define PIXEL_CONVERTER_AVX2 1
+	#define AVX2_FUNCTION __attribute__((target("avx2")))
+#elif defined(__AVX2__)
+	#define PIXEL_CONVERTER_AVX2 1
+	#define AVX2_FUNCTION
+#else
+	#define PIXEL_CONVERTER_AVX2 0
+#endif
+
+#if PIXEL_CONVERTER_AVX2
+	#include <immintrin.h>
+#endif
+
+namespace
+{
+	const size_t kNumPaletteColors = 64; // Technically 56 but there is space for 64 and some games access >= 56
+
+	struct RGB { uint8 r, g, b; };
+
+	void GetPaletteColors(RGB colors[kNumPaletteColors])
+	{
+	#define USE_PALETTE 2
+
+	#if USE_PALETTE == 1
+		// This palette seems more "accurate"
+		// 2C03 and 2C05 palettes (http://wiki.nesdev.com/w/index.php/PPU_palettes#2C03_and_2C05)
+		const RGB dac3Palette[] =
+		{
+			{3,3,3},{0,1,4},{0,0,6},{3,2,6},{4,0,3},{5,0,3},{5,1,0},{4,2,0},{3,2,0},{1,2,0},{0,3,1},{0,4,0},{0,2,2},{0,0,0},{0,0,0},{0,0,0},
+			{5,5,5},{0,3,6},{0,2,7},{4,0,7},{5,0,7},{7,0,4},{7,0,0},{6,3,0},{4,3,0},{1,4,0},{0,4,0},{0,5,3},{0,4,4},{0,0,0},{0,0,0},{0,0,0},
+			{7,7,7},{3,5,7},{4,4,7},{6,3,7},{7,0,7},{7,3,7},{7,4,0},{7,5,0},{6,6,0},{3,6,0},{0,7,0},{2,7,6},{0,7,7},{0,0,0},{0,0,0},{0,0,0},
+			{7,7,7},{5,6,7},{6,5,7},{7,5,7},{7,4,7},{7,5,5},{7,6,4},{7,7,2},{7,7,3},{5,7,2},{4,7,3},{2,7,6},{4,6,7},{0,0,0},{0,0,0},{0,0,0}
+		};
+
+		for (uint8 i = 0; i < kNumPaletteColors; ++i)
+		{
+			const RGB& c = dac3Palette[i];
+			const RGB scaled = { uint8(c.r/7.f*255.f), uint8(c.g/7.f*255.f), uint8(c.b/7.f*255.f) };
+			colors[i] = scaled;
+		}
+	#elif USE_PALETTE == 2
+
+		// This palette seems closer to what fceux does by default
+		// http://nesdev.com/NESTechFAQ.htm#accuratepal
+
+		const RGB palette[] =
+		{
+			{0x80,0x80,0x80}, {0x00,0x3D,0xA6}, {0x00,0x12,0xB0}, {0x44,0x00,0x96},
+			{0xA1,0x00,0x5E}, {0xC7,0x00,0x28}, {0xBA,0x06,0x00}, {0x8C,0x17,0x00},
+			{0x5C,0x2F,0x00}, {0x10,0x45,0x00}, {0x05,0x4A,0x00}, {0x00,0x47,0x2E},
+			{0x00,0x41,0x66}, {0x00,0x00,0x00}, {0x05,0x05,0x05}, {0x05,0x05,0x05},
+			{0xC7,0xC7,0xC7}, {0x00,0x77,0xFF}, {0x21,0x55,0xFF}, {0x82,0x37,0xFA},
+			{0xEB,0x2F,0xB5}, {0xFF,0x29,0x50}, {0xFF,0x22,0x00}, {0xD6,0x32,0x00},
+			{0xC4,0x62,0x00}, {0x35,0x80,0x00}, {0x05,0x8F,0x00}, {0x00,0x8A,0x55},
+			{0x00,0x99,0xCC}, {0x21,0x21,0x21}, {0x09,0x09,0x09}, {0x09,0x09,0x09},
+			{0xFF,0xFF,0xFF}, {0x0F,0xD7,0xFF}, {0x69,0xA2,0xFF}, {0xD4,0x80,0xFF},
+			{0xFF,0x45,0xF3}, {0xFF,0x61,0x8B}, {0xFF,0x88,0x33}, {0xFF,0x9C,0x12},
+			{0xFA,0xBC,0x20}, {0x9F,0xE3,0x0E}, {0x2B,0xF0,0x35}, {0x0C,0xF0,0xA4},
+			{0x05,0xFB,0xFF}, {0x5E,0x5E,0x5E}, {0x0D,0x0D,0x0D}, {0x0D,0x0D,0x0D},
+			{0xFF,0xFF,0xFF}, {0xA6,0xFC,0xFF}, {0xB3,0xEC,0xFF}, {0xDA,0xAB,0xEB},
+			{0xFF,0xA8,0xF9}, {0xFF,0xAB,0xB3}, {0xFF,0xD2,0xB0}, {0xFF,0xEF,0xA6},
+			{0xFF,0xF7,0x9C}, {0xD7,0xE8,0x95}, {0xA6,0xED,0xAF}, {0xA2,0xF2,0xDA},
+			{0x99,0xFF,0xFC}, {0xDD,0xDD,0xDD}, {0x11,0x11,0x11}, {0x11,0x11,0x11},
+		};
+
+		for (uint8 i = 0; i < kNumPaletteColors; ++i)
+		{
+			colors[i] = palette[i];
+		}
+	#endif
+	}
+
+	// Emphasized channels are kept and the others darkened, as on the NTSC PPU (approximately). With
+	// all three bits set, the whole color is darkened.
+	RGB ApplyEmphasis(const RGB& c, uint8 emphasisBits)
+	{
+		if (emphasisBits == 0)
+			return c;
+
+		const uint8 keptChannels = (emphasisBits == 0x7)? 0 : emphasisBits;
+		const float32 kAttenuation = 0.816f;
+		auto Channel = [&] (uint8 value, uint8 bit) { return (keptChannels & bit)? value : uint8(value * kAttenuation); };
+		const RGB result = { Channel(c.r, BIT(0)), Channel(c.g, BIT(1)), Channel(c.b, BIT(2)) };
+		return result;
+	}
+
+	template <typename T>
+	FORCEINLINE void ConvertRowScalar(const PpuPixel* src, size_t width, const uint32* lut, T* dest)
+	{
+		for (size_t x = 0; x < width; ++x)
+			dest[x] = static_cast<T>(lut[src[x] & (PixelConverter::kNumPpuPixelValues - 1)]);
+	}
+
+#if PIXEL_CONVERTER_AVX2
+	bool CpuSupportsAvx2()
+	{
+	#if defined(__GNUC__) || defined(__clang__)
+		return __builtin_cpu_supports("avx2") != 0;
+	#else
+		return true; // Enabled at compile time
+	#endif
+	}
+
+	AVX2_FUNCTION FORCEINLINE __m256i GatherEight(const PpuPixel* src, const uint32* lut)
+	{
+		const __m256i mask = _mm256_set1_epi32(PixelConverter::kNumPpuPixelValues - 1);
+		const __m256i indices = _mm256_and_si256(_mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src))), mask);
+		return _mm256_i32gather_epi32(reinterpret_cast<const int*>(lut), indices, 4);
+	}
+
+	AVX2_FUNCTION void ConvertRowArgb8888Avx2(const PpuPixel* src, size_t width, const uint32* lut, uint32* dest)
+	{
+		size_t x = 0;
+		for ( ; x + 8 <= width; x += 8)
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + x), GatherEight(src + x, lut));
+
+		ConvertRowScalar(src + x, width - x, lut, dest + x);
+	}
+
+	AVX2_FUNCTION void ConvertRowRgb565Avx2(const PpuPixel* src, size_t width, const uint32* lut, uint16* dest)
+	{
+		size_t x = 0;
+		for ( ; x + 16 <= width; x += 16)
+		{
+			// Packing works within 128-bit lanes, so the 64-bit quarters come out as 0, 2, 1, 3
+			const __m256i packed = _mm256_packus_epi32(GatherEight(src + x, lut), GatherEight(src + x + 8, lut));
+			_mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + x), _mm256_permute4x64_epi64(packed, _MM_SHUFFLE(3, 1, 2, 0)));
+		}
+
+		ConvertRowScalar(src + x, width - x, lut, dest + x);
+	}
+#endif
+}
+
+const PixelConverter& PixelConverter::Get()
+{
+	// Thread-safe initialization, instances may be created on different threads
+	static const PixelConverter instance;
+	return instance;
+}
+
+PixelConverter::PixelConverter()
+{
+	RGB colors[kNumPaletteColors];
+	GetPaletteColors(colors);
+
+	for (size_t i = 0; i < kNumPpuPixelValues; ++i)
+	{
+		const RGB c = ApplyEmphasis(colors[i % kNumPaletteColors], static_cast<uint8>(i / kNumPaletteColors));
+		m_argb8888[i] = (0xFFu << 24) | (c.r << 16) | (c.g << 8) | c.b;
+		m_rgb565[i] = ((c.r >> 3) << 11) | ((c.g >> 2) << 5) | (c.b >> 3);
+		m_gray8[i] = (299 * c.r + 587 * c.g + 114 * c.b + 500) / 1000; // BT.601
+	}
+}
+
+void PixelConverter::Convert(const PpuPixel* pixels, size_t width, size_t height, PixelFormat::Type format, uint8* dest, size_t destPitch) const
+{
+#if PIXEL_CONVERTER_AVX2
+	static const bool useAvx2 = CpuSupportsAvx2();
+#endif
+
+	for (size_t y = 0; y < height; ++y, pixels += width, dest += destPitch)
+	{
+		switch (format)
+		{
+		case PixelFormat::Argb8888:
+		#if PIXEL_CONVERTER_AVX2
+			if (useAvx2)
+			{
+				ConvertRowArgb8888Avx2(pixels, width, m_argb8888, reinterpret_cast<uint32*>(dest));
+				break;
+			}
+		#endif
+			ConvertRowScalar(pixels, width, m_argb8888, reinterpret_cast<uint32*>(dest));
+			break;
+
+		case PixelFormat::Rgb565:
+		#if PIXEL_CONVERTER_AVX2
+			if (useAvx2)
+			{
+				ConvertRowRgb565Avx2(pixels, width, m_rgb565, reinterpret_cast<uint16*>(dest));
+				break;
+			}
+		#endif
+			ConvertRowScalar(pixels, width, m_rgb565, reinterpret_cast<uint16*>(dest));
+			break;
+
+		case PixelFormat::Indexed:
+			memcpy(dest, pixels, width * sizeof(PpuPixel));
+			break;
+
+		case PixelFormat::Palette8:
+			for (size_t x = 0; x < width; ++x)
+				dest[x] = static_cast<uint8>(pixels[x] & (kNumPaletteColors - 1));
+			break;
+
+		case PixelFormat::Gray8:
+			ConvertRowScalar(pixels, width, m_gray8, dest);
+			break;
+
+		default:
+			assert(false);
+		}
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "Base.h"
+
+namespace PixelFormat
+{
+	enum Type
+	{
+		Argb8888,	// uint32 per pixel, same as the Renderer's back buffer
+		Rgb565,		// uint16 per pixel
+		Indexed,	// uint16 per pixel, the PPU pixel unchanged (see PpuPixel)
+		Palette8,	// uint8 per pixel, the 6-bit palette color without emphasis
+		Gray8,		// uint8 per pixel, luma of the Argb8888 color
+
+		NumTypes
+	};
+
+	static const char* String[] = { "Argb8888", "Rgb565", "Indexed", "Palette8", "Gray8" };
+	static_assert(NumTypes == ARRAYSIZE(String), "Size mismatch");
+
+	static const size_t BytesPerPixel[] = { 4, 2, 2, 1, 1 };
+	static_assert(NumTypes == ARRAYSIZE(BytesPerPixel), "Size mismatch");
+}
+
+// What the PPU outputs per pixel: the 6-bit palette color in bits 0-5 (already masked by $2001
+// grayscale), and the $2001 color emphasis bits (red, green, blue) in bits 6-8.
+typedef uint16 PpuPixel;
+
+// Converts frames of PpuPixels to displayable formats through lookup tables covering every palette
+// color and emphasis combination, so a frame is converted in one pass over its pixels.
+class PixelConverter
+{
+public:
+	static const size_t kNumPpuPixelValues = 512;
+
+	// The tables are built once and shared, so this is cheap
+	static const PixelConverter& Get();
+
+	// Converts width * height contiguous pixels to rows 'destPitch' bytes apart
+	void Convert(const PpuPixel* pixels, size_t width, size_t height, PixelFormat::Type format, uint8* dest, size_t destPitch) const;
+
+private:
+	PixelConverter();
+
+	// All are uint32 so that the AVX2 path can gather from any
+	uint32 m_argb8888[kNumPpuPixelValues];
+	uint32 m_rgb565[kNumPpuPixelValues];
+	uint32 m_gray8[kNumPpuPixelValues];
+};
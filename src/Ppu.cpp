@@ -6,71 +6,11 @@
 #include "MemoryMap.h"
 #include "Debugger.h"
 #include <tuple>
+#include <algorithm>
 #include <cstring>
 
 namespace
 {
-	const size_t kScreenWidth = 256;
-	const size_t kScreenHeight = 240;
-
-	const size_t kNumPaletteColors = 64; // Technically 56 but there is space for 64 and some games access >= 56
-	Color4 g_paletteColors[kNumPaletteColors] = {0};
-
-	void InitPaletteColors()
-	{
-		struct RGB { uint8 r, g, b; };
-
-	#define USE_PALETTE 2
-
-	#if USE_PALETTE == 1
-		// This palette seems more "accurate"
-		// 2C03 and 2C05 palettes (http://wiki.nesdev.com/w/index.php/PPU_palettes#2C03_and_2C05)
-		RGB dac3Palette[] =
-		{
-			{3,3,3},{0,1,4},{0,0,6},{3,2,6},{4,0,3},{5,0,3},{5,1,0},{4,2,0},{3,2,0},{1,2,0},{0,3,1},{0,4,0},{0,2,2},{0,0,0},{0,0,0},{0,0,0},
-			{5,5,5},{0,3,6},{0,2,7},{4,0,7},{5,0,7},{7,0,4},{7,0,0},{6,3,0},{4,3,0},{1,4,0},{0,4,0},{0,5,3},{0,4,4},{0,0,0},{0,0,0},{0,0,0},
-			{7,7,7},{3,5,7},{4,4,7},{6,3,7},{7,0,7},{7,3,7},{7,4,0},{7,5,0},{6,6,0},{3,6,0},{0,7,0},{2,7,6},{0,7,7},{0,0,0},{0,0,0},{0,0,0},
-			{7,7,7},{5,6,7},{6,5,7},{7,5,7},{7,4,7},{7,5,5},{7,6,4},{7,7,2},{7,7,3},{5,7,2},{4,7,3},{2,7,6},{4,6,7},{0,0,0},{0,0,0},{0,0,0}
-		};
-
-		for (uint8 i = 0; i < kNumPaletteColors; ++i)
-		{
-			const RGB& c = dac3Palette[i];
-			g_paletteColors[i].SetRGBA((uint8(c.r/7.f*255.f)), ((uint8)(c.g/7.f*255.f)), ((uint8)(c.b/7.f*255.f)), 0xFF);
-		}
-	#elif USE_PALETTE == 2
-
-		// This palette seems closer to what fceux does by default
-		// http://nesdev.com/NESTechFAQ.htm#accuratepal
-
-		RGB palette[] =
-		{
-			{0x80,0x80,0x80}, {0x00,0x3D,0xA6}, {0x00,0x12,0xB0}, {0x44,0x00,0x96},
-			{0xA1,0x00,0x5E}, {0xC7,0x00,0x28}, {0xBA,0x06,0x00}, {0x8C,0x17,0x00},
-			{0x5C,0x2F,0x00}, {0x10,0x45,0x00}, {0x05,0x4A,0x00}, {0x00,0x47,0x2E},
-			{0x00,0x41,0x66}, {0x00,0x00,0x00}, {0x05,0x05,0x05}, {0x05,0x05,0x05},
-			{0xC7,0xC7,0xC7}, {0x00,0x77,0xFF}, {0x21,0x55,0xFF}, {0x82,0x37,0xFA},
-			{0xEB,0x2F,0xB5}, {0xFF,0x29,0x50}, {0xFF,0x22,0x00}, {0xD6,0x32,0x00},
-			{0xC4,0x62,0x00}, {0x35,0x80,0x00}, {0x05,0x8F,0x00}, {0x00,0x8A,0x55},
-			{0x00,0x99,0xCC}, {0x21,0x21,0x21}, {0x09,0x09,0x09}, {0x09,0x09,0x09},
-			{0xFF,0xFF,0xFF}, {0x0F,0xD7,0xFF}, {0x69,0xA2,0xFF}, {0xD4,0x80,0xFF},
-			{0xFF,0x45,0xF3}, {0xFF,0x61,0x8B}, {0xFF,0x88,0x33}, {0xFF,0x9C,0x12},
-			{0xFA,0xBC,0x20}, {0x9F,0xE3,0x0E}, {0x2B,0xF0,0x35}, {0x0C,0xF0,0xA4},
-			{0x05,0xFB,0xFF}, {0x5E,0x5E,0x5E}, {0x0D,0x0D,0x0D}, {0x0D,0x0D,0x0D},
-			{0xFF,0xFF,0xFF}, {0xA6,0xFC,0xFF}, {0xB3,0xEC,0xFF}, {0xDA,0xAB,0xEB},
-			{0xFF,0xA8,0xF9}, {0xFF,0xAB,0xB3}, {0xFF,0xD2,0xB0}, {0xFF,0xEF,0xA6},
-			{0xFF,0xF7,0x9C}, {0xD7,0xE8,0x95}, {0xA6,0xED,0xAF}, {0xA2,0xF2,0xDA},
-			{0x99,0xFF,0xFC}, {0xDD,0xDD,0xDD}, {0x11,0x11,0x11}, {0x11,0x11,0x11},
-		};
-
-		for (uint8 i = 0; i < kNumPaletteColors; ++i)
-		{
-			const RGB& c = palette[i];
-			g_paletteColors[i].SetRGBA(c.r, c.g, c.b, 0xFF);
-		}
-	#endif
-	}
-
 	// EDC BA 98765 43210 *** NOTE bit 15 is missing because it's not used. PPU address space is 14 bits wide, but extra bit is used f or scrolling.
 	// yyy NN YYYYY XXXXX
 	// ||| || ||||| +++++-- coarse X scroll
@@ -246,14 +186,26 @@ namespace PpuStatus // $2002 (R)
 	};
 }
 
+namespace
+{
+	// Grayscale selects the gray column of the palette, emphasis bits are left for PixelConverter
+	FORCEINLINE PpuPixel MakePpuPixel(uint8 paletteColor, const Bitfield8& ppuControlReg2)
+	{
+		const uint8 colorMask = ppuControlReg2.Test(PpuControl2::DisplayType)? 0x30 : 0x3F;
+		return (paletteColor & colorMask) | (TO16(ppuControlReg2.Read(PpuControl2::ColorIntensityMask)) << 1);
+	}
+}
+
 Ppu::Ppu()
 	: m_ppuMemoryBus(nullptr)
 	, m_nes(nullptr)
 	, m_rendererHolder(new Renderer())
 	, m_renderer(m_rendererHolder.get())
+	, m_spriteBucketsHeight(0)
+	, m_spriteBucketsDirty(true)
+	, m_pixelCompositionEnabled(true)
+	, m_framePixels(kScreenWidth * kScreenHeight, 0x0F) // Black
 {
-	InitPaletteColors();
-	m_renderer->Create(kScreenWidth, kScreenHeight);
 }
 
 void Ppu::Initialize(PpuMemoryBus& ppuMemoryBus, Nes& nes)
@@ -261,11 +213,15 @@ void Ppu::Initialize(PpuMemoryBus& ppuMemoryBus, Nes& nes)
 	m_ppuMemoryBus = &ppuMemoryBus;
 	m_nes = &nes;
 
+	m_renderer->Create(kScreenWidth, kScreenHeight, nes.IsHeadless());
+
 	m_nameTables.Initialize();
 	m_palette.Initialize();
 	m_ppuRegisters.Initialize();
 	m_oam.Initialize();
 	m_oam2.Initialize();
+	m_nameTablePages.Initialize(m_nameTables.Size());
+	m_oamPages.Initialize(m_oam.Size());
 
 	m_ppuControlReg1 = m_ppuRegisters.RawPtrAs<Bitfield8*>(MapCpuToPpuRegister(CpuMemory::kPpuControlReg1));
 	m_ppuControlReg2 = m_ppuRegisters.RawPtrAs<Bitfield8*>(MapCpuToPpuRegister(CpuMemory::kPpuControlReg2));
@@ -296,9 +252,9 @@ void Ppu::Reset()
 
 void Ppu::Serialize(class Serializer& serializer)
 {
-	SERIALIZE(m_nameTables);
+	SERIALIZE_TRACKED(m_nameTables, m_nameTablePages);
 	SERIALIZE(m_palette);
-	SERIALIZE(m_oam);
+	SERIALIZE_TRACKED(m_oam, m_oamPages);
 	SERIALIZE(m_oam2);
 	SERIALIZE(m_ppuRegisters);
 	SERIALIZE(m_vramAndScrollFirstWrite);
@@ -311,6 +267,9 @@ void Ppu::Serialize(class Serializer& serializer)
 	SERIALIZE(m_vblankFlagSetThisFrame);
 	SERIALIZE(m_bgTileFetchDataPipeline);
 	SERIALIZE(m_spriteFetchData);
+
+	if (!serializer.IsSaving())
+		m_spriteBucketsDirty = true;
 }
 
 void Ppu::Execute(uint32 cpuCycles, bool& completedFrame)
@@ -326,11 +285,31 @@ void Ppu::Execute(uint32 cpuCycles, bool& completedFrame)
 
 	const bool renderingEnabled = m_ppuControlReg2->Test(PpuControl2::RenderBackground|PpuControl2::RenderSprites);
 
-	for ( ; ppuCycles > 0; --ppuCycles)
+	while (ppuCycles > 0)
 	{
 		const uint32 x = m_cycle % kNumScanlineCycles; // offset in current scanline
 		const uint32 y = m_cycle / kNumScanlineCycles; // scanline
 
+		// With rendering disabled, a visible scanline only draws the backdrop color, so handle the rest of it
+		// at once, up to the dot where the frame completes
+		if (!renderingEnabled && y < kScreenHeight)
+		{
+			const uint32 spanEndX = (y == kScreenHeight - 1)? 339 : kNumScanlineCycles;
+			if (x < spanEndX)
+			{
+				const uint32 numDots = std::min<uint32>(spanEndX - x, ppuCycles);
+				if (m_pixelCompositionEnabled && x < kScreenWidth)
+				{
+					const PpuPixel pixel = MakePpuPixel(m_palette.Read(0), *m_ppuControlReg2); // BG ($3F00), as in RenderPixel
+					std::fill_n(&m_framePixels[y * kScreenWidth + x], std::min<uint32>(numDots, kScreenWidth - x), pixel);
+				}
+
+				m_cycle += numDots; // Can't wrap on a visible scanline
+				ppuCycles -= numDots;
+				continue;
+			}
+		}
+
 		if ( (y <= 239) || y == 261 ) // Visible and Pre-render scanlines
 		{
 			if (renderingEnabled) //@TODO: Not sure about this
@@ -403,7 +382,8 @@ void Ppu::Execute(uint32 cpuCycles, bool& completedFrame)
 				}
 
 				// Render pixel at x,y using pipelined fetch data. If rendering is disabled, will render background color.
-				if (x < kScreenWidth && y < kScreenHeight)
+				// Without composition, only pixels that may shift sprites or hit sprite 0 need to be processed.
+				if (x < kScreenWidth && y < kScreenHeight && (m_pixelCompositionEnabled || m_numSpritesToRender > 0))
 				{
 					RenderPixel(x, y);
 				}
@@ -438,14 +418,46 @@ void Ppu::Execute(uint32 cpuCycles, bool& completedFrame)
 
 		// Update cycle
 		m_cycle = (m_cycle + 1) % kNumScreenCycles;
+		--ppuCycles;
 	}
 }
 
 void Ppu::RenderFrame()
 {
+	size_t pitch;
+	uint8* backBuffer = m_renderer->GetBackBuffer(pitch);
+	PixelConverter::Get().Convert(m_framePixels.data(), kScreenWidth, kScreenHeight, PixelFormat::Argb8888, backBuffer, pitch);
+
 	m_renderer->Present();
 }
 
+void Ppu::SetUpscaleFilter(UpscaleFilter::Type filter)
+{
+	m_renderer->SetUpscaleFilter(filter);
+}
+
+const uint8* Ppu::GetFrameBuffer(size_t& pitch) const
+{
+	return m_renderer->GetBackBuffer(pitch);
+}
+
+bool Ppu::PeekStatusRead(uint8& value)
+{
+	// See the $2002 case in HandleCpuRead for the side-effects of a read
+	const uint32 kSetVBlankCycle = YXtoPpuCycle(241, 1);
+	if (m_ppuStatusReg->Test(PpuStatus::InVBlank)
+		|| (m_cycle < kSetVBlankCycle && (m_cycle + CpuToPpuCycles(3) >= kSetVBlankCycle))
+		|| !m_vramAndScrollFirstWrite
+		|| ReadPpuRegister(CpuMemory::kPpuVRamAddressReg1) != 0
+		|| ReadPpuRegister(CpuMemory::kPpuVRamAddressReg2) != 0)
+	{
+		return false;
+	}
+
+	value = ReadPpuRegister(CpuMemory::kPpuStatusReg);
+	return true;
+}
+
 uint8 Ppu::HandleCpuRead(uint16 cpuAddress)
 {
 	// CPU only has access to PPU memory-mapped registers
@@ -555,7 +567,12 @@ void Ppu::HandleCpuWrite(uint16 cpuAddress, uint8 value)
 			// Write value to sprite ram at address in $2003 (OAMADDR) and increment address
 			const uint8 spriteRamAddress = ReadPpuRegister(CpuMemory::kPpuSprRamAddressReg);
 			m_oam.Write(spriteRamAddress, value);
+			m_oamPages.MarkDirty(spriteRamAddress);
 			WritePpuRegister(CpuMemory::kPpuSprRamAddressReg, spriteRamAddress + 1);
+
+			// Other sprite bytes are read from OAM when evaluated
+			if (spriteRamAddress % kSpriteDataSize == 0)
+				m_spriteBucketsDirty = true;
 		}
 		break;
 
@@ -615,6 +632,21 @@ void Ppu::HandleCpuWrite(uint16 cpuAddress, uint8 value)
 	}
 }
 
+void Ppu::OamDmaTransfer(const uint8* source)
+{
+	// Each write to $2004 stores at OAMADDR and increments it, so the copy starts at OAMADDR and wraps
+	// around, leaving OAMADDR unchanged once all 256 bytes have been written.
+	const uint8 spriteRamAddress = ReadPpuRegister(CpuMemory::kPpuSprRamAddressReg);
+	const size_t firstCopySize = kSpriteMemorySize - spriteRamAddress;
+	memcpy(m_oam.RawPtr(spriteRamAddress), source, firstCopySize);
+	memcpy(m_oam.RawPtr(), source + firstCopySize, spriteRamAddress);
+	m_oamPages.MarkAllDirty();
+	m_spriteBucketsDirty = true;
+
+	// Register memory holds the last value written
+	WritePpuRegister(CpuMemory::kPpuSprRamIoReg, source[kSpriteMemorySize - 1]);
+}
+
 uint8 Ppu::HandlePpuRead(uint16 ppuAddress)
 {
 	//@NOTE: The palette can only be accessed directly by the PPU (no address lines go out to Cartridge)
@@ -623,7 +655,9 @@ uint8 Ppu::HandlePpuRead(uint16 ppuAddress)
 
 void Ppu::HandlePpuWrite(uint16 ppuAddress, uint8 value)
 {
-	m_nameTables.Write(MapPpuToVRam(ppuAddress), value);
+	const uint16 address = MapPpuToVRam(ppuAddress);
+	m_nameTables.Write(address, value);
+	m_nameTablePages.MarkDirty(address);
 }
 
 uint16 Ppu::MapCpuToPpuRegister(uint16 cpuAddress)
@@ -766,6 +800,31 @@ void Ppu::ClearOAM2() // OAM2 = $FF
 	memset(m_oam2.RawPtr(), 0xFF, m_oam2.Size());
 }
 
+void Ppu::RebuildSpriteBuckets(uint8 spriteHeight)
+{
+	for (auto& bucket : m_spriteBuckets)
+		bucket.numSprites = 0;
+
+	for (uint8 n = 0; n < kMaxSprites; ++n)
+	{
+		const uint8 spriteY = m_oam.Read(n * kSpriteDataSize);
+		if (spriteY >= kScreenHeight)
+			continue;
+
+		const uint32 endY = std::min<uint32>(spriteY + spriteHeight, kScreenHeight);
+		for (uint32 y = spriteY; y < endY; ++y)
+		{
+			SpriteBucket& bucket = m_spriteBuckets[y];
+			if (bucket.numSprites < ARRAYSIZE(bucket.sprites))
+				bucket.sprites[bucket.numSprites] = n;
+			++bucket.numSprites;
+		}
+	}
+
+	m_spriteBucketsHeight = spriteHeight;
+	m_spriteBucketsDirty = false;
+}
+
 void Ppu::PerformSpriteEvaluation(uint32 /*x*/, uint32 y) // OAM -> OAM2
 {
 	// See http://wiki.nesdev.com/w/index.php/PPU_sprite_evaluation
@@ -777,46 +836,49 @@ void Ppu::PerformSpriteEvaluation(uint32 /*x*/, uint32 y) // OAM -> OAM2
 
 	const bool isSprite8x16 = m_ppuControlReg1->Test(PpuControl1::SpriteSize8x16);
 	const uint8 spriteHeight = isSprite8x16? 16 : 8;
+
+	if (m_spriteBucketsDirty || m_spriteBucketsHeight != spriteHeight)
+	{
+		RebuildSpriteBuckets(spriteHeight);
+	}
 	
 	// Reset sprite vars for current scanline
 	m_numSpritesToRender = 0;
 	m_renderSprite0 = false;
 
-	uint16 n = 0; // Sprite [0-63] in OAM
 	auto& n2 = m_numSpritesToRender; // Sprite [0-7] in OAM2
 
 	typedef uint8 SpriteData[4]; //@TODO: Maybe we should just store m_oam and m_oam2 as arrays of this
 	SpriteData* oam = m_oam.RawPtrAs<SpriteData*>();
 	SpriteData* oam2 = m_oam2.RawPtrAs<SpriteData*>();
 
-	// Attempt to find up to 8 sprites on current scanline
-	while (n2 < 8)
-	{
-		const uint8 spriteY = oam[n][0];
-		oam2[n2][0] = spriteY; // (1)
+	// No sprite is in range of the pre-render scanline
+	const SpriteBucket emptyBucket = {};
+	const SpriteBucket& bucket = y < kScreenHeight? m_spriteBuckets[y] : emptyBucket;
 
-		if (IsSpriteInRangeY(y, spriteY, spriteHeight)) // (1a)
-		{
-			oam2[n2][1] = oam[n][1];
-			oam2[n2][2] = oam[n][2];
-			oam2[n2][3] = oam[n][3];
-
-			if (n == 0) // If we're going to render sprite 0, set flag so we can detect sprite 0 hit when we render
-			{
-				m_renderSprite0 = true;
-			}
+	// Copy up to 8 sprites on current scanline (1, 1a)
+	n2 = static_cast<uint8>(std::min<size_t>(bucket.numSprites, 8));
+	for (uint8 i = 0; i < n2; ++i)
+	{
+		memcpy(oam2[i], oam[bucket.sprites[i]], kSpriteDataSize);
+	}
 
-			++n2;
-		}
+	// If we're going to render sprite 0, set flag so we can detect sprite 0 hit when we render
+	m_renderSprite0 = n2 > 0 && bucket.sprites[0] == 0;
 
-		++n; // (2)
-		if (n == 64) // (2a)
+	if (n2 < 8)
+	{
+		// (2a) Evaluation copied the Y coordinate of every sprite to the next free OAM2 slot, so the
+		// last one remains there unless it was in range
+		if (n2 == 0 || bucket.sprites[n2 - 1] != kMaxSprites - 1)
 		{
-			// We didn't find 8 sprites, OAM2 contains what we've found so far, so we can bail
-			return;
+			oam2[n2][0] = oam[kMaxSprites - 1][0];
 		}
+		return;
 	}
 
+	uint16 n = bucket.sprites[7] + 1; // Sprite [0-63] in OAM, after the 8th found
+
 	// We found 8 sprites above. Let's see if there are any more so we can set sprite overflow flag.
 	uint16 m = 0; // Byte in sprite data [0-3]
 	
@@ -944,12 +1006,12 @@ void Ppu::RenderPixel(uint32 x, uint32 y)
 {
 	// See http://wiki.nesdev.com/w/index.php/PPU_rendering
 
-	static auto GetBackgroundColor = [&] (Color4& color)
+	auto GetBackgroundColor = [&] () -> uint8
 	{
-		color = g_paletteColors[m_palette.Read(0)]; // BG ($3F00)
+		return m_palette.Read(0); // BG ($3F00)
 	};
 
-	static auto GetPaletteColor = [&] (uint8 highBits, uint8 lowBits, uint16 paletteBaseAddress, Color4& color)
+	auto GetPaletteColor = [&] (uint8 highBits, uint8 lowBits, uint16 paletteBaseAddress) -> uint8
 	{
 		assert(lowBits != 0);
 
@@ -958,8 +1020,7 @@ void Ppu::RenderPixel(uint32 x, uint32 y)
 
 		//@NOTE: lowBits is never 0, so we don't have to worry about mapping every 4th byte to 0 (bg color) here.
 		// That case is handled specially in the multiplexer code.
-		const uint8 paletteIndex = m_palette.Read( MapPpuToPalette(paletteBaseAddress + paletteOffset) );
-		color = g_paletteColors[paletteIndex & (kNumPaletteColors-1)]; // Mask in only required bits, some roms write values > 64
+		return m_palette.Read( MapPpuToPalette(paletteBaseAddress + paletteOffset) ); // Some roms write values > 64, masked by MakePpuPixel
 	};
 
 	bool bgRenderingEnabled = m_ppuControlReg2->Test(PpuControl2::RenderBackground);
@@ -975,6 +1036,12 @@ void Ppu::RenderPixel(uint32 x, uint32 y)
 	{
 		spriteRenderingEnabled = false;
 	}
+
+	// Without composition, only sprite shifting and sprite 0 hit below affect emulation
+	if (!m_pixelCompositionEnabled && !spriteRenderingEnabled)
+	{
+		return;
+	}
 	
 	// Get the background pixel
 	uint8 bgPaletteHighBits = 0;
@@ -1042,20 +1109,29 @@ void Ppu::RenderPixel(uint32 x, uint32 y)
 		}
 	}
 
+	if (!m_pixelCompositionEnabled)
+	{
+		if (isSprite0 && bgPaletteLowBits != 0)
+		{
+			m_ppuStatusReg->Set(PpuStatus::PpuHitSprite0);
+		}
+		return;
+	}
+
 	// Multiplexer selects background or sprite pixel (see "Priority multiplexer decision table")
-	Color4 color;
+	uint8 color;
 
 	if (bgPaletteLowBits == 0)
 	{
 		if (!foundSprite || sprPaletteLowBits == 0)
 		{
 			// Background color 0
-			GetBackgroundColor(color);
+			color = GetBackgroundColor();
 		}
 		else
 		{
 			// Sprite color
-			GetPaletteColor(sprPaletteHighBits, sprPaletteLowBits, PpuMemory::kSpritePalette, color);
+			color = GetPaletteColor(sprPaletteHighBits, sprPaletteLowBits, PpuMemory::kSpritePalette);
 		}
 	}
 	else
@@ -1063,12 +1139,12 @@ void Ppu::RenderPixel(uint32 x, uint32 y)
 		if (foundSprite && !spriteHasBgPriority)
 		{
 			// Sprite color
-			GetPaletteColor(sprPaletteHighBits, sprPaletteLowBits, PpuMemory::kSpritePalette, color);
+			color = GetPaletteColor(sprPaletteHighBits, sprPaletteLowBits, PpuMemory::kSpritePalette);
 		}
 		else
 		{
 			// BG color
-			GetPaletteColor(bgPaletteHighBits, bgPaletteLowBits, PpuMemory::kImagePalette, color);
+			color = GetPaletteColor(bgPaletteHighBits, bgPaletteLowBits, PpuMemory::kImagePalette);
 		}
 
 		if (isSprite0)
@@ -1077,7 +1153,7 @@ void Ppu::RenderPixel(uint32 x, uint32 y)
 		}
 	}
 
-	m_renderer->DrawPixel(x, y, color);
+	m_framePixels[y * kScreenWidth + x] = MakePpuPixel(color, *m_ppuControlReg2);
 }
 
 void Ppu::SetVBlankFlag()
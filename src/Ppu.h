@@ -2,7 +2,11 @@
 #include "Base.h"
 #include "Memory.h"
 #include "Bitfield.h"
+#include "PixelConverter.h"
+#include "Upscaler.h"
+#include "DirtyPageHash.h"
 #include <memory>
+#include <vector>
 
 class Renderer;
 class PpuMemoryBus;
@@ -11,6 +15,12 @@ class Nes;
 class Ppu
 {
 public:
+	static const size_t kMaxSprites = 64;
+	static const size_t kSpriteDataSize = 4;
+	static const size_t kSpriteMemorySize = kMaxSprites * kSpriteDataSize;
+	static const size_t kScreenWidth = 256;
+	static const size_t kScreenHeight = 240;
+
 	Ppu();
 	void Initialize(PpuMemoryBus& ppuMemoryBus, Nes& nes);
 
@@ -20,11 +30,33 @@ public:
 	void Execute(uint32 cpuCycles, bool& completedFrame);
 	void RenderFrame(); // Call when Execute() sets completedFrame to true
 
+	// When disabled, frames are emulated exactly (timing, VRAM address, sprite overflow and sprite 0
+	// hit) but no pixels are composed, leaving the frame buffer as is. Enabled by default.
+	void SetPixelCompositionEnabled(bool enabled) { m_pixelCompositionEnabled = enabled; }
+
+	// Window only, see Renderer::SetUpscaleFilter
+	void SetUpscaleFilter(UpscaleFilter::Type filter);
+
+	// ARGB8888 pixels of the last frame rendered, rows 'pitch' bytes apart (see Renderer::GetBackBuffer)
+	const uint8* GetFrameBuffer(size_t& pitch) const;
+
+	// 256x240 pixels of the frame being composed, or of the last one if composition is disabled. Use
+	// PixelConverter to get colors.
+	const PpuPixel* GetFramePixels() const { return m_framePixels.data(); }
+
 	uint8 HandleCpuRead(uint16 cpuAddress);
 	void HandleCpuWrite(uint16 cpuAddress, uint8 value);
+
+	// Returns false if reading $2002 now would change PPU state, otherwise sets value to what the
+	// read would return
+	bool PeekStatusRead(uint8& value);
+
 	uint8 HandlePpuRead(uint16 ppuAddress);
 	void HandlePpuWrite(uint16 ppuAddress, uint8 value);
 
+	// Equivalent to writing the kSpriteMemorySize bytes of source to $2004 (OAMDATA)
+	void OamDmaTransfer(const uint8* source);
+
 private:
 	uint16 MapCpuToPpuRegister(uint16 cpuAddress);
 	uint16 MapPpuToVRam(uint16 ppuAddress);
@@ -37,6 +69,7 @@ private:
 	void FetchBackgroundTileData();
 	
 	void ClearOAM2(); // OAM2 = $FF
+	void RebuildSpriteBuckets(uint8 spriteHeight);
 	void PerformSpriteEvaluation(uint32 x, uint32 y); // OAM -> OAM2
 	void FetchSpriteData(uint32 y); // OAM2 -> render (shift) registers
 
@@ -52,20 +85,32 @@ private:
 	// Memory used to store name/attribute tables (aka CIRAM)
 	typedef Memory<FixedSizeStorage<KB(2)>> NameTableMemory;
 	NameTableMemory m_nameTables;
+	DirtyPageHash m_nameTablePages;
 
 	typedef Memory<FixedSizeStorage<32>> PaletteMemory;
 	PaletteMemory m_palette;
 
-	static const size_t kMaxSprites = 64;
-	static const size_t kSpriteDataSize = 4;
-	static const size_t kSpriteMemorySize = kMaxSprites * kSpriteDataSize;
 	typedef Memory<FixedSizeStorage<kSpriteMemorySize>> ObjectAttributeMemory; // Sprite memory
 	ObjectAttributeMemory m_oam;
+	DirtyPageHash m_oamPages;
 
 	typedef Memory<FixedSizeStorage<kSpriteDataSize * 8>> ObjectAttributeMemory2;
 	ObjectAttributeMemory2 m_oam2;
 	uint8 m_numSpritesToRender;
 	bool m_renderSprite0;
+
+	// Sprites in range of each visible scanline, so that evaluation doesn't scan all of OAM. Rebuilt
+	// when sprite Y coordinates or the sprite height change.
+	struct SpriteBucket
+	{
+		uint8 numSprites; // All sprites in range, may be more than 8
+		uint8 sprites[8]; // OAM index of the first 8, in OAM order
+	};
+	SpriteBucket m_spriteBuckets[kScreenHeight];
+	uint8 m_spriteBucketsHeight;
+	bool m_spriteBucketsDirty;
+	bool m_pixelCompositionEnabled;
+	std::vector<PpuPixel> m_framePixels; // Converted to the renderer's back buffer by RenderFrame
 	
 	// Memory mapped registers
 	typedef Memory<FixedSizeStorage<8>> PpuRegisterMemory; // $2000 - $2007
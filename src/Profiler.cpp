@@ -0,0 +1,356 @@
+#include "Profiler.h"
+
+#if PROFILING_ENABLED
+
+#include "Nes.h"
+#include "OpCodeTable.h"
+#include "MemoryMap.h"
+#include "System.h"
+#include "Stream.h"
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <string>
+
+namespace
+{
+	const size_t kNumAddressModes = 13;
+	const char* kAddressModeNames[kNumAddressModes] =
+	{
+		"Immedt", "Implid", "Accumu", "Relatv", "ZeroPg", "ZPIdxX", "ZPIdxY",
+		"Absolu", "AbIdxX", "AbIdxY", "Indrct", "IdxInd", "IndIdx",
+	};
+
+	// AddressMode::Type values are single bits, so the index is the bit position
+	size_t GetAddressModeIndex(AddressMode::Type addrMode)
+	{
+		size_t index = 0;
+		for (uint32 value = addrMode; value > 1; value >>= 1)
+			++index;
+		assert(index < kNumAddressModes);
+		return index;
+	}
+
+	const size_t kNoBank = ~static_cast<size_t>(0); // For code executed outside of PRG ROM (e.g. RAM)
+	const size_t kMaxCallDepth = 256;
+
+	// Call frame keys: bank in bits 16-23, address in bits 0-15, interrupt type in the top bits
+	const uint32 kFrameNmi = BIT(30);
+	const uint32 kFrameIrq = BIT(31);
+	const uint32 kFrameNoBank = 0xFF << 16;
+
+	struct Counters
+	{
+		Counters() : count(0), cycles(0) {}
+
+		void Add(uint64 numCycles)
+		{
+			++count;
+			cycles += numCycles;
+		}
+
+		uint64 count;
+		uint64 cycles;
+	};
+
+	struct PcStats : Counters
+	{
+		PcStats() : bankIndex(kNoBank), pc(0), opCode(0) {}
+
+		size_t bankIndex;
+		uint16 pc;
+		uint8 opCode;
+	};
+
+	struct CallNode
+	{
+		uint32 parent;
+		uint32 frameKey;
+		uint64 selfCycles;
+	};
+}
+
+class ProfilerImpl
+{
+public:
+	ProfilerImpl()
+		: m_nes(nullptr)
+	{
+	}
+
+	void Initialize(Nes& nes)
+	{
+		m_nes = &nes;
+		Reset();
+	}
+
+	void Shutdown()
+	{
+		const std::string& profileDir = System::GetAppDirectory() + std::string("profile/");
+		System::CreateDirectory(profileDir.c_str());
+		WriteReports(profileDir.c_str());
+	}
+
+	void Reset()
+	{
+		std::fill(std::begin(m_opCodeStats), std::end(m_opCodeStats), Counters());
+		std::fill(std::begin(m_addressModeStats), std::end(m_addressModeStats), Counters());
+		m_opCodeExtraCycles.fill(0);
+		m_pcStats.clear();
+
+		m_callNodes.clear();
+		m_callNodeLookup.clear();
+		CallNode root = { 0, 0, 0 };
+		m_callNodes.push_back(root);
+		m_callStack.clear();
+		m_callStack.push_back(0);
+		m_unbalancedCallDepth = 0;
+	}
+
+	void PreCpuInstruction()
+	{
+		const Cpu& cpu = m_nes->m_cpu;
+		m_pc = cpu.PC;
+		m_opCodeEntry = cpu.m_opCodeEntry;
+		m_startCycles = cpu.m_cycles;
+	}
+
+	void PostCpuInstruction()
+	{
+		const Cpu& cpu = m_nes->m_cpu;
+		const uint64 numCycles = cpu.m_cycles - m_startCycles;
+		const OpCodeEntry& entry = *m_opCodeEntry;
+
+		m_opCodeStats[entry.opCode].Add(numCycles);
+		m_opCodeExtraCycles[entry.opCode] += numCycles - entry.numCycles; // Page crosses, taken branches, DMA stalls
+		m_addressModeStats[GetAddressModeIndex(entry.addrMode)].Add(numCycles);
+
+		const size_t bankIndex = GetBankIndex(m_pc);
+		PcStats& pcStats = GetPcStats(m_pc, bankIndex);
+		pcStats.Add(numCycles);
+		pcStats.opCode = entry.opCode;
+
+		m_callNodes[m_callStack.back()].selfCycles += numCycles;
+
+		switch (entry.opCodeName)
+		{
+		case OpCodeName::JSR:
+			PushCallFrame(MakeFrameKey(cpu.PC));
+			break;
+
+		case OpCodeName::RTS:
+		case OpCodeName::RTI:
+			PopCallFrame();
+			break;
+
+		default:
+			break;
+		}
+	}
+
+	void CpuInterrupt(bool nmi)
+	{
+		PushCallFrame(MakeFrameKey(m_nes->m_cpu.PC) | (nmi? kFrameNmi : kFrameIrq));
+	}
+
+	void WriteReports(const char* directory)
+	{
+		const std::string dir = directory;
+		WriteOpCodeReport((dir + "opcodes.csv").c_str());
+		WriteAddressModeReport((dir + "addrmodes.csv").c_str());
+		WritePcReport((dir + "pcs.csv").c_str());
+		WriteFoldedStacks((dir + "callstacks.folded").c_str());
+	}
+
+private:
+	size_t GetBankIndex(uint16 cpuAddress) const
+	{
+		if (cpuAddress < CpuMemory::kPrgRomBase)
+			return kNoBank;
+		return m_nes->m_cartridge.GetPrgBankIndex4k(cpuAddress);
+	}
+
+	// Flat table: non-PRG addresses first, followed by each mapped 4K PRG bank
+	PcStats& GetPcStats(uint16 cpuAddress, size_t bankIndex)
+	{
+		const size_t index = bankIndex == kNoBank
+			? cpuAddress
+			: CpuMemory::kPrgRomBase + bankIndex * KB(4) + (cpuAddress & (KB(4) - 1));
+
+		if (index >= m_pcStats.size())
+			m_pcStats.resize(index + KB(4));
+
+		PcStats& pcStats = m_pcStats[index];
+		pcStats.bankIndex = bankIndex;
+		pcStats.pc = cpuAddress;
+		return pcStats;
+	}
+
+	uint32 MakeFrameKey(uint16 cpuAddress) const
+	{
+		const size_t bankIndex = GetBankIndex(cpuAddress);
+		const uint32 bankBits = bankIndex == kNoBank? kFrameNoBank : static_cast<uint32>((bankIndex & 0xFF) << 16);
+		return bankBits | cpuAddress;
+	}
+
+	void PushCallFrame(uint32 frameKey)
+	{
+		if (m_callStack.size() >= kMaxCallDepth)
+		{
+			++m_unbalancedCallDepth;
+			return;
+		}
+
+		const uint32 parent = m_callStack.back();
+		const uint64 lookupKey = (static_cast<uint64>(parent) << 32) | frameKey;
+
+		auto iter = m_callNodeLookup.find(lookupKey);
+		if (iter == m_callNodeLookup.end())
+		{
+			CallNode node = { parent, frameKey, 0 };
+			m_callNodes.push_back(node);
+			iter = m_callNodeLookup.insert(std::make_pair(lookupKey, static_cast<uint32>(m_callNodes.size() - 1))).first;
+		}
+		m_callStack.push_back(iter->second);
+	}
+
+	void PopCallFrame()
+	{
+		if (m_unbalancedCallDepth > 0)
+		{
+			--m_unbalancedCallDepth;
+		}
+		else if (m_callStack.size() > 1) // Games sometimes use RTS as an indirect jump, don't pop the root
+		{
+			m_callStack.pop_back();
+		}
+	}
+
+	static void PrintFrameName(FileStream& fs, uint32 frameKey)
+	{
+		if (frameKey & kFrameNmi)
+			fs.Printf("NMI_");
+		else if (frameKey & kFrameIrq)
+			fs.Printf("IRQ_");
+
+		const uint32 bankBits = frameKey & kFrameNoBank;
+		if (bankBits != kFrameNoBank)
+			fs.Printf("%02X:", bankBits >> 16);
+		fs.Printf(ADDR_16, frameKey & 0xFFFF);
+	}
+
+	void WriteOpCodeReport(const char* file)
+	{
+		FileStream fs(file, "w");
+		fs.Printf("opcode,name,addrmode,count,cycles,avg_cycles,extra_cycles\n");
+
+		OpCodeEntry** opCodeTable = GetOpCodeTable();
+		for (size_t i = 0; i < 256; ++i)
+		{
+			const Counters& c = m_opCodeStats[i];
+			if (c.count == 0)
+				continue;
+
+			const OpCodeEntry& entry = *opCodeTable[i];
+			fs.Printf("%02X,%s,%s,%llu,%llu,%.2f,%llu\n", entry.opCode, OpCodeName::String[entry.opCodeName],
+				kAddressModeNames[GetAddressModeIndex(entry.addrMode)], c.count, c.cycles,
+				static_cast<float64>(c.cycles) / c.count, m_opCodeExtraCycles[i]);
+		}
+	}
+
+	void WriteAddressModeReport(const char* file)
+	{
+		FileStream fs(file, "w");
+		fs.Printf("addrmode,count,cycles\n");
+
+		for (size_t i = 0; i < kNumAddressModes; ++i)
+		{
+			const Counters& c = m_addressModeStats[i];
+			fs.Printf("%s,%llu,%llu\n", kAddressModeNames[i], c.count, c.cycles);
+		}
+	}
+
+	void WritePcReport(const char* file)
+	{
+		std::vector<const PcStats*> sorted;
+		for (const auto& pcStats : m_pcStats)
+		{
+			if (pcStats.count > 0)
+				sorted.push_back(&pcStats);
+		}
+		std::sort(sorted.begin(), sorted.end(), [] (const PcStats* lhs, const PcStats* rhs) { return lhs->cycles > rhs->cycles; });
+
+		FileStream fs(file, "w");
+		fs.Printf("bank,pc,name,count,cycles\n");
+
+		OpCodeEntry** opCodeTable = GetOpCodeTable();
+		for (const PcStats* pcStats : sorted)
+		{
+			if (pcStats->bankIndex == kNoBank)
+				fs.Printf("-,");
+			else
+				fs.Printf("%02X,", static_cast<uint32>(pcStats->bankIndex));
+
+			fs.Printf(ADDR_16 ",%s,%llu,%llu\n", pcStats->pc,
+				OpCodeName::String[opCodeTable[pcStats->opCode]->opCodeName], pcStats->count, pcStats->cycles);
+		}
+	}
+
+	// One line per call stack with its self cycles, e.g. "RESET;NMI_07:$C0A2;07:$C3F0 1234",
+	// as consumed by flamegraph.pl and speedscope.
+	void WriteFoldedStacks(const char* file)
+	{
+		FileStream fs(file, "w");
+
+		std::vector<uint32> path;
+		for (size_t i = 0; i < m_callNodes.size(); ++i)
+		{
+			if (m_callNodes[i].selfCycles == 0)
+				continue;
+
+			path.clear();
+			for (uint32 nodeIndex = static_cast<uint32>(i); nodeIndex != 0; nodeIndex = m_callNodes[nodeIndex].parent)
+				path.push_back(nodeIndex);
+
+			fs.Printf("RESET");
+			for (auto iter = path.rbegin(); iter != path.rend(); ++iter)
+			{
+				fs.Printf(";");
+				PrintFrameName(fs, m_callNodes[*iter].frameKey);
+			}
+			fs.Printf(" %llu\n", m_callNodes[i].selfCycles);
+		}
+	}
+
+	Nes* m_nes;
+
+	// Current instruction
+	uint16 m_pc;
+	const OpCodeEntry* m_opCodeEntry;
+	uint64 m_startCycles;
+
+	Counters m_opCodeStats[256];
+	std::array<uint64, 256> m_opCodeExtraCycles;
+	Counters m_addressModeStats[kNumAddressModes];
+	std::vector<PcStats> m_pcStats;
+
+	std::vector<CallNode> m_callNodes; // Node 0 is the root (reset vector)
+	std::unordered_map<uint64, uint32> m_callNodeLookup; // (parent node, frame key) -> node
+	std::vector<uint32> m_callStack;
+	size_t m_unbalancedCallDepth;
+};
+
+namespace Profiler
+{
+	static ProfilerImpl g_profiler;
+
+	void Initialize(Nes& nes) { g_profiler.Initialize(nes); }
+	void Shutdown() { g_profiler.Shutdown(); }
+	void Reset() { g_profiler.Reset(); }
+	void WriteReports(const char* directory) { g_profiler.WriteReports(directory); }
+	void PreCpuInstruction() { g_profiler.PreCpuInstruction(); }
+	void PostCpuInstruction() { g_profiler.PostCpuInstruction(); }
+	void CpuInterrupt(bool nmi) { g_profiler.CpuInterrupt(nmi); }
+}
+
+#endif // PROFILING_ENABLED
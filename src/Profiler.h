@@ -0,0 +1,30 @@
+#pragma once
+
+#include "Base.h"
+
+// If set, emulated CPU profiling is enabled (per opcode, addressing mode, PC and call stack). Reports are
+// written to the "profile" folder in the app directory on shutdown.
+#define PROFILING_ENABLED 0
+
+class Nes;
+
+namespace Profiler
+{
+#if PROFILING_ENABLED
+	void Initialize(Nes& nes);
+	void Shutdown();
+	void Reset(); // Clears all collected data
+	void WriteReports(const char* directory);
+	void PreCpuInstruction();
+	void PostCpuInstruction();
+	void CpuInterrupt(bool nmi); // Call after PC has been set to the interrupt handler
+#else
+	FORCEINLINE void Initialize(Nes&) {}
+	FORCEINLINE void Shutdown() {}
+	FORCEINLINE void Reset() {}
+	FORCEINLINE void WriteReports(const char*) {}
+	FORCEINLINE void PreCpuInstruction() {}
+	FORCEINLINE void PostCpuInstruction() {}
+	FORCEINLINE void CpuInterrupt(bool) {}
+#endif
+}
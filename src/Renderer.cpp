@@ -1,78 +1,170 @@
 #include "Renderer.h"
 #define SDL_MAIN_HANDLED // Don't use SDL's main impl
 #include <SDL.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstring>
+
+// Upscale frames on a dedicated thread, so that the emulation thread doesn't spend time filtering
+// them. SDL calls stay on the thread that created the window, which must also pump its events.
+#define UPSCALE_THREAD_ENABLED 1
 
-extern void DebugDrawAudio(SDL_Renderer* renderer);
-	
 namespace
 {
 	SDL_Window* g_mainWindow = nullptr;
 
-	class BackBuffer
+	// Shows upscaled frames in the window. An SDL renderer may only be used from the thread that
+	// created it, which must be the window's thread, so all calls must be made from that thread.
+	class Display
 	{
 	public:
-		void Create(size_t width, size_t height, SDL_Renderer* renderer)
+		Display()
+			: m_renderer(NULL)
+			, m_texture(NULL)
+			, m_width(0)
+			, m_height(0)
 		{
-			m_width = width;
-			m_height = height;
-			m_backbufferTexture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
-			Lock();
 		}
 
-		void Clear(const Color4& color)
+		bool Create(SDL_Window* window)
 		{
-			auto pCurrRow = reinterpret_cast<Uint32*>(m_backbuffer);
-			for (int32 y = 0; y < m_height; ++y, pCurrRow += (m_pitch/4))
-			{
-				for (int32 x = 0; x < m_width; ++x)
-					pCurrRow[x] = color.argb;
-			}
+			m_renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
+			return m_renderer != NULL;
 		}
 
-		void Flip(SDL_Renderer* renderer)
+		void Destroy()
 		{
-			Unlock();
-			SDL_RenderCopy(renderer, m_backbufferTexture, NULL, NULL);
-
-			DebugDrawAudio(renderer);
-
-			SDL_RenderPresent(renderer);
-			Lock();
+			if (m_texture)
+				SDL_DestroyTexture(m_texture);
+			if (m_renderer)
+				SDL_DestroyRenderer(m_renderer);
+			m_texture = NULL;
+			m_renderer = NULL;
 		}
 
-		FORCEINLINE Uint32& operator()(int32 x, int32 y)
+		void Show(const Uint8* pixels, size_t width, size_t height)
 		{
-			assert(x < m_width && y < m_height);
-			return reinterpret_cast<Uint32&>(m_backbuffer[y * m_pitch + x * sizeof(Uint32)]);
+			// The texture is the size of the upscaled frame
+			if (!m_texture || width != m_width || height != m_height)
+			{
+				if (m_texture)
+					SDL_DestroyTexture(m_texture);
+
+				m_width = width;
+				m_height = height;
+				m_texture = SDL_CreateTexture(m_renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, m_width, m_height);
+			}
+
+			Uint8* texturePixels;
+			int32 texturePitch;
+			SDL_LockTexture(m_texture, NULL, (void**)(&texturePixels), &texturePitch);
+			const size_t pitch = width * sizeof(Uint32);
+			for (size_t y = 0; y < height; ++y)
+				memcpy(texturePixels + y * texturePitch, pixels + y * pitch, pitch);
+			SDL_UnlockTexture(m_texture);
+
+			SDL_RenderCopy(m_renderer, m_texture, NULL, NULL);
+
+			SDL_RenderPresent(m_renderer);
 		}
 
 	private:
-		void Lock()
-		{
-			SDL_LockTexture(m_backbufferTexture, NULL, (void**)(&m_backbuffer), &m_pitch);
-		}
-		void Unlock()
-		{
-			SDL_UnlockTexture(m_backbufferTexture);
-		}
+		SDL_Renderer* m_renderer;
+		SDL_Texture* m_texture;
+		size_t m_width, m_height;
+	};
 
-		SDL_Texture* m_backbufferTexture;
-		Uint8* m_backbuffer;
-		int32 m_width, m_height, m_pitch;
+	struct UpscaledFrame
+	{
+		std::vector<Uint8> pixels; // Rows are width * scale pixels, without padding
+		size_t scale;
 	};
 }
 
+// Frames are drawn to system memory and handed to the upscale thread through 3 buffers: the
+// emulation thread draws to the write buffer, and Present swaps it with the ready buffer. The
+// upscale thread swaps the ready buffer with the one it upscales from once it's done with the
+// previous frame, and hands the result back the same way through 3 upscaled frames, which Present
+// shows. Neither thread ever waits for the other longer than a swap; frames that can't be kept up
+// with are dropped. A frame is shown by the Present after the one that drew it.
+// Headless, only the write buffer is used.
 struct Renderer::PIMPL
 {
 	PIMPL()
 		: m_window(NULL)
-		, m_renderer(NULL)
+		, m_writeIndex(0)
+		, m_readyIndex(1)
+		, m_upscaleIndex(2)
+		, m_newFrameReady(false)
+		, m_upscaledWriteIndex(0)
+		, m_upscaledReadyIndex(1)
+		, m_upscaledShowIndex(2)
+		, m_newUpscaledFrameReady(false)
+		, m_upscaleFilter(UpscaleFilter::None)
+		, m_quit(false)
 	{
 	}
 
+	Uint8* WriteBuffer() { return m_buffers[m_writeIndex].data(); }
+	const Uint8* WriteBuffer() const { return m_buffers[m_writeIndex].data(); }
+
+	void Upscale(const Uint8* pixels, UpscaleFilter::Type upscaleFilter, UpscaledFrame& upscaled)
+	{
+		if (upscaleFilter != m_upscaler.GetFilter())
+			m_upscaler.SetFilter(upscaleFilter);
+
+		upscaled.scale = m_upscaler.GetScale();
+		const size_t pitch = m_width * upscaled.scale * sizeof(Uint32);
+		upscaled.pixels.resize(pitch * m_height * upscaled.scale);
+		m_upscaler.Apply(pixels, m_pitch, m_width, m_height, upscaled.pixels.data(), pitch); // Plain copy without a filter
+	}
+
+	void Show(const UpscaledFrame& upscaled)
+	{
+		m_display.Show(upscaled.pixels.data(), m_width * upscaled.scale, m_height * upscaled.scale);
+	}
+
+	void UpscaleThreadMain()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		for (;;)
+		{
+			m_frameReadyCondition.wait(lock, [this] { return m_quit || m_newFrameReady; });
+			if (m_quit)
+				break;
+
+			std::swap(m_readyIndex, m_upscaleIndex);
+			m_newFrameReady = false;
+			const UpscaleFilter::Type upscaleFilter = m_upscaleFilter;
+
+			lock.unlock();
+			Upscale(m_buffers[m_upscaleIndex].data(), upscaleFilter, m_upscaledFrames[m_upscaledWriteIndex]);
+			lock.lock();
+
+			std::swap(m_upscaledWriteIndex, m_upscaledReadyIndex);
+			m_newUpscaledFrameReady = true;
+		}
+	}
+
 	SDL_Window* m_window;
-	SDL_Renderer* m_renderer;
-	BackBuffer m_backbuffer;
+	size_t m_width, m_height, m_pitch;
+	std::vector<Uint8> m_buffers[3];
+	size_t m_writeIndex, m_readyIndex, m_upscaleIndex;
+	bool m_newFrameReady;
+	UpscaledFrame m_upscaledFrames[3];
+	size_t m_upscaledWriteIndex, m_upscaledReadyIndex, m_upscaledShowIndex;
+	bool m_newUpscaledFrameReady;
+	UpscaleFilter::Type m_upscaleFilter;
+	Upscaler m_upscaler; // Used by the upscale thread if enabled, otherwise by Present
+	Display m_display; // Only used from the window's thread
+
+	std::thread m_upscaleThread;
+	std::mutex m_mutex;
+	std::condition_variable m_frameReadyCondition;
+	bool m_quit;
 };
 
 Renderer::Renderer()
@@ -93,29 +185,39 @@ void Renderer::SetWindowTitle(const char* title)
 	}
 }
 
-void Renderer::Create(size_t screenWidth, size_t screenHeight)
+void Renderer::Create(size_t screenWidth, size_t screenHeight, bool headless)
 {
 	assert(!m_impl);
 	m_impl = new PIMPL();
 
+	m_impl->m_width = screenWidth;
+	m_impl->m_height = screenHeight;
+	m_impl->m_pitch = screenWidth * sizeof(Uint32);
+	for (auto& buffer : m_impl->m_buffers)
+		buffer.resize(screenHeight * m_impl->m_pitch);
+
+	Clear();
+
+	if (headless)
+		return;
+
 	if( SDL_Init( SDL_INIT_VIDEO ) < 0 )
 		FAIL("SDL_Init failed");
 
 	const float windowScale = 3.0f;
 	const size_t windowWidth = static_cast<size_t>(screenWidth * windowScale);
 	const size_t windowHeight = static_cast<size_t>(screenHeight * windowScale);
-	
+
 	m_impl->m_window = SDL_CreateWindow("", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, windowWidth, windowHeight, SDL_WINDOW_SHOWN);
 	if (!m_impl->m_window)
 		FAIL("SDL_CreateWindow failed");
 
-	m_impl->m_renderer = SDL_CreateRenderer(m_impl->m_window, -1, SDL_RENDERER_ACCELERATED);
-	if (!m_impl->m_renderer)
+	if (!m_impl->m_display.Create(m_impl->m_window))
 		FAIL("SDL_CreateRenderer failed");
 
-	m_impl->m_backbuffer.Create(screenWidth, screenHeight, m_impl->m_renderer);
-
-	Clear();
+#if UPSCALE_THREAD_ENABLED
+	m_impl->m_upscaleThread = std::thread(&PIMPL::UpscaleThreadMain, m_impl);
+#endif
 
 	g_mainWindow = m_impl->m_window;
 }
@@ -124,25 +226,86 @@ void Renderer::Destroy()
 {
 	if (m_impl)
 	{
-		SDL_DestroyRenderer(m_impl->m_renderer);
-		SDL_DestroyWindow(m_impl->m_window);
+		if (m_impl->m_upscaleThread.joinable())
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_impl->m_mutex);
+				m_impl->m_quit = true;
+			}
+			m_impl->m_frameReadyCondition.notify_all();
+			m_impl->m_upscaleThread.join();
+		}
+
+		if (m_impl->m_window)
+		{
+			m_impl->m_display.Destroy();
+			SDL_DestroyWindow(m_impl->m_window);
+			g_mainWindow = nullptr;
+		}
 		delete m_impl;
 		m_impl = nullptr;
-		g_mainWindow = nullptr;
 	}
 }
 
 void Renderer::Clear(const Color4& color)
 {
-	m_impl->m_backbuffer.Clear(color);
+	for (auto& buffer : m_impl->m_buffers)
+	{
+		auto pixels = reinterpret_cast<Uint32*>(buffer.data());
+		std::fill(pixels, pixels + m_impl->m_width * m_impl->m_height, color.argb);
+	}
 }
 
 void Renderer::DrawPixel(int32 x, int32 y, const Color4& color)
 {
-	m_impl->m_backbuffer(x, y) = color.argb;
+	assert(x < static_cast<int32>(m_impl->m_width) && y < static_cast<int32>(m_impl->m_height));
+	reinterpret_cast<Uint32*>(m_impl->WriteBuffer() + y * m_impl->m_pitch)[x] = color.argb;
+}
+
+void Renderer::SetUpscaleFilter(UpscaleFilter::Type filter)
+{
+	std::lock_guard<std::mutex> lock(m_impl->m_mutex);
+	m_impl->m_upscaleFilter = filter;
 }
 
 void Renderer::Present()
 {
-	m_impl->m_backbuffer.Flip(m_impl->m_renderer);
+	if (!m_impl->m_window)
+		return;
+
+#if UPSCALE_THREAD_ENABLED
+	bool newUpscaledFrame;
+	{
+		std::lock_guard<std::mutex> lock(m_impl->m_mutex);
+		std::swap(m_impl->m_writeIndex, m_impl->m_readyIndex);
+		m_impl->m_newFrameReady = true;
+
+		newUpscaledFrame = m_impl->m_newUpscaledFrameReady;
+		if (newUpscaledFrame)
+		{
+			std::swap(m_impl->m_upscaledReadyIndex, m_impl->m_upscaledShowIndex);
+			m_impl->m_newUpscaledFrameReady = false;
+		}
+	}
+	m_impl->m_frameReadyCondition.notify_one();
+
+	if (newUpscaledFrame)
+		m_impl->Show(m_impl->m_upscaledFrames[m_impl->m_upscaledShowIndex]);
+#else
+	UpscaledFrame& upscaled = m_impl->m_upscaledFrames[m_impl->m_upscaledShowIndex];
+	m_impl->Upscale(m_impl->WriteBuffer(), m_impl->m_upscaleFilter, upscaled);
+	m_impl->Show(upscaled);
+#endif
+}
+
+const uint8* Renderer::GetBackBuffer(size_t& pitch) const
+{
+	pitch = m_impl->m_pitch;
+	return m_impl->WriteBuffer();
+}
+
+uint8* Renderer::GetBackBuffer(size_t& pitch)
+{
+	pitch = m_impl->m_pitch;
+	return m_impl->WriteBuffer();
 }
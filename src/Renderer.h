@@ -1,6 +1,7 @@
 #pragma once
 
 #include "Base.h"
+#include "Upscaler.h"
 
 struct Color4
 {
@@ -39,14 +40,24 @@ public:
 
 	static void SetWindowTitle(const char* title);
 
-	void Create(size_t screenWidth, size_t screenHeight);
+	// If headless, no window is created and pixels are only drawn to system memory
+	void Create(size_t screenWidth, size_t screenHeight, bool headless = false);
 	void Destroy();
 
 	void Clear(const Color4& color = Color4::Black());
 	void DrawPixel(int32 x, int32 y, const Color4& color);
 	
+	// Applied to presented frames on the upscale thread, window only (see Upscaler to upscale
+	// headless frames)
+	void SetUpscaleFilter(UpscaleFilter::Type filter);
+
 	void Present();
 
+	// Returns pixels drawn since the last Present, rows 'pitch' bytes apart. Present hands the buffer
+	// to the display and replaces it with an older frame, so it must be fully redrawn after.
+	const uint8* GetBackBuffer(size_t& pitch) const;
+	uint8* GetBackBuffer(size_t& pitch); // To write pixels in bulk
+
 private:
 	struct PIMPL;
 	PIMPL* m_impl;
@@ -6,6 +6,8 @@
 
 RewindManager::RewindManager()
 	: m_nes(nullptr)
+	, m_rewinding(false)
+	, m_rewindBuffer(nullptr)
 {
 }
 
@@ -27,7 +29,8 @@ void RewindManager::Initialize(Nes& nes)
 
 void RewindManager::ClearRewindStates()
 {
-	m_rewindBuffer->Clear();
+	if (m_rewindBuffer)
+		m_rewindBuffer->Clear();
 }
 
 void RewindManager::SetRewinding(bool enable)
@@ -2,50 +2,107 @@
 
 #include "Base.h"
 #include "Stream.h"
+#include "DirtyPageHash.h"
 #include <type_traits>
 #include <string>
+#include <vector>
+#include <algorithm>
 
 #define SERIALIZE(value) serializer.SerializeValue(#value, value)
 #define SERIALIZE_BUFFER(buffer, size) serializer.SerializeBuffer(#buffer, reinterpret_cast<uint8*>(buffer), size)
 
+// Same as above for memory whose writes are tracked by a DirtyPageHash, see HashRootObject
+#define SERIALIZE_TRACKED(value, dirtyPageHash) serializer.SerializeTrackedValue(#value, value, dirtyPageHash)
+#define SERIALIZE_TRACKED_BUFFER(buffer, size, dirtyPageHash) serializer.SerializeTrackedBuffer(#buffer, reinterpret_cast<uint8*>(buffer), size, dirtyPageHash)
+
 class Serializer
 {
 public:
+	// Tagged data stores the name and size of each value, which is checked on load. Untagged data is
+	// only the values, which is smaller and faster, but can only be loaded back into objects of the same
+	// layout (same build and rom), and mismatches go undetected.
 	template <typename SerializableObject>
-	static void SaveRootObject(IStream& stream, SerializableObject& serializable)
+	static void SaveRootObject(IStream& stream, SerializableObject& serializable, bool tagged = true)
 	{
 		Serializer serializer;
-		serializer.BeginSave(stream);
+		serializer.BeginSave(stream, tagged);
 		serializer.SerializeObject(serializable);
 		serializer.End();
 	}
 
 	template <typename SerializableObject>
-	static void LoadRootObject(IStream& stream, SerializableObject& serializable)
+	static void LoadRootObject(IStream& stream, SerializableObject& serializable, bool tagged = true)
 	{
 		Serializer serializer;
-		serializer.BeginLoad(stream);
+		serializer.BeginLoad(stream, tagged);
 		serializer.SerializeObject(serializable);
 		serializer.End();
 	}
 
-	void BeginSave(IStream& stream)
+	// Hash of what would be saved, except that tracked memory (see SERIALIZE_TRACKED) contributes the
+	// hash of its DirtyPageHash, which only rehashes pages written since the last call. Values are
+	// gathered in buffer, reused across calls so that hashing doesn't allocate.
+	template <typename SerializableObject>
+	static uint64 HashRootObject(SerializableObject& serializable, std::vector<uint8>& buffer)
+	{
+		Serializer serializer;
+		serializer.BeginHash(buffer);
+		serializer.SerializeObject(serializable);
+		return serializer.EndHash();
+	}
+
+	Serializer()
+		: m_stream(nullptr)
+		, m_saving(false)
+		, m_tagged(true)
+		, m_hashBuffer(nullptr)
+		, m_hashCurr(nullptr)
+		, m_hashEnd(nullptr)
+	{
+	}
+
+	void BeginSave(IStream& stream, bool tagged = true)
 	{
 		m_saving = true;
+		m_tagged = tagged;
 		m_stream = &stream; // shared_ptr?
 	}
 
-	void BeginLoad(IStream& stream)
+	void BeginLoad(IStream& stream, bool tagged = true)
 	{
 		m_saving = false;
+		m_tagged = tagged;
 		m_stream = &stream;
 	}
 
+	// Hashing saves, as far as serializable objects are concerned
+	void BeginHash(std::vector<uint8>& buffer)
+	{
+		m_saving = true;
+		m_hashBuffer = &buffer;
+		m_hashCurr = buffer.data();
+		m_hashEnd = buffer.data() + buffer.size();
+	}
+
 	void End()
 	{
 		m_stream->Close();
 	}
 
+	uint64 EndHash()
+	{
+		// Pad to whole blocks
+		const size_t size = m_hashCurr - m_hashBuffer->data();
+		const size_t paddedSize = (size + 31) & ~31;
+		GrowHashBuffer(paddedSize - size);
+		std::fill(m_hashCurr, m_hashCurr + (paddedSize - size), 0);
+		const uint64 hash = HashBlocks64(m_hashBuffer->data(), paddedSize, size);
+		m_hashBuffer = nullptr;
+		return hash;
+	}
+
+	bool IsSaving() const { return m_saving; }
+
 	// Client is expected to implement a function with signature:
 	//   void Serialize(class Serializer& serializer, bool saving);
 	template <typename SerializableObject>
@@ -63,7 +120,18 @@ public:
 		static_assert(std::is_trivially_copyable<T>::value, "Type must be trivially copyable to serialize");
 		static_assert(!std::is_pointer<T>::value, "Unsafe to serialize a pointer");
 
-		if (m_saving)
+		if (m_hashBuffer)
+		{
+			AppendToHash(&value, sizeof(T));
+		}
+		else if (!m_tagged)
+		{
+			if (m_saving)
+				m_stream->WriteValue(value);
+			else
+				m_stream->ReadValue(value);
+		}
+		else if (m_saving)
 		{
 			WriteString(name);
 			WriteValue(value);
@@ -81,7 +149,18 @@ public:
 	// User SERIALIZE_BUFFER macro to invoke this function
 	void SerializeBuffer(const char* name, uint8* buffer, size_t size)
 	{
-		if (m_saving)
+		if (m_hashBuffer)
+		{
+			AppendToHash(buffer, size);
+		}
+		else if (!m_tagged)
+		{
+			if (m_saving)
+				m_stream->Write(buffer, size);
+			else
+				m_stream->Read(buffer, size);
+		}
+		else if (m_saving)
 		{
 			WriteString(name);
 			WriteBuffer(buffer, size);
@@ -98,7 +177,60 @@ public:
 		}
 	}
 
+	// Use SERIALIZE_TRACKED macro to invoke this function
+	template <typename T>
+	void SerializeTrackedValue(const char* name, T& value, DirtyPageHash& dirtyPageHash)
+	{
+		assert(sizeof(T) == dirtyPageHash.Size());
+		if (m_hashBuffer)
+		{
+			uint64 hash = dirtyPageHash.GetHash(reinterpret_cast<const uint8*>(&value));
+			AppendToHash(&hash, sizeof(hash));
+			return;
+		}
+
+		SerializeValue(name, value);
+		if (!m_saving)
+			dirtyPageHash.MarkAllDirty();
+	}
+
+	// Use SERIALIZE_TRACKED_BUFFER macro to invoke this function
+	void SerializeTrackedBuffer(const char* name, uint8* buffer, size_t size, DirtyPageHash& dirtyPageHash)
+	{
+		assert(size == dirtyPageHash.Size());
+		if (m_hashBuffer)
+		{
+			uint64 hash = dirtyPageHash.GetHash(buffer);
+			AppendToHash(&hash, sizeof(hash));
+			return;
+		}
+
+		SerializeBuffer(name, buffer, size);
+		if (!m_saving)
+			dirtyPageHash.MarkAllDirty();
+	}
+
 private:
+	// Makes room for size more bytes. The buffer only grows on the first calls, after which it fits
+	// everything hashed.
+	FORCEINLINE void GrowHashBuffer(size_t size)
+	{
+		if (m_hashCurr + size > m_hashEnd)
+		{
+			const size_t used = m_hashCurr - m_hashBuffer->data();
+			m_hashBuffer->resize(std::max(used + size, m_hashBuffer->size() * 2));
+			m_hashCurr = m_hashBuffer->data() + used;
+			m_hashEnd = m_hashBuffer->data() + m_hashBuffer->size();
+		}
+	}
+
+	FORCEINLINE void AppendToHash(const void* data, size_t size)
+	{
+		GrowHashBuffer(size);
+		memcpy(m_hashCurr, data, size);
+		m_hashCurr += size;
+	}
+
 	void WriteString(const std::string& s)
 	{
 		m_stream->WriteValue<uint32>(s.length());
@@ -151,4 +283,8 @@ private:
 
 	IStream* m_stream;
 	bool m_saving;
+	bool m_tagged;
+	std::vector<uint8>* m_hashBuffer; // Hashing if set
+	uint8* m_hashCurr;
+	uint8* m_hashEnd;
 };
@@ -0,0 +1,352 @@
+#include "SharedMemoryExport.h"
+#include "System.h"
+#include <cstring>
+#include <algorithm>
+
+#define SHARED_MEMORY_EXPORT_SUPPORTED !PLATFORM_WINDOWS
+
+#if SHARED_MEMORY_EXPORT_SUPPORTED
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if PLATFORM_LINUX
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <climits>
+#include <ctime>
+#endif
+
+static_assert(sizeof(std::atomic<uint32>) == sizeof(uint32) && sizeof(std::atomic<uint64>) == sizeof(uint64), "Atomics must be plain words to be shared");
+
+namespace
+{
+	const size_t kAlignment = 64; // Cache line
+
+	size_t Align(size_t size)
+	{
+		return (size + kAlignment - 1) & ~(kAlignment - 1);
+	}
+
+	std::string GetObjectName(const char* name)
+	{
+		return name[0] == '/'? name : std::string("/") + name;
+	}
+
+	void WakeAll(const std::atomic<uint32>& word)
+	{
+	#if PLATFORM_LINUX
+		syscall(SYS_futex, &word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+	#else
+		(void)word; // Consumers poll
+	#endif
+	}
+
+	// Returns once word is no longer 'value', or after at most timeoutSec
+	void WaitWhileEqual(const std::atomic<uint32>& word, uint32 value, float64 timeoutSec)
+	{
+	#if PLATFORM_LINUX
+		timespec timeout;
+		timeout.tv_sec = static_cast<time_t>(timeoutSec);
+		timeout.tv_nsec = static_cast<long>((timeoutSec - timeout.tv_sec) * 1e9);
+		syscall(SYS_futex, &word, FUTEX_WAIT, value, &timeout, nullptr, 0);
+	#else
+		(void)timeoutSec;
+		if (word.load(std::memory_order_acquire) == value)
+			System::Sleep(1);
+	#endif
+	}
+
+	void* Map(int fd, size_t size, bool writable)
+	{
+	#if SHARED_MEMORY_EXPORT_SUPPORTED
+		void* memory = mmap(nullptr, size, writable? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+		return memory == MAP_FAILED? nullptr : memory;
+	#else
+		(void)fd; (void)size; (void)writable;
+		return nullptr;
+	#endif
+	}
+
+	void Unmap(const void* memory, size_t size)
+	{
+	#if SHARED_MEMORY_EXPORT_SUPPORTED
+		munmap(const_cast<void*>(memory), size);
+	#else
+		(void)memory; (void)size;
+	#endif
+	}
+}
+
+SharedMemoryExport::SharedMemoryExport()
+	: m_header(nullptr)
+	, m_size(0)
+	, m_audioRing(nullptr)
+{
+}
+
+SharedMemoryExport::~SharedMemoryExport()
+{
+	Close();
+}
+
+bool SharedMemoryExport::Create(const char* name, size_t frameWidth, size_t frameHeight, PixelFormat::Type format,
+	size_t audioSampleRate, size_t numFrameSlots)
+{
+	Close();
+
+#if SHARED_MEMORY_EXPORT_SUPPORTED
+	assert(numFrameSlots >= 2);
+
+	const size_t pitch = frameWidth * PixelFormat::BytesPerPixel[format];
+	const size_t slotSize = Align(sizeof(SharedMemoryFrameSlotHeader)) + Align(pitch * frameHeight);
+	const size_t frameSlotsOffset = Align(sizeof(SharedMemoryExportHeader));
+	const size_t audioRingOffset = frameSlotsOffset + slotSize * numFrameSlots;
+	const size_t size = audioRingOffset + kAudioRingSize * sizeof(float32);
+
+	const std::string objectName = GetObjectName(name);
+	shm_unlink(objectName.c_str()); // Consumers of a previous run keep their mapping of the old object
+
+	const int fd = shm_open(objectName.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0)
+		return false;
+
+	void* memory = ftruncate(fd, size) == 0? Map(fd, size, true) : nullptr;
+	close(fd);
+	if (!memory)
+	{
+		shm_unlink(objectName.c_str());
+		return false;
+	}
+
+	// New objects are zero-filled, so all counters start at 0
+	m_name = objectName;
+	m_size = size;
+	m_header = static_cast<SharedMemoryExportHeader*>(memory);
+	m_header->frameWidth = static_cast<uint32>(frameWidth);
+	m_header->frameHeight = static_cast<uint32>(frameHeight);
+	m_header->pixelFormat = format;
+	m_header->framePitch = static_cast<uint32>(pitch);
+	m_header->numFrameSlots = static_cast<uint32>(numFrameSlots);
+	m_header->frameSlotSize = static_cast<uint32>(slotSize);
+	m_header->frameSlotsOffset = frameSlotsOffset;
+	m_header->audioSampleRate = static_cast<uint32>(audioSampleRate);
+	m_header->audioRingSize = kAudioRingSize;
+	m_header->audioRingOffset = audioRingOffset;
+	m_audioRing = reinterpret_cast<float32*>(static_cast<uint8*>(memory) + audioRingOffset);
+	m_pendingAudio.clear();
+	m_pendingAudio.reserve(kAudioRingSize);
+
+	// Written last so that consumers never see a valid magic with an incomplete header
+	m_header->version = SharedMemoryExportHeader::kVersion;
+	std::atomic_thread_fence(std::memory_order_release);
+	m_header->magic = SharedMemoryExportHeader::kMagic;
+	return true;
+#else
+	(void)name; (void)frameWidth; (void)frameHeight; (void)format; (void)audioSampleRate; (void)numFrameSlots;
+	return false;
+#endif
+}
+
+void SharedMemoryExport::Close()
+{
+	if (!m_header)
+		return;
+
+	PublishAudio();
+	m_header->closed.store(1, std::memory_order_release);
+	WakeAll(m_header->frameCount);
+	WakeAll(m_header->audioBlockCount);
+
+#if SHARED_MEMORY_EXPORT_SUPPORTED
+	shm_unlink(m_name.c_str());
+#endif
+	Unmap(m_header, m_size);
+	m_header = nullptr;
+	m_audioRing = nullptr;
+}
+
+void SharedMemoryExport::PublishFrame(const PpuPixel* pixels)
+{
+	if (!m_header)
+		return;
+
+	const uint32 n = m_header->frameCount.load(std::memory_order_relaxed) + 1;
+	uint8* slot = reinterpret_cast<uint8*>(m_header) + m_header->frameSlotsOffset + ((n - 1) % m_header->numFrameSlots) * m_header->frameSlotSize;
+	auto& slotHeader = *reinterpret_cast<SharedMemoryFrameSlotHeader*>(slot);
+
+	// Pixel stores must not become visible before the slot is marked as being written
+	slotHeader.sequence.store(2 * n - 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	uint8* dest = slot + Align(sizeof(SharedMemoryFrameSlotHeader));
+	PixelConverter::Get().Convert(pixels, m_header->frameWidth, m_header->frameHeight, static_cast<PixelFormat::Type>(m_header->pixelFormat), dest, m_header->framePitch);
+
+	slotHeader.sequence.store(2 * n, std::memory_order_release);
+	m_header->frameCount.store(n, std::memory_order_release);
+	WakeAll(m_header->frameCount);
+}
+
+void SharedMemoryExport::OnFrameEnd(const PpuPixel* pixels)
+{
+	if (pixels)
+		PublishFrame(pixels);
+	PublishAudio();
+}
+
+void SharedMemoryExport::AddAudioSample(float32 sample)
+{
+	if (m_audioRing)
+		m_pendingAudio.push_back(sample);
+}
+
+void SharedMemoryExport::PublishAudio()
+{
+	if (!m_header || m_pendingAudio.empty())
+		return;
+
+	const uint64 start = m_header->audioSampleCount.load(std::memory_order_relaxed);
+	const uint64 end = start + m_pendingAudio.size();
+
+	// Like frame slots, readers must be able to tell that samples they copied may be overwritten
+	m_header->audioWriteCount.store(end, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	// Only the last ring's worth would survive
+	const size_t numSamples = std::min(m_pendingAudio.size(), static_cast<size_t>(kAudioRingSize));
+	const float32* samples = m_pendingAudio.data() + m_pendingAudio.size() - numSamples;
+	for (uint64 i = end - numSamples; i < end; ++i)
+		m_audioRing[i & (kAudioRingSize - 1)] = *samples++;
+	m_pendingAudio.clear();
+
+	m_header->audioSampleCount.store(end, std::memory_order_release);
+	m_header->audioBlockCount.fetch_add(1, std::memory_order_release);
+	WakeAll(m_header->audioBlockCount);
+}
+
+
+SharedMemoryImport::SharedMemoryImport()
+	: m_header(nullptr)
+	, m_size(0)
+{
+}
+
+SharedMemoryImport::~SharedMemoryImport()
+{
+	Close();
+}
+
+bool SharedMemoryImport::Open(const char* name)
+{
+	Close();
+
+#if SHARED_MEMORY_EXPORT_SUPPORTED
+	const int fd = shm_open(GetObjectName(name).c_str(), O_RDONLY, 0);
+	if (fd < 0)
+		return false;
+
+	struct stat status;
+	void* memory = nullptr;
+	if (fstat(fd, &status) == 0 && static_cast<size_t>(status.st_size) >= sizeof(SharedMemoryExportHeader))
+		memory = Map(fd, status.st_size, false);
+	close(fd);
+	if (!memory)
+		return false;
+
+	m_header = static_cast<const SharedMemoryExportHeader*>(memory);
+	m_size = status.st_size;
+
+	// The object may still be being set up
+	const bool valid = m_header->magic == SharedMemoryExportHeader::kMagic;
+	std::atomic_thread_fence(std::memory_order_acquire);
+	if (!valid || m_header->version != SharedMemoryExportHeader::kVersion)
+	{
+		Close();
+		return false;
+	}
+	return true;
+#else
+	(void)name;
+	return false;
+#endif
+}
+
+void SharedMemoryImport::Close()
+{
+	if (m_header)
+	{
+		Unmap(m_header, m_size);
+		m_header = nullptr;
+	}
+}
+
+bool SharedMemoryImport::WaitForFrame(uint32 frameCount, float64 timeoutSec) const
+{
+	const float64 endTime = System::GetTimeSec() + timeoutSec;
+	for (;;)
+	{
+		if (m_header->frameCount.load(std::memory_order_acquire) != frameCount || m_header->closed.load(std::memory_order_acquire))
+			return true;
+
+		const float64 remainingSec = endTime - System::GetTimeSec();
+		if (remainingSec <= 0)
+			return false;
+
+		WaitWhileEqual(m_header->frameCount, frameCount, remainingSec);
+	}
+}
+
+const SharedMemoryFrameSlotHeader* SharedMemoryImport::GetSlot(uint32 n) const
+{
+	const uint8* memory = reinterpret_cast<const uint8*>(m_header);
+	return reinterpret_cast<const SharedMemoryFrameSlotHeader*>(memory + m_header->frameSlotsOffset + ((n - 1) % m_header->numFrameSlots) * m_header->frameSlotSize);
+}
+
+const uint8* SharedMemoryImport::GetFramePixels(uint32 n) const
+{
+	const SharedMemoryFrameSlotHeader* slot = GetSlot(n);
+	if (slot->sequence.load(std::memory_order_acquire) != 2 * n)
+		return nullptr;
+	return reinterpret_cast<const uint8*>(slot) + Align(sizeof(SharedMemoryFrameSlotHeader));
+}
+
+bool SharedMemoryImport::IsFrameValid(uint32 n) const
+{
+	// Pixel loads must complete before the sequence is checked again
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return GetSlot(n)->sequence.load(std::memory_order_relaxed) == 2 * n;
+}
+
+size_t SharedMemoryImport::ReadAudio(uint64& position, float32* dest, size_t maxSamples, uint64& numSamplesLost) const
+{
+	const uint64 ringSize = m_header->audioRingSize;
+	const uint64 end = m_header->audioSampleCount.load(std::memory_order_acquire);
+	if (end - position > ringSize)
+	{
+		numSamplesLost += end - ringSize - position;
+		position = end - ringSize;
+	}
+
+	const size_t numSamples = static_cast<size_t>(std::min<uint64>(end - position, maxSamples));
+	const float32* ring = reinterpret_cast<const float32*>(reinterpret_cast<const uint8*>(m_header) + m_header->audioRingOffset);
+	for (size_t i = 0; i < numSamples; ++i)
+		dest[i] = ring[(position + i) & (ringSize - 1)];
+
+	// The writer may have lapped us while copying, including with a block that isn't published yet.
+	// Sample loads must complete before the write count is checked.
+	std::atomic_thread_fence(std::memory_order_acquire);
+	const uint64 newEnd = m_header->audioWriteCount.load(std::memory_order_relaxed);
+	const uint64 numOverwritten = newEnd > position + ringSize? newEnd - ringSize - position : 0;
+	const size_t numValid = numSamples - static_cast<size_t>(std::min<uint64>(numOverwritten, numSamples));
+	if (numValid < numSamples)
+	{
+		// Drop the overwritten head of what was copied
+		std::memmove(dest, dest + (numSamples - numValid), numValid * sizeof(float32));
+		numSamplesLost += numSamples - numValid;
+	}
+
+	position += numSamples;
+	return numValid;
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "Base.h"
+#include "AvOutput.h"
+#include <string>
+#include <vector>
+#include <atomic>
+
+// Publishes presented frames and audio samples to a named POSIX shared memory object, so that local
+// processes (encoders, monitors, etc.) can read them in place, without copies or sockets. Frames go
+// to a ring of slots, each guarded by a sequence number, and audio to a ring of float32 samples. On
+// Linux, consumers can sleep on the header's counters with FUTEX_WAIT, and are woken on each publish.
+// Not supported on Windows.
+//
+// The object starts with a SharedMemoryExportHeader; all offsets are from the start of the object.
+
+struct SharedMemoryExportHeader
+{
+	static const uint32 kMagic = 0x5853454E; // "NESX"
+	static const uint32 kVersion = 1;
+
+	uint32 magic;
+	uint32 version;
+
+	uint32 frameWidth;
+	uint32 frameHeight;
+	uint32 pixelFormat;		// PixelFormat::Type
+	uint32 framePitch;		// Bytes between rows
+	uint32 numFrameSlots;
+	uint32 frameSlotSize;	// Bytes between slots, pixels start after the SharedMemoryFrameSlotHeader
+	uint64 frameSlotsOffset;
+
+	uint32 audioSampleRate;
+	uint32 audioRingSize;	// In samples, a power of 2
+	uint64 audioRingOffset;	// Sample i of the stream is at index (i & (audioRingSize - 1))
+
+	// Incremented after each frame is published; frame n (from 1) is in slot (n - 1) % numFrameSlots
+	std::atomic<uint32> frameCount;
+
+	// Incremented after each block of samples is published, then audioSampleCount is the total number
+	// of samples written. Samples older than audioRingSize from the end have been overwritten.
+	std::atomic<uint32> audioBlockCount;
+	std::atomic<uint64> audioSampleCount;
+
+	// Set to the sample count a block will end at before it's written to the ring. Samples older than
+	// audioRingSize from it may be being overwritten.
+	std::atomic<uint64> audioWriteCount;
+
+	// Set to 1 when the emulator stops publishing, waking any consumer
+	std::atomic<uint32> closed;
+};
+
+struct SharedMemoryFrameSlotHeader
+{
+	// 2n - 1 while frame n is being written to the slot, 2n once it's complete. Read it before and
+	// after reading the pixels: if it didn't stay 2n, the frame was overwritten in the meantime.
+	std::atomic<uint32> sequence;
+};
+
+class SharedMemoryExport : public AvOutputListener
+{
+public:
+	static const size_t kDefaultNumFrameSlots = 4;
+	static const size_t kAudioRingSize = 64 * 1024; // More than a second of audio
+
+	SharedMemoryExport();
+	~SharedMemoryExport(); // Closes
+
+	// Creates or replaces the shared memory object 'name' (a leading '/' is added if missing)
+	bool Create(const char* name, size_t frameWidth, size_t frameHeight, PixelFormat::Type format,
+		size_t audioSampleRate, size_t numFrameSlots = kDefaultNumFrameSlots);
+
+	// Marks the export closed and unlinks the object; consumers that have it mapped can keep reading
+	void Close();
+
+	bool IsOpen() const { return m_header != nullptr; }
+
+	// Converts the frame directly into the next slot
+	void PublishFrame(const PpuPixel* pixels);
+
+	// Samples are buffered, and written to the ring and made visible to consumers by PublishAudio
+	void AddAudioSample(float32 sample);
+	void PublishAudio();
+
+	// Publishes the frame, if presented, then the frame's audio
+	virtual void OnAudioSample(float32 sample) { AddAudioSample(sample); }
+	virtual void OnFrameEnd(const PpuPixel* pixels);
+
+private:
+	SharedMemoryExport(const SharedMemoryExport&);
+	SharedMemoryExport& operator=(const SharedMemoryExport&);
+
+	std::string m_name;
+	SharedMemoryExportHeader* m_header;
+	size_t m_size;
+	float32* m_audioRing;
+	std::vector<float32> m_pendingAudio;
+};
+
+// Consumer side of SharedMemoryExport, for tools and as a reference for other consumers
+class SharedMemoryImport
+{
+public:
+	SharedMemoryImport();
+	~SharedMemoryImport();
+
+	bool Open(const char* name);
+	void Close();
+
+	const SharedMemoryExportHeader& GetHeader() const { return *m_header; }
+
+	bool IsClosed() const { return m_header->closed.load(std::memory_order_acquire) != 0; }
+
+	// Waits until the frame count differs from frameCount, or the export is closed. Returns false on
+	// timeout.
+	bool WaitForFrame(uint32 frameCount, float64 timeoutSec) const;
+
+	// Returns the pixels of frame n, read in place, or nullptr if the slot holds another frame or is
+	// being written. Check IsFrameValid(n) after reading the pixels.
+	const uint8* GetFramePixels(uint32 n) const;
+	bool IsFrameValid(uint32 n) const;
+
+	// Copies up to maxSamples published samples starting at sample 'position', advancing it. If the
+	// position was overwritten, skips ahead to the oldest sample available and adds the number of
+	// samples lost to numSamplesLost.
+	size_t ReadAudio(uint64& position, float32* dest, size_t maxSamples, uint64& numSamplesLost) const;
+
+private:
+	SharedMemoryImport(const SharedMemoryImport&);
+	SharedMemoryImport& operator=(const SharedMemoryImport&);
+
+	const SharedMemoryFrameSlotHeader* GetSlot(uint32 n) const;
+
+	const SharedMemoryExportHeader* m_header;
+	size_t m_size;
+};
@@ -2,15 +2,17 @@
 #include "IO.h"
 #include <SDL.h>
 #include <chrono>
+#include <mutex>
 
 namespace System
 {
 	const char* GetAppDirectory()
 	{
 		static char appDir[2048] = { 0 };
+		static std::once_flag appDirInitialized;
 		
-		// Lazily build the app directory
-		if (appDir[0] == 0)
+		// Lazily build the app directory, once even if called from multiple threads
+		std::call_once(appDirInitialized, [] ()
 		{
 			std::string temp = SDL_GetBasePath();
 
@@ -29,7 +31,7 @@ namespace System
 			temp = appDir; // Just for asserting
 			assert(temp.size() > 0 && temp.size() < ARRAYSIZE(appDir));
 			assert(temp.back() == '\\' || temp.back() == '/');
-		}
+		});
 
 		return appDir;
 	}
@@ -69,6 +71,11 @@ namespace System
 		return ::CreateDirectoryA(directory, NULL) != FALSE;
 	}
 
+	bool RenameFile(const char* source, const char* destination)
+	{
+		return ::MoveFileExA(source, destination, MOVEFILE_REPLACE_EXISTING) != FALSE;
+	}
+
 	void DebugBreak()
 	{
 		::DebugBreak();
@@ -111,9 +118,10 @@ namespace System
 	}
 }
 
-#elif PLATFORM_LINUX || PLATFORM_MAC
+#elif PLATFORM_LINUX || PLATFORM_MAC
 
 #include <sys/stat.h>
+#include <cstdio>
 
 namespace System
 {
@@ -122,6 +130,11 @@ namespace System
 		return mkdir(directory, 0777) == 0;
 	}
 
+	bool RenameFile(const char* source, const char* destination)
+	{
+		return rename(source, destination) == 0;
+	}
+
 	void DebugBreak()
 	{
 		assert(false); //@TODO: better way to do this?
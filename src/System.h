@@ -13,6 +13,7 @@ namespace System
 {
 	const char* GetAppDirectory();
 	bool CreateDirectory(const char* directory);
+	bool RenameFile(const char* source, const char* destination); // Replaces destination if it exists
 	void Sleep(uint32 ms);
 	void DebugBreak();
 	void MessageBox(const char* title, const char* message);
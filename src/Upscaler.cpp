@@ -0,0 +1,541 @@
+#include "Upscaler.h"
+#include "WorkerPool.h"
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+// SSE2 is part of x86-64, so it doesn't need a runtime check
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define UPSCALER_SSE2 1
+	#include <emmintrin.h>
+#else
+	#define UPSCALER_SSE2 0
+#endif
+
+namespace
+{
+	struct SourceImage
+	{
+		const uint32* pixels;
+		size_t pitch; // In pixels
+		size_t width;
+		size_t height;
+
+		FORCEINLINE const uint32* Row(size_t y) const { return pixels + y * pitch; }
+
+		// Out of range coordinates are clamped to the edges
+		FORCEINLINE uint32 At(int32 x, int32 y) const
+		{
+			x = std::min(std::max(x, 0), static_cast<int32>(width) - 1);
+			y = std::min(std::max(y, 0), static_cast<int32>(height) - 1);
+			return pixels[y * pitch + x];
+		}
+	};
+
+	struct DestImage
+	{
+		uint32* pixels;
+		size_t pitch; // In pixels
+
+		FORCEINLINE uint32* Row(size_t y) const { return pixels + y * pitch; }
+	};
+
+	// Source rows [y0, y1) of the image, each writing its own scaled rows
+	typedef WorkerPool::RangeJob BandJob;
+
+	FORCEINLINE uint8 R(uint32 c) { return static_cast<uint8>(c >> 16); }
+	FORCEINLINE uint8 G(uint32 c) { return static_cast<uint8>(c >> 8); }
+	FORCEINLINE uint8 B(uint32 c) { return static_cast<uint8>(c); }
+
+	///////////////////////////////////////////////////////////////////////////
+	// Scale2x, see http://www.scale2x.it/algorithm
+	//   B        E0 E1
+	// D E F  ->  E2 E3
+	//   H
+	///////////////////////////////////////////////////////////////////////////
+
+	FORCEINLINE void Scale2xPixel(const uint32* above, const uint32* row, const uint32* below, size_t x, size_t width, uint32* out0, uint32* out1)
+	{
+		const uint32 b = above[x];
+		const uint32 h = below[x];
+		const uint32 d = row[x > 0? x - 1 : x];
+		const uint32 f = row[x + 1 < width? x + 1 : x];
+		const uint32 e = row[x];
+
+		if (b != h && d != f)
+		{
+			out0[2*x] = d == b? d : e;
+			out0[2*x + 1] = b == f? f : e;
+			out1[2*x] = d == h? d : e;
+			out1[2*x + 1] = h == f? f : e;
+		}
+		else
+		{
+			out0[2*x] = out0[2*x + 1] = out1[2*x] = out1[2*x + 1] = e;
+		}
+	}
+
+#if UPSCALER_SSE2
+	FORCEINLINE __m128i Select(__m128i mask, __m128i a, __m128i b)
+	{
+		return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+	}
+
+	FORCEINLINE __m128i Load(const uint32* p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+	FORCEINLINE void Store(uint32* p, __m128i v) { _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v); }
+#endif
+
+	void Scale2xRows(const SourceImage& src, const DestImage& dest, size_t y0, size_t y1)
+	{
+		const size_t width = src.width;
+
+		for (size_t y = y0; y < y1; ++y)
+		{
+			const uint32* above = src.Row(y > 0? y - 1 : y);
+			const uint32* row = src.Row(y);
+			const uint32* below = src.Row(y + 1 < src.height? y + 1 : y);
+			uint32* out0 = dest.Row(2*y);
+			uint32* out1 = dest.Row(2*y + 1);
+
+			size_t x = 0;
+		#if UPSCALER_SSE2
+			// 4 pixels at a time, leaving the first and last ones (clamped neighbors) to the scalar code
+			Scale2xPixel(above, row, below, x++, width, out0, out1);
+			for ( ; x + 4 < width; x += 4)
+			{
+				const __m128i b = Load(above + x);
+				const __m128i h = Load(below + x);
+				const __m128i d = Load(row + x - 1);
+				const __m128i f = Load(row + x + 1);
+				const __m128i e = Load(row + x);
+
+				const __m128i active = _mm_andnot_si128(_mm_or_si128(_mm_cmpeq_epi32(b, h), _mm_cmpeq_epi32(d, f)), _mm_set1_epi32(-1));
+				const __m128i e0 = Select(_mm_and_si128(active, _mm_cmpeq_epi32(d, b)), d, e);
+				const __m128i e1 = Select(_mm_and_si128(active, _mm_cmpeq_epi32(b, f)), f, e);
+				const __m128i e2 = Select(_mm_and_si128(active, _mm_cmpeq_epi32(d, h)), d, e);
+				const __m128i e3 = Select(_mm_and_si128(active, _mm_cmpeq_epi32(h, f)), f, e);
+
+				Store(out0 + 2*x, _mm_unpacklo_epi32(e0, e1));
+				Store(out0 + 2*x + 4, _mm_unpackhi_epi32(e0, e1));
+				Store(out1 + 2*x, _mm_unpacklo_epi32(e2, e3));
+				Store(out1 + 2*x + 4, _mm_unpackhi_epi32(e2, e3));
+			}
+		#endif
+			for ( ; x < width; ++x)
+				Scale2xPixel(above, row, below, x, width, out0, out1);
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Scale3x
+	// A B C      E0 E1 E2
+	// D E F  ->  E3 E4 E5
+	// G H I      E6 E7 E8
+	///////////////////////////////////////////////////////////////////////////
+
+	void Scale3xRows(const SourceImage& src, const DestImage& dest, size_t y0, size_t y1)
+	{
+		for (size_t y = y0; y < y1; ++y)
+		{
+			uint32* out0 = dest.Row(3*y);
+			uint32* out1 = dest.Row(3*y + 1);
+			uint32* out2 = dest.Row(3*y + 2);
+
+			for (size_t x = 0; x < src.width; ++x)
+			{
+				const int32 sx = static_cast<int32>(x);
+				const int32 sy = static_cast<int32>(y);
+				const uint32 a = src.At(sx - 1, sy - 1), b = src.At(sx, sy - 1), c = src.At(sx + 1, sy - 1);
+				const uint32 d = src.At(sx - 1, sy),     e = src.At(sx, sy),     f = src.At(sx + 1, sy);
+				const uint32 g = src.At(sx - 1, sy + 1), h = src.At(sx, sy + 1), i = src.At(sx + 1, sy + 1);
+
+				uint32* o0 = out0 + 3*x;
+				uint32* o1 = out1 + 3*x;
+				uint32* o2 = out2 + 3*x;
+
+				if (b != h && d != f)
+				{
+					o0[0] = d == b? d : e;
+					o0[1] = (d == b && e != c) || (b == f && e != a)? b : e;
+					o0[2] = b == f? f : e;
+					o1[0] = (d == b && e != g) || (d == h && e != a)? d : e;
+					o1[1] = e;
+					o1[2] = (b == f && e != i) || (h == f && e != c)? f : e;
+					o2[0] = d == h? d : e;
+					o2[1] = (d == h && e != i) || (h == f && e != g)? h : e;
+					o2[2] = h == f? f : e;
+				}
+				else
+				{
+					o0[0] = o0[1] = o0[2] = o1[0] = o1[1] = o1[2] = o2[0] = o2[1] = o2[2] = e;
+				}
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// XbrLite2x: the xBR (level 1) edge rule, see
+	// https://forums.libretro.com/t/xbr-algorithm-tutorial/123
+	//      A1 B1 C1
+	//   A0 A  B  C  C4
+	//   D0 D  E  F  F4
+	//   G0 G  H  I  I4
+	//      G5 H5 I5
+	// For the bottom-right corner of E, an edge along H-F is found if the weighted color distances
+	// along that direction are smaller than across it. The corner is then blended with F or H. The
+	// other corners are the same rule on the mirrored neighborhood.
+	///////////////////////////////////////////////////////////////////////////
+
+	// Weighted YUV distance, as used by xBR
+	FORCEINLINE int32 Distance(uint32 a, uint32 b)
+	{
+		if (a == b) // Common with a small palette
+			return 0;
+
+		const int32 dr = R(a) - R(b);
+		const int32 dg = G(a) - G(b);
+		const int32 db = B(a) - B(b);
+		const int32 dy = abs(299 * dr + 587 * dg + 114 * db);
+		const int32 du = abs(-169 * dr - 331 * dg + 500 * db);
+		const int32 dv = abs(500 * dr - 419 * dg - 81 * db);
+		return 48 * dy + 7 * du + 6 * dv;
+	}
+
+	FORCEINLINE uint32 Blend50(uint32 a, uint32 b)
+	{
+		return (((a & 0xFEFEFEFE) >> 1) + ((b & 0xFEFEFEFE) >> 1)) | 0xFF000000;
+	}
+
+	// The source padded by 2 pixels on each side (edge pixels repeated), and the distance of each of
+	// its pixels to the neighbors in 4 directions, the other 4 being the same distances seen from the
+	// neighbor. Every distance the edge rule needs is between neighbors, so they're computed once per
+	// pixel rather than once per use.
+	struct XbrImage
+	{
+		enum Direction { Right, Down, DownRight, DownLeft, NumDirections };
+
+		static const int32 kPadding = 2;
+
+		std::vector<uint32> pixels;
+		std::vector<int32> distances[NumDirections];
+		size_t width; // Padded
+		size_t height;
+	};
+
+	// Padded rows [y0, y1)
+	void XbrPadRows(const SourceImage& src, XbrImage& image, size_t y0, size_t y1)
+	{
+		for (size_t y = y0; y < y1; ++y)
+		{
+			for (size_t x = 0; x < image.width; ++x)
+				image.pixels[y * image.width + x] = src.At(static_cast<int32>(x) - XbrImage::kPadding, static_cast<int32>(y) - XbrImage::kPadding);
+		}
+	}
+
+	// Padded rows [y0, y1), neighbors outside of the padded image get 0 (never used)
+	void XbrDistanceRows(XbrImage& image, size_t y0, size_t y1)
+	{
+		const size_t width = image.width;
+		for (size_t y = y0; y < y1; ++y)
+		{
+			const bool hasDown = y + 1 < image.height;
+			for (size_t x = 0; x < width; ++x)
+			{
+				const size_t index = y * width + x;
+				const uint32 p = image.pixels[index];
+				image.distances[XbrImage::Right][index] = x + 1 < width? Distance(p, image.pixels[index + 1]) : 0;
+				image.distances[XbrImage::Down][index] = hasDown? Distance(p, image.pixels[index + width]) : 0;
+				image.distances[XbrImage::DownRight][index] = hasDown && x + 1 < width? Distance(p, image.pixels[index + width + 1]) : 0;
+				image.distances[XbrImage::DownLeft][index] = hasDown && x > 0? Distance(p, image.pixels[index + width - 1]) : 0;
+			}
+		}
+	}
+
+	// Source rows [y0, y1)
+	void XbrLite2xRows(const XbrImage& image, const DestImage& dest, size_t y0, size_t y1)
+	{
+		const int32 kPadding = XbrImage::kPadding;
+		const int32 width = static_cast<int32>(image.width);
+		const int32 srcWidth = width - 2 * kPadding;
+
+		// Pairs of pixels, as (row, column) in the neighborhood, whose distance the rule uses for the
+		// bottom-right corner
+		enum { EC, EG, IF4, IH5, HF, HD, HI5, FI4, FB, EI, EF, EH, NumPairs };
+		static const int32 kPairs[NumPairs][4] =
+		{
+			{2,2, 1,3}, {2,2, 3,1}, {3,3, 2,4}, {3,3, 4,2}, {3,2, 2,3},
+			{3,2, 2,1}, {3,2, 4,3}, {2,3, 3,4}, {2,3, 1,2}, {2,2, 3,3},
+			{2,2, 2,3}, {2,2, 3,2}
+		};
+
+		// For each corner, where the distance of each pair is stored relative to E, the neighborhood
+		// being mirrored so that the corner is the bottom-right one
+		struct Lookup { const int32* distances; int32 offset; };
+		Lookup lookups[2][2][NumPairs];
+		int32 fOffsets[2][2], hOffsets[2][2];
+		for (int32 cornerY = 0; cornerY < 2; ++cornerY)
+		{
+			for (int32 cornerX = 0; cornerX < 2; ++cornerX)
+			{
+				const int32 mirrorY = cornerY? 1 : -1;
+				const int32 mirrorX = cornerX? 1 : -1;
+				for (int32 i = 0; i < NumPairs; ++i)
+				{
+					int32 x0 = mirrorX * (kPairs[i][1] - 2), y0 = mirrorY * (kPairs[i][0] - 2);
+					int32 x1 = mirrorX * (kPairs[i][3] - 2), y1 = mirrorY * (kPairs[i][2] - 2);
+					if (y1 < y0 || (y1 == y0 && x1 < x0))
+					{
+						std::swap(x0, x1);
+						std::swap(y0, y1);
+					}
+
+					const XbrImage::Direction direction = y1 == y0? XbrImage::Right : x1 == x0? XbrImage::Down : x1 > x0? XbrImage::DownRight : XbrImage::DownLeft;
+					lookups[cornerY][cornerX][i].distances = image.distances[direction].data();
+					lookups[cornerY][cornerX][i].offset = y0 * width + x0;
+				}
+				fOffsets[cornerY][cornerX] = mirrorX;
+				hOffsets[cornerY][cornerX] = mirrorY * width;
+			}
+		}
+
+		for (size_t y = y0; y < y1; ++y)
+		{
+			uint32* outRows[2] = { dest.Row(2*y), dest.Row(2*y + 1) };
+			const uint32* row = &image.pixels[(y + kPadding) * width + kPadding];
+			const int32 rowIndex = static_cast<int32>((y + kPadding) * width + kPadding);
+
+			for (int32 x = 0; x < srcWidth; ++x)
+			{
+				const uint32 e = row[x];
+
+				// Flat areas are left as is
+				if (e == row[x - width] && e == row[x + width] && e == row[x - 1] && e == row[x + 1])
+				{
+					outRows[0][2*x] = outRows[0][2*x + 1] = outRows[1][2*x] = outRows[1][2*x + 1] = e;
+					continue;
+				}
+
+				const int32 index = rowIndex + x;
+				for (int32 cornerY = 0; cornerY < 2; ++cornerY)
+				{
+					for (int32 cornerX = 0; cornerX < 2; ++cornerX)
+					{
+						const Lookup* pairs = lookups[cornerY][cornerX];
+						auto D = [&] (int32 pair) { return pairs[pair].distances[index + pairs[pair].offset]; };
+
+						const uint32 f = row[x + fOffsets[cornerY][cornerX]];
+						const uint32 h = row[x + hOffsets[cornerY][cornerX]];
+
+						uint32 corner = e;
+						if (e != f && e != h)
+						{
+							const int32 edgeAlong = D(EC) + D(EG) + D(IF4) + D(IH5) + 4 * D(HF);
+							const int32 edgeAcross = D(HD) + D(HI5) + D(FI4) + D(FB) + 4 * D(EI);
+							if (edgeAlong < edgeAcross)
+								corner = Blend50(e, D(EF) <= D(EH)? f : h);
+						}
+						outRows[cornerY][2*x + cornerX] = corner;
+					}
+				}
+			}
+		}
+	}
+
+	///////////////////////////////////////////////////////////////////////////
+	// Ntsc3x: an approximation of the composite look in YIQ space rather than a simulation of the
+	// signal. Chroma has a lower bandwidth than luma, so it's blurred over neighbor pixels, and luma
+	// edges leak into chroma as color fringes. Every third row is darkened like a scanline gap.
+	///////////////////////////////////////////////////////////////////////////
+
+	FORCEINLINE uint8 ClampColor(float32 value)
+	{
+		return static_cast<uint8>(std::min(std::max(value, 0.0f), 255.0f));
+	}
+
+	void Ntsc3xRows(const SourceImage& src, const DestImage& dest, size_t y0, size_t y1)
+	{
+		const float32 kFringeAmount = 0.15f;
+		const float32 kScanlineBrightness = 0.75f;
+
+		const size_t width = src.width;
+		std::vector<float32> lumas(width), is(width), qs(width);
+		std::vector<float32> filteredIs(width), filteredQs(width);
+
+		for (size_t y = y0; y < y1; ++y)
+		{
+			const uint32* row = src.Row(y);
+			for (size_t x = 0; x < width; ++x)
+			{
+				const float32 r = R(row[x]), g = G(row[x]), b = B(row[x]);
+				lumas[x] = 0.299f * r + 0.587f * g + 0.114f * b;
+				is[x] = 0.596f * r - 0.274f * g - 0.322f * b;
+				qs[x] = 0.211f * r - 0.523f * g + 0.312f * b;
+			}
+
+			// 1-2-1 chroma low-pass, plus luma crosstalk
+			for (size_t x = 0; x < width; ++x)
+			{
+				const size_t left = x > 0? x - 1 : x;
+				const size_t right = x + 1 < width? x + 1 : x;
+				const float32 lumaSlope = lumas[right] - lumas[left];
+				filteredIs[x] = (is[left] + 2.0f * is[x] + is[right]) * 0.25f + kFringeAmount * lumaSlope;
+				filteredQs[x] = (qs[left] + 2.0f * qs[x] + qs[right]) * 0.25f - kFringeAmount * lumaSlope;
+			}
+
+			uint32* out0 = dest.Row(3*y);
+			uint32* out1 = dest.Row(3*y + 1);
+			uint32* out2 = dest.Row(3*y + 2);
+
+			// Each source pixel covers 3 output pixels, interpolated towards its neighbors from its center
+			for (size_t ox = 0; ox < width * 3; ++ox)
+			{
+				const float32 pos = (ox + 0.5f) / 3.0f - 0.5f;
+				const size_t x0 = pos > 0.0f? static_cast<size_t>(pos) : 0;
+				const size_t x1 = std::min(x0 + 1, width - 1);
+				const float32 t = pos > 0.0f? pos - x0 : 0.0f;
+
+				const float32 luma = lumas[x0] + (lumas[x1] - lumas[x0]) * t;
+				const float32 i = filteredIs[x0] + (filteredIs[x1] - filteredIs[x0]) * t;
+				const float32 q = filteredQs[x0] + (filteredQs[x1] - filteredQs[x0]) * t;
+
+				const float32 r = luma + 0.956f * i + 0.621f * q;
+				const float32 g = luma - 0.272f * i - 0.647f * q;
+				const float32 b = luma - 1.106f * i + 1.703f * q;
+
+				out0[ox] = out1[ox] = 0xFF000000 | (ClampColor(r) << 16) | (ClampColor(g) << 8) | ClampColor(b);
+				out2[ox] = 0xFF000000 | (ClampColor(r * kScanlineBrightness) << 16) | (ClampColor(g * kScanlineBrightness) << 8) | ClampColor(b * kScanlineBrightness);
+			}
+		}
+	}
+}
+
+class Upscaler::UpscalerImpl
+{
+public:
+	UpscalerImpl()
+		: m_filter(UpscaleFilter::None)
+	{
+	}
+
+	void SetFilter(UpscaleFilter::Type filter, size_t numThreads)
+	{
+		m_workerPool.SetNumThreads(numThreads);
+		m_filter = filter;
+	}
+
+	UpscaleFilter::Type GetFilter() const { return m_filter; }
+
+	void Apply(const uint8* srcPixels, size_t srcPitch, size_t width, size_t height, uint8* destPixels, size_t destPitch)
+	{
+		assert(srcPitch % sizeof(uint32) == 0 && destPitch % sizeof(uint32) == 0);
+
+		const SourceImage src = { reinterpret_cast<const uint32*>(srcPixels), srcPitch / sizeof(uint32), width, height };
+		const DestImage dest = { reinterpret_cast<uint32*>(destPixels), destPitch / sizeof(uint32) };
+
+		switch (m_filter)
+		{
+		case UpscaleFilter::None:
+			for (size_t y = 0; y < height; ++y)
+				memcpy(dest.Row(y), src.Row(y), width * sizeof(uint32));
+			break;
+
+		case UpscaleFilter::Scale2x:
+			RunBands(height, [&] (size_t y0, size_t y1) { Scale2xRows(src, dest, y0, y1); });
+			break;
+
+		case UpscaleFilter::Scale3x:
+			RunBands(height, [&] (size_t y0, size_t y1) { Scale3xRows(src, dest, y0, y1); });
+			break;
+
+		case UpscaleFilter::Scale4x:
+			ApplyTwice(src, dest, &UpscalerImpl::ApplyScale2x);
+			break;
+
+		case UpscaleFilter::XbrLite2x:
+			ApplyXbrLite2x(src, dest);
+			break;
+
+		case UpscaleFilter::XbrLite4x:
+			ApplyTwice(src, dest, &UpscalerImpl::ApplyXbrLite2x);
+			break;
+
+		case UpscaleFilter::Ntsc3x:
+			RunBands(height, [&] (size_t y0, size_t y1) { Ntsc3xRows(src, dest, y0, y1); });
+			break;
+
+		default:
+			assert(false);
+		}
+	}
+
+private:
+	typedef void (UpscalerImpl::*Apply2x)(const SourceImage& src, const DestImage& dest);
+
+	void ApplyScale2x(const SourceImage& src, const DestImage& dest)
+	{
+		RunBands(src.height, [&] (size_t y0, size_t y1) { Scale2xRows(src, dest, y0, y1); });
+	}
+
+	// Each step reads rows of the previous one from other bands, so it only starts once that one is done
+	void ApplyXbrLite2x(const SourceImage& src, const DestImage& dest)
+	{
+		XbrImage& image = m_xbrImage;
+		image.width = src.width + 2 * XbrImage::kPadding;
+		image.height = src.height + 2 * XbrImage::kPadding;
+		image.pixels.resize(image.width * image.height);
+		for (auto& distances : image.distances)
+			distances.resize(image.width * image.height);
+
+		RunBands(image.height, [&] (size_t y0, size_t y1) { XbrPadRows(src, image, y0, y1); });
+		RunBands(image.height, [&] (size_t y0, size_t y1) { XbrDistanceRows(image, y0, y1); });
+		RunBands(src.height, [&] (size_t y0, size_t y1) { XbrLite2xRows(image, dest, y0, y1); });
+	}
+
+	// The second pass reads rows of the first pass from other bands, so it only starts once the first
+	// pass is done
+	void ApplyTwice(const SourceImage& src, const DestImage& dest, Apply2x apply2x)
+	{
+		m_intermediate.resize(src.width * 2 * src.height * 2);
+		const DestImage intermediateDest = { m_intermediate.data(), src.width * 2 };
+		const SourceImage intermediateSrc = { m_intermediate.data(), src.width * 2, src.width * 2, src.height * 2 };
+
+		(this->*apply2x)(src, intermediateDest);
+		(this->*apply2x)(intermediateSrc, dest);
+	}
+
+	void RunBands(size_t height, const BandJob& job)
+	{
+		m_workerPool.Run(height, job);
+	}
+
+	UpscaleFilter::Type m_filter;
+	std::vector<uint32> m_intermediate; // Output of the first pass of 4x filters
+	XbrImage m_xbrImage;
+	WorkerPool m_workerPool; // Bands are filtered in parallel
+};
+
+Upscaler::Upscaler()
+	: m_impl(new Upscaler::UpscalerImpl)
+{
+}
+
+Upscaler::~Upscaler()
+{
+	delete m_impl;
+}
+
+void Upscaler::SetFilter(UpscaleFilter::Type filter, size_t numThreads)
+{
+	m_impl->SetFilter(filter, numThreads);
+}
+
+UpscaleFilter::Type Upscaler::GetFilter() const
+{
+	return m_impl->GetFilter();
+}
+
+void Upscaler::Apply(const uint8* src, size_t srcPitch, size_t width, size_t height, uint8* dest, size_t destPitch)
+{
+	m_impl->Apply(src, srcPitch, width, height, dest, destPitch);
+}
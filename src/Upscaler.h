@@ -0,0 +1,52 @@
+#pragma once
+
+#include "Base.h"
+
+namespace UpscaleFilter
+{
+	enum Type
+	{
+		None,
+		Scale2x,	// AdvMAME2x/Scale2x pixel art scaler
+		Scale3x,	// AdvMAME3x/Scale3x
+		Scale4x,	// Scale2x applied twice
+		XbrLite2x,	// xBR-style edge detection, blending only the corner pixel of each block
+		XbrLite4x,	// XbrLite2x applied twice
+		Ntsc3x,		// Composite look: chroma bleeding and color fringes on edges, darkened scanlines
+
+		NumTypes
+	};
+
+	static const char* String[] = { "None", "Scale2x", "Scale3x", "Scale4x", "XbrLite2x", "XbrLite4x", "Ntsc3x" };
+	static_assert(NumTypes == ARRAYSIZE(String), "Size mismatch");
+
+	static const size_t Scale[] = { 1, 2, 3, 4, 2, 4, 3 };
+	static_assert(NumTypes == ARRAYSIZE(Scale), "Size mismatch");
+}
+
+// Upscales ARGB8888 frames on the CPU, for output that doesn't go through a GPU (e.g. capture on
+// servers) or to show filtered frames in the window. The frame is split into horizontal bands that
+// are filtered in parallel on worker threads, the calling thread doing one of the bands.
+class Upscaler
+{
+public:
+	Upscaler();
+	~Upscaler(); // Stops worker threads
+
+	// numThreads includes the calling thread, 0 to use one per hardware thread
+	void SetFilter(UpscaleFilter::Type filter, size_t numThreads = 0);
+	UpscaleFilter::Type GetFilter() const;
+	size_t GetScale() const { return UpscaleFilter::Scale[GetFilter()]; }
+
+	// Upscales width x height pixels, rows srcPitch bytes apart, to dest, which must have room for
+	// (width * GetScale()) x (height * GetScale()) pixels, rows destPitch bytes apart. Returns once
+	// all bands are done.
+	void Apply(const uint8* src, size_t srcPitch, size_t width, size_t height, uint8* dest, size_t destPitch);
+
+private:
+	Upscaler(const Upscaler&);
+	Upscaler& operator=(const Upscaler&);
+
+	class UpscalerImpl;
+	UpscalerImpl* m_impl;
+};
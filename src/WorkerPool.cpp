@@ -0,0 +1,155 @@
+#include "WorkerPool.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+
+class WorkerPool::WorkerPoolImpl
+{
+public:
+	WorkerPoolImpl()
+		: m_numThreads(1)
+		, m_job(nullptr)
+		, m_jobCount(0)
+		, m_generation(0)
+		, m_numRangesPending(0)
+		, m_quit(false)
+	{
+	}
+
+	~WorkerPoolImpl()
+	{
+		StopThreads();
+	}
+
+	void SetNumThreads(size_t numThreads)
+	{
+		if (numThreads == 0)
+			numThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+		if (numThreads != m_numThreads)
+		{
+			StopThreads();
+			m_numThreads = numThreads;
+		}
+	}
+
+	size_t GetNumThreads() const { return m_numThreads; }
+
+	void Run(size_t count, const RangeJob& job)
+	{
+		if (m_numThreads == 1)
+		{
+			job(0, count);
+			return;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			// Lazily start threads, range 0 is done by the caller
+			if (m_threads.empty())
+			{
+				for (size_t rangeIndex = 1; rangeIndex < m_numThreads; ++rangeIndex)
+					m_threads.push_back(std::thread(&WorkerPoolImpl::ThreadMain, this, rangeIndex, m_generation));
+			}
+
+			m_job = &job;
+			m_jobCount = count;
+			m_numRangesPending = m_threads.size();
+			++m_generation;
+		}
+		m_wakeCondition.notify_all();
+
+		RunRange(0, count, job);
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_doneCondition.wait(lock, [this] { return m_numRangesPending == 0; });
+		m_job = nullptr;
+	}
+
+private:
+	void RunRange(size_t rangeIndex, size_t count, const RangeJob& job) const
+	{
+		const size_t rangeSize = (count + m_numThreads - 1) / m_numThreads;
+		const size_t begin = std::min(rangeIndex * rangeSize, count);
+		const size_t end = std::min(begin + rangeSize, count);
+		if (begin < end)
+			job(begin, end);
+	}
+
+	void ThreadMain(size_t rangeIndex, uint64 generation)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+
+		for (;;)
+		{
+			m_wakeCondition.wait(lock, [&] { return m_quit || m_generation != generation; });
+			if (m_quit)
+				break;
+
+			generation = m_generation;
+			const RangeJob& job = *m_job;
+			const size_t count = m_jobCount;
+
+			lock.unlock();
+			RunRange(rangeIndex, count, job);
+			lock.lock();
+
+			if (--m_numRangesPending == 0)
+				m_doneCondition.notify_one();
+		}
+	}
+
+	void StopThreads()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_quit = true;
+		}
+		m_wakeCondition.notify_all();
+
+		for (auto& thread : m_threads)
+			thread.join();
+
+		m_threads.clear();
+		m_quit = false;
+	}
+
+	size_t m_numThreads; // Including the calling thread
+	std::vector<std::thread> m_threads;
+	std::mutex m_mutex;
+	std::condition_variable m_wakeCondition;
+	std::condition_variable m_doneCondition;
+	const RangeJob* m_job;
+	size_t m_jobCount;
+	uint64 m_generation;
+	size_t m_numRangesPending;
+	bool m_quit;
+};
+
+WorkerPool::WorkerPool()
+	: m_impl(new WorkerPool::WorkerPoolImpl)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+	delete m_impl;
+}
+
+void WorkerPool::SetNumThreads(size_t numThreads)
+{
+	m_impl->SetNumThreads(numThreads);
+}
+
+size_t WorkerPool::GetNumThreads() const
+{
+	return m_impl->GetNumThreads();
+}
+
+void WorkerPool::Run(size_t count, const RangeJob& job)
+{
+	m_impl->Run(count, job);
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "Base.h"
+#include <functional>
+
+// Runs jobs split into contiguous ranges on persistent worker threads, the calling thread running
+// the first range. Threads are started on the first Run, and wait for the next job in between, so
+// running a job allocates nothing.
+class WorkerPool
+{
+public:
+	typedef std::function<void (size_t begin, size_t end)> RangeJob;
+
+	WorkerPool();
+	~WorkerPool(); // Stops worker threads
+
+	// numThreads includes the calling thread, 0 to use one per hardware thread
+	void SetNumThreads(size_t numThreads);
+	size_t GetNumThreads() const;
+
+	// Splits [0, count) into GetNumThreads() ranges of (nearly) equal size and runs job on each.
+	// Returns once all ranges are done.
+	void Run(size_t count, const RangeJob& job);
+
+private:
+	WorkerPool(const WorkerPool&);
+	WorkerPool& operator=(const WorkerPool&);
+
+	class WorkerPoolImpl;
+	WorkerPoolImpl* m_impl;
+};
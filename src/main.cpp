@@ -4,6 +4,13 @@
 #include "Input.h"
 #include "Renderer.h"
 #include "Debugger.h"
+#include "Profiler.h"
+#include "FrameTrace.h"
+#include "Movie.h"
+#include "IO.h"
+#include "SharedMemoryExport.h"
+#include "AvCapture.h"
+#include "Stream.h"
 
 #define kVersionMajor  1
 #define kVersionMinor  4
@@ -44,10 +51,78 @@ namespace
 
 	int ShowUsage(const char* appPath)
 	{
-		printf("Usage: %s <nes rom>\n\n", appPath);
+		printf("Usage: %s <nes rom> [-play <movie> | -shm <shared memory name>]\n\n", appPath);
 		return -1;
 	}
 
+	std::string GetMovieFile(const std::string& romFile)
+	{
+		return System::GetAppDirectory() + std::string("saves/") + IO::Path::GetFileNameWithoutExtension(romFile) + ".nesm";
+	}
+
+	// Plays back movie headless at full speed
+	int PlayMovie(const char* romFile, const char* movieFile)
+	{
+		Movie movie;
+		if (!movie.Load(movieFile))
+			return -1;
+
+		std::shared_ptr<Nes> nes = std::make_shared<Nes>();
+		nes->Initialize(true);
+		nes->LoadRom(romFile);
+		nes->Reset();
+
+		if (!movie.Restore(*nes))
+			return -1;
+
+		Profiler::Initialize(*nes);
+
+		MoviePlayer player(movie);
+		nes->SetInputSource(&player);
+
+		const float64 startTime = System::GetTimeSec();
+		while (!player.IsFinished())
+		{
+			nes->ExecuteFrame(false);
+		}
+		const float64 elapsedTime = System::GetTimeSec() - startTime;
+
+		printf("Played %d frames in %.2f s (%.1f FPS)\n", (int)player.GetNumFramesPlayed(), elapsedTime,
+			player.GetNumFramesPlayed() / std::max(elapsedTime, 0.001));
+		return 0;
+	}
+
+	// Returns a path without extension for a new capture of the rom, in the captures directory
+	std::string GetNewCaptureBaseFile(const std::string& romFile)
+	{
+		const std::string captureDir = System::GetAppDirectory() + std::string("captures/");
+		System::CreateDirectory(captureDir.c_str());
+
+		const std::string romName = IO::Path::GetFileNameWithoutExtension(romFile);
+		for (int index = 1; ; ++index)
+		{
+			const std::string baseFile = captureDir + romName + FormattedString<>("-%03d", index).Value();
+			FileStream fs;
+			if (!fs.Open((baseFile + ".wav").c_str(), "rb"))
+				return baseFile;
+		}
+	}
+
+	// Last executed instructions are always recorded, and saved if emulation fails
+	const size_t kNumInstructionTraceRecords = 64 * 1024;
+
+	// Frames emulated but not presented for each one presented while turbo is held
+	const size_t kTurboFrameSkip = 3;
+
+	const size_t kScreenWidth = 256;
+	const size_t kScreenHeight = 240;
+
+	void SaveInstructionTrace(const std::shared_ptr<Nes>& nes)
+	{
+		if (nes && nes->IsInstructionTraceEnabled())
+			nes->SaveInstructionTrace((System::GetAppDirectory() + std::string("trace.bin")).c_str());
+	}
+
 	bool OpenRomFileDialog(std::string& fileSelected)
 	{
 		return System::SupportsOpenFileDialog() 
@@ -85,11 +160,14 @@ namespace
 
 int main(int argc, char* argv[])
 {
+	std::shared_ptr<Nes> nesHolder;
+
 	try
 	{
 		PrintAppInfo();
 
 		std::string romFile;
+		std::string sharedMemoryName;
 
 		if (argc == 1)
 		{
@@ -103,6 +181,17 @@ int main(int argc, char* argv[])
 		{
 			romFile = argv[1];
 		}
+		else if (argc == 4 && std::string(argv[2]) == "-play")
+		{
+			const int result = PlayMovie(argv[1], argv[3]);
+			Profiler::Shutdown();
+			return result;
+		}
+		else if (argc == 4 && std::string(argv[2]) == "-shm")
+		{
+			romFile = argv[1];
+			sharedMemoryName = argv[3];
+		}
 		
 		if (romFile.empty())
 		{
@@ -110,19 +199,52 @@ int main(int argc, char* argv[])
 			FAIL("No rom file to load");
 		}
 
-		std::shared_ptr<Nes> nesHolder = std::make_shared<Nes>();
+		nesHolder = std::make_shared<Nes>();
 		Nes* nes = nesHolder.get();
 		nes->Initialize();
+		nes->EnableInstructionTrace(kNumInstructionTraceRecords);
 		
 		Debugger::Initialize(*nes);
+		Profiler::Initialize(*nes);
 
 		RomHeader romHeader = nes->LoadRom(romFile.c_str());
 		PrintRomInfo(romFile.c_str(), romHeader);
 		nes->Reset();
 
+		// Publish frames and audio for other local processes (see SharedMemoryExport)
+		SharedMemoryExport sharedMemoryExport;
+		if (!sharedMemoryName.empty())
+		{
+			if (!sharedMemoryExport.Create(sharedMemoryName.c_str(), kScreenWidth, kScreenHeight, PixelFormat::Argb8888, nes->GetAudioSampleRate()))
+				FAIL("Failed to create shared memory export '%s'", sharedMemoryName.c_str());
+			nes->AddAvOutputListener(&sharedMemoryExport);
+			printf("Exporting frames and audio to shared memory '%s'\n", sharedMemoryName.c_str());
+		}
+
 		bool quit = false;
 		bool paused = false;
 		bool stepOneFrame = false;
+		UpscaleFilter::Type upscaleFilter = UpscaleFilter::None;
+
+		AvCapture avCapture;
+
+		KeyboardInputSource keyboardInputSource;
+		Movie movie;
+		std::shared_ptr<MovieRecorder> movieRecorder;
+
+		auto stopMovieRecording = [&] ()
+		{
+			if (movieRecorder)
+			{
+				nes->SetInputSource(nullptr);
+				movieRecorder.reset();
+				movie.Save(GetMovieFile(romFile).c_str());
+
+				// Sram is the game's own again from here on
+				if (movie.GetAnchor() == MovieAnchor::PowerOn)
+					nes->ResumeSaveRamFiles();
+			}
+		};
 
 		while (!quit)
 		{
@@ -136,6 +258,8 @@ int main(int argc, char* argv[])
 
 			if (Input::CtrlDown() && Input::KeyPressed(SDL_SCANCODE_O))
 			{
+				stopMovieRecording();
+
 				std::string fileSelected;
 				if (OpenRomFileDialog(fileSelected))
 				{
@@ -148,12 +272,14 @@ int main(int argc, char* argv[])
 
 			if (Input::CtrlDown() && Input::KeyPressed(SDL_SCANCODE_R))
 			{
+				stopMovieRecording();
 				nes->Reset();
 				paused = false;
 			}
 
 			if (Input::AltDown() && Input::KeyPressed(SDL_SCANCODE_F4))
 			{
+				stopMovieRecording();
 				quit = true;
 			}
 
@@ -177,6 +303,49 @@ int main(int argc, char* argv[])
 
 			const bool turbo = Input::KeyDown(SDL_SCANCODE_GRAVE); // tilde '~' key
 			nes->SetTurboEnabled(turbo);
+			nes->SetFrameSkip(turbo? kTurboFrameSkip : 0);
+
+			// Cycle through run-ahead frames; each one adds a frame of emulation per frame
+			if (Input::KeyPressed(SDL_SCANCODE_F9))
+			{
+				nes->SetRunAheadFrames((nes->GetRunAheadFrames() + 1) % 3);
+				printf("Run-ahead: %d frame(s)\n", static_cast<int32>(nes->GetRunAheadFrames()));
+			}
+
+			if (Input::KeyPressed(SDL_SCANCODE_F10))
+			{
+				upscaleFilter = static_cast<UpscaleFilter::Type>((upscaleFilter + 1) % UpscaleFilter::NumTypes);
+				nes->SetUpscaleFilter(upscaleFilter);
+				printf("Upscale filter: %s\n", UpscaleFilter::String[upscaleFilter]);
+			}
+
+			// F11 to start capturing video and audio (Shift+F11 for palette-indexed video), and again to stop
+			if (Input::KeyPressed(SDL_SCANCODE_F11))
+			{
+				if (avCapture.IsCapturing())
+				{
+					nes->RemoveAvOutputListener(&avCapture);
+					const size_t numStalls = avCapture.GetNumStalls();
+					if (avCapture.Stop())
+						printf("Capture stopped (%d stalls)\n", static_cast<int32>(numStalls));
+					else
+						printf("Capture stopped, failed to write all of it\n");
+				}
+				else
+				{
+					const std::string baseFile = GetNewCaptureBaseFile(romFile);
+					const auto format = Input::ShiftDown()? VideoCaptureFormat::Indexed : VideoCaptureFormat::Y4m;
+					if (avCapture.Start(baseFile, format, nes->GetAudioSampleRate()))
+					{
+						nes->AddAvOutputListener(&avCapture);
+						printf("Capturing to %s%s and %s.wav...\n", baseFile.c_str(), VideoCaptureFormat::Extension[format], baseFile.c_str());
+					}
+					else
+					{
+						printf("Failed to start capture to %s\n", baseFile.c_str());
+					}
+				}
+			}
 
 			if (Input::KeyPressed(SDL_SCANCODE_F5))
 			{
@@ -184,24 +353,48 @@ int main(int argc, char* argv[])
 			}
 			if (Input::KeyPressed(SDL_SCANCODE_F7))
 			{
+				stopMovieRecording();
 				nes->SerializeSaveState(false);
 			}
 
-			nes->RewindSaveStates(Input::KeyDown(SDL_SCANCODE_BACKSPACE));
+			// Ctrl+M to start recording movie from current state (Ctrl+Shift+M from power on), and again to stop
+			if (Input::CtrlDown() && Input::KeyPressed(SDL_SCANCODE_M))
+			{
+				if (movieRecorder)
+				{
+					stopMovieRecording();
+				}
+				else
+				{
+					movie.Begin(*nes, Input::ShiftDown()? MovieAnchor::PowerOn : MovieAnchor::SaveState);
+					movieRecorder = std::make_shared<MovieRecorder>(movie, keyboardInputSource);
+					nes->SetInputSource(movieRecorder.get());
+					printf("Recording movie...\n");
+				}
+			}
+
+			// Rewinding would desync the movie being recorded
+			nes->RewindSaveStates(!movieRecorder && Input::KeyDown(SDL_SCANCODE_BACKSPACE));
 
 			ProcessInputForChannelVolumes(*nes);
 		}
 	}
 	catch (const std::exception& ex)
 	{
+		SaveInstructionTrace(nesHolder);
 		System::MessageBox("Exception", ex.what());
 	}
 	catch (...)
 	{
+		SaveInstructionTrace(nesHolder);
 		System::MessageBox("Exception", "Unknown exception");
 	}
 
+	nesHolder.reset();
+
 	Debugger::Shutdown();
+	Profiler::Shutdown();
+	FrameTrace::Shutdown();
 
 	return 0;
 }
@@ -0,0 +1,490 @@
+// nes-bench: micro and macro benchmarks
+//
+// Microbenchmarks time individual subsystems of a headless Nes, starting each sample from the same
+// state captured after running the first rom for a few seconds. Only the subsystem being measured
+// is clocked, so e.g. the CPU keeps executing whatever it was running without the PPU advancing.
+// Macrobenchmarks run each rom for a fixed number of frames, driven by <rom>.nesm if present.
+// Each benchmark is sampled several times and the median is reported, along with heap allocations
+// counted through the global operator new.
+
+#include "Base.h"
+#include "Nes.h"
+#include "Movie.h"
+#include "Serializer.h"
+#include "Stream.h"
+#include "System.h"
+#include "IO.h"
+#include "ToolUtils.h"
+#include "Upscaler.h"
+#include "NesEnv.h"
+#include <vector>
+#include <string>
+#include <atomic>
+#include <algorithm>
+#include <functional>
+#include <cstdlib>
+#include <cctype>
+#include <new>
+
+namespace
+{
+	std::atomic<uint64> g_numAllocations(0);
+}
+
+void* operator new(size_t size)
+{
+	++g_numAllocations;
+	if (void* p = malloc(size > 0? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+namespace
+{
+	const size_t kCpuCyclesPerFrame = 29781;
+	const size_t kScreenWidth = 256;
+	const size_t kScreenHeight = 240;
+	const size_t kAvgCpuCyclesPerInstruction = 3;
+	const size_t kWarmUpFrames = 180;
+	const size_t kDefaultNumFrames = 1800;
+	const size_t kDefaultNumSamples = 5;
+
+#if CONFIG_DEBUG
+	const char* kConfigName = "debug";
+#else
+	const char* kConfigName = "release";
+#endif
+
+	struct Options
+	{
+		Options() : numFrames(kDefaultNumFrames), numSamples(kDefaultNumSamples), micro(true), macro(true), idleLoopSkip(true) {}
+
+		size_t numFrames;
+		size_t numSamples;
+		bool micro;
+		bool macro;
+		bool idleLoopSkip;
+		std::string filter;
+		std::string jsonFile;
+		std::vector<std::string> romFiles;
+	};
+
+	struct BenchResult
+	{
+		std::string name;
+		std::string unit; // What one op is
+		uint64 numOps; // Per sample
+		float64 nsPerOp;
+		float64 allocsPerOp;
+	};
+
+	// Runs func(numOps) numSamples times, calling setup() untimed before each, and returns the median
+	BenchResult Measure(const std::string& name, const char* unit, uint64 numOps, size_t numSamples,
+		const std::function<void()>& setup, const std::function<void(uint64)>& func)
+	{
+		std::vector<float64> nsPerOp;
+		std::vector<float64> allocsPerOp;
+
+		for (size_t i = 0; i < numSamples; ++i)
+		{
+			setup();
+
+			const uint64 startAllocations = g_numAllocations;
+			const float64 startTime = System::GetTimeSec();
+			func(numOps);
+			const float64 elapsed = System::GetTimeSec() - startTime;
+
+			nsPerOp.push_back(elapsed * 1e9 / numOps);
+			allocsPerOp.push_back(static_cast<float64>(g_numAllocations - startAllocations) / numOps);
+		}
+
+		auto median = [] (std::vector<float64>& values)
+		{
+			std::sort(values.begin(), values.end());
+			return values[values.size() / 2];
+		};
+
+		BenchResult result;
+		result.name = name;
+		result.unit = unit;
+		result.numOps = numOps;
+		result.nsPerOp = median(nsPerOp);
+		result.allocsPerOp = median(allocsPerOp);
+		return result;
+	}
+}
+
+// Friend of Nes, to drive subsystems individually
+class NesBench
+{
+public:
+	NesBench(const Options& options)
+		: m_options(options)
+		, m_sink(0)
+	{
+	}
+
+	void RunMicro(const std::string& romFile)
+	{
+		m_nes = std::make_shared<Nes>();
+		m_nes->Initialize(true);
+		m_nes->SetIdleLoopSkipEnabled(m_options.idleLoopSkip);
+		m_nes->LoadRom(romFile.c_str());
+		m_nes->Reset();
+		m_nes->PowerOn();
+		m_nes->SetInputSource(&m_noInput);
+
+		for (size_t i = 0; i < kWarmUpFrames; ++i)
+			m_nes->ExecuteFrame(false);
+
+		m_nes->SaveState(m_warmState);
+		auto restore = [this] () { m_nes->LoadState(m_warmState); };
+
+		Nes& nes = *m_nes;
+
+		// Interpreted every instruction: idle loops are only skipped when driven through Nes
+		nes.SetIdleLoopSkipEnabled(false);
+		Run("cpu.execute", "instruction", 200000, restore, [&] (uint64 numOps)
+		{
+			uint32 cpuCycles;
+			for (uint64 i = 0; i < numOps; ++i)
+				nes.m_cpu.Execute(cpuCycles);
+		});
+		nes.SetIdleLoopSkipEnabled(m_options.idleLoopSkip);
+
+		// Alternate between internal RAM and PRG-ROM, the common cases
+		Run("cpumemorybus.read", "read", 1000000, restore, [&] (uint64 numOps)
+		{
+			uint8 sum = 0;
+			for (uint64 i = 0; i < numOps; ++i)
+			{
+				const uint16 address = (i & 1)? static_cast<uint16>(i & 0x07FF) : static_cast<uint16>(0x8000 | (i & 0x7FFF));
+				sum += nes.m_cpuMemoryBus.Read(address);
+			}
+			m_sink += sum;
+		});
+
+		// Includes rendering of every visible pixel when the rom has rendering enabled. Nothing
+		// services the NMI (and mapper IRQs) the PPU signals, so drop them before the next one.
+		Run("ppu.execute", "frame", 60, restore, [&] (uint64 numOps)
+		{
+			for (uint64 i = 0; i < numOps; ++i)
+			{
+				bool completedFrame = false;
+				while (!completedFrame)
+				{
+					nes.m_ppu.Execute(kAvgCpuCyclesPerInstruction, completedFrame);
+					nes.m_cpu.ClearPendingInterrupts();
+				}
+			}
+		});
+
+		Run("apu.execute", "frame", 60, restore, [&] (uint64 numOps)
+		{
+			for (uint64 i = 0; i < numOps; ++i)
+			{
+				for (size_t c = 0; c < kCpuCyclesPerFrame; c += kAvgCpuCyclesPerInstruction)
+					nes.m_apu.Execute(kAvgCpuCyclesPerInstruction);
+			}
+		});
+
+		std::vector<uint8> state(m_warmState.size());
+		Run("serializer.save", "state", 1000, restore, [&] (uint64 numOps)
+		{
+			for (uint64 i = 0; i < numOps; ++i)
+			{
+				MemoryStream ms;
+				ms.Open(state.data(), state.size());
+				Serializer::SaveRootObject(ms, nes);
+			}
+		});
+
+		Run("serializer.load", "state", 1000, restore, [&] (uint64 numOps)
+		{
+			for (uint64 i = 0; i < numOps; ++i)
+			{
+				MemoryStream ms;
+				ms.Open(m_warmState.data(), m_warmState.size());
+				Serializer::LoadRootObject(ms, nes);
+			}
+		});
+
+		// Branching another instance from this one, e.g. for tree search
+		Nes clone;
+		clone.Initialize(true);
+		clone.CloneFrom(nes);
+		Run("nes.clonefrom", "clone", 1000, restore, [&] (uint64 numOps)
+		{
+			for (uint64 i = 0; i < numOps; ++i)
+				clone.CloneFrom(nes);
+		});
+
+		// Only rehashes memory written since the previous call, none here after the first call
+		Run("nes.getstatehash", "hash", 10000, restore, [&] (uint64 numOps)
+		{
+			uint64 hash = 0;
+			for (uint64 i = 0; i < numOps; ++i)
+				hash += nes.GetStateHash();
+			m_sink += static_cast<size_t>(hash);
+		});
+
+		// Rewind is disabled when headless, so set it up here
+		nes.m_rewindManager.Initialize(nes);
+		Run("rewindmanager.save", "state", 1000, restore, [&] (uint64 numOps)
+		{
+			for (uint64 i = 0; i < numOps; ++i)
+				nes.m_rewindManager.SaveRewindState();
+		});
+
+		// The warm state's frame, upscaled with as many threads as the hardware has
+		size_t framePitch;
+		const uint8* frame = nes.GetFrameBuffer(framePitch);
+		Upscaler upscaler;
+		std::vector<uint8> upscaled;
+		for (size_t filter = UpscaleFilter::Scale2x; filter < UpscaleFilter::NumTypes; ++filter)
+		{
+			upscaler.SetFilter(static_cast<UpscaleFilter::Type>(filter));
+			const size_t scale = upscaler.GetScale();
+			upscaled.resize(kScreenWidth * scale * kScreenHeight * scale * sizeof(uint32));
+
+			std::string name = std::string("upscaler.") + UpscaleFilter::String[filter];
+			std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+			Run(name, "frame", 60, restore, [&] (uint64 numOps)
+			{
+				for (uint64 i = 0; i < numOps; ++i)
+					upscaler.Apply(frame, framePitch, kScreenWidth, kScreenHeight, upscaled.data(), kScreenWidth * scale * sizeof(uint32));
+			});
+		}
+
+		m_nes.reset();
+	}
+
+	void RunMacro(const std::string& romFile)
+	{
+		const std::string name = "frame." + IO::Path::GetFileNameWithoutExtension(romFile);
+		if (!MatchesFilter(name))
+			return;
+
+		m_nes = std::make_shared<Nes>();
+		m_nes->Initialize(true);
+		m_nes->SetIdleLoopSkipEnabled(m_options.idleLoopSkip);
+		m_nes->LoadRom(romFile.c_str());
+		m_nes->Reset();
+
+		Movie movie;
+		const std::string movieFile = IO::Path::ChangeExtension(romFile, "nesm");
+		const bool hasMovie = ToolUtils::FileExists(movieFile) && movie.Load(movieFile.c_str());
+		if (!hasMovie || !movie.Restore(*m_nes))
+			m_nes->PowerOn();
+
+		std::vector<uint8> startState;
+		m_nes->SaveState(startState);
+
+		std::shared_ptr<MoviePlayer> player;
+		auto setup = [&] ()
+		{
+			m_nes->LoadState(startState);
+			player = std::make_shared<MoviePlayer>(movie);
+			m_nes->SetInputSource(hasMovie? static_cast<InputSource*>(player.get()) : &m_noInput);
+		};
+
+		auto executeFrames = [&] (uint64 numOps)
+		{
+			for (uint64 i = 0; i < numOps; ++i)
+				m_nes->ExecuteFrame(false);
+		};
+
+		Run(name, "frame", m_options.numFrames, setup, executeFrames);
+
+		// Fast-forward, 3 of every 4 frames are not composed or presented
+		m_nes->SetFrameSkip(3);
+		Run(name + ".frameskip3", "frame", m_options.numFrames, setup, executeFrames);
+		m_nes->SetFrameSkip(0);
+
+		// Run-ahead overhead per frame is the difference with the first run: a state save and load,
+		// and the hidden frame
+		m_nes->SetRunAheadFrames(1);
+		Run(name + ".runahead1", "frame", m_options.numFrames, setup, executeFrames);
+
+		m_nes.reset();
+	}
+
+	// Batched RL environments (see NesEnvBatch), stepped with changing actions so that games don't
+	// sit idle
+	void RunEnv(const std::string& romFile)
+	{
+		const std::string name = "env." + IO::Path::GetFileNameWithoutExtension(romFile);
+		if (!MatchesFilter(name))
+			return;
+
+		const size_t kNumEnvs = 8;
+		NesEnvConfig config;
+		config.romFile = romFile;
+		NesEnvBatch envs;
+		envs.Initialize(config, kNumEnvs);
+
+		std::vector<uint8> actions(kNumEnvs);
+		const uint64 numSteps = std::max<uint64>(m_options.numFrames / config.framesPerStep / kNumEnvs, 1);
+		size_t stepIndex = 0;
+
+		Run(name + ".step", "env-step", numSteps * kNumEnvs, [&] () { envs.ResetAll(); }, [&] (uint64 numOps)
+		{
+			for (uint64 i = 0; i < numOps; i += kNumEnvs, ++stepIndex)
+			{
+				for (size_t e = 0; e < kNumEnvs; ++e)
+					actions[e] = static_cast<uint8>(((stepIndex / 8 + e) * 37) >> 2);
+				envs.Step(actions.data());
+			}
+		});
+	}
+
+	void PrintResults() const
+	{
+		printf("%-32s %14s %14s %12s\n", "Benchmark", "ns/op", "ops/s", "allocs/op");
+		for (const auto& result : m_results)
+		{
+			const std::string name = result.name + " (" + result.unit + ")";
+			printf("%-32s %14.1f %14.1f %12.3f\n", name.c_str(), result.nsPerOp, 1e9 / result.nsPerOp, result.allocsPerOp);
+		}
+	}
+
+	bool WriteJson(const char* file) const
+	{
+		FileStream fs;
+		if (!fs.Open(file, "w"))
+			return false;
+
+		fs.Printf("{\n  \"config\": \"%s\",\n  \"samples\": %d,\n  \"idle_loop_skip\": %s,\n  \"benchmarks\": [", kConfigName,
+			static_cast<int32>(m_options.numSamples), m_options.idleLoopSkip? "true" : "false");
+
+		for (size_t i = 0; i < m_results.size(); ++i)
+		{
+			const BenchResult& result = m_results[i];
+			fs.Printf("%s\n    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %llu, \"ns_per_op\": %.3f, \"ops_per_sec\": %.3f, \"allocs_per_op\": %.4f}",
+				i > 0? "," : "", result.name.c_str(), result.unit.c_str(), result.numOps, result.nsPerOp, 1e9 / result.nsPerOp, result.allocsPerOp);
+		}
+
+		fs.Printf("\n  ]\n}\n");
+		return true;
+	}
+
+private:
+	bool MatchesFilter(const std::string& name) const
+	{
+		return m_options.filter.empty() || name.find(m_options.filter) != std::string::npos;
+	}
+
+	void Run(const std::string& name, const char* unit, uint64 numOps,
+		const std::function<void()>& setup, const std::function<void(uint64)>& func)
+	{
+		if (!MatchesFilter(name))
+			return;
+
+		const BenchResult result = Measure(name, unit, numOps, m_options.numSamples, setup, func);
+		printf("  %s: %.1f ns/%s\n", result.name.c_str(), result.nsPerOp, result.unit.c_str());
+		m_results.push_back(result);
+	}
+
+	const Options& m_options;
+	std::shared_ptr<Nes> m_nes;
+	std::vector<uint8> m_warmState;
+	ToolUtils::NoInputSource m_noInput;
+	std::vector<BenchResult> m_results;
+	uint32 m_sink; // Keeps reads from being optimized out
+};
+
+namespace
+{
+	int ShowUsage(const char* appPath)
+	{
+		printf("Usage: %s [options] <nes rom>...\n\n", appPath);
+		printf("Microbenchmarks run on the first rom, macrobenchmarks on all of them. Input for\n");
+		printf("macrobenchmarks is read from <rom>.nesm (recorded with nes-emu) if present.\n\n");
+		printf("Options:\n");
+		printf("  -frames <n>       Frames per macrobenchmark sample (default %d)\n", static_cast<int32>(kDefaultNumFrames));
+		printf("  -samples <n>      Samples per benchmark, the median is reported (default %d)\n", static_cast<int32>(kDefaultNumSamples));
+		printf("  -filter <text>    Only run benchmarks whose name contains text\n");
+		printf("  -nomicro          Skip microbenchmarks\n");
+		printf("  -nomacro          Skip macrobenchmarks\n");
+		printf("  -noidleskip       Interpret idle loops instead of skipping them\n");
+		printf("  -json <file>      Write results as JSON\n");
+		printf("\n");
+		return -1;
+	}
+
+	bool ParseArgs(int argc, char* argv[], Options& options)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+			if (arg == "-frames" && i + 1 < argc)
+				options.numFrames = atoi(argv[++i]);
+			else if (arg == "-samples" && i + 1 < argc)
+				options.numSamples = atoi(argv[++i]);
+			else if (arg == "-filter" && i + 1 < argc)
+				options.filter = argv[++i];
+			else if (arg == "-nomicro")
+				options.micro = false;
+			else if (arg == "-nomacro")
+				options.macro = false;
+			else if (arg == "-noidleskip")
+				options.idleLoopSkip = false;
+			else if (arg == "-json" && i + 1 < argc)
+				options.jsonFile = argv[++i];
+			else if (arg[0] == '-')
+				return false;
+			else
+				options.romFiles.push_back(arg);
+		}
+		return !options.romFiles.empty() && options.numFrames > 0 && options.numSamples > 0;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!ParseArgs(argc, argv, options))
+		return ShowUsage(argv[0]);
+
+	NesBench bench(options);
+
+	try
+	{
+		if (options.micro)
+		{
+			printf("Microbenchmarks: %s\n", options.romFiles[0].c_str());
+			bench.RunMicro(options.romFiles[0]);
+		}
+
+		if (options.macro)
+		{
+			printf("Macrobenchmarks: %d frames\n", static_cast<int32>(options.numFrames));
+			for (const auto& romFile : options.romFiles)
+			{
+				bench.RunMacro(romFile);
+				bench.RunEnv(romFile);
+			}
+		}
+	}
+	catch (const std::exception& ex)
+	{
+		printf("Benchmark failed: %s\n", ex.what());
+		return -1;
+	}
+
+	printf("\n");
+	bench.PrintResults();
+
+	if (!options.jsonFile.empty() && !bench.WriteJson(options.jsonFile.c_str()))
+	{
+		printf("Failed to write JSON file: %s\n", options.jsonFile.c_str());
+		return -1;
+	}
+
+	return 0;
+}
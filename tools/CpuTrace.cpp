@@ -0,0 +1,386 @@
+// nes-cputrace: differential CPU verification against a reference instruction trace
+//
+// Runs a rom headless and compares the CPU state before every instruction against a known-good
+// reference log, such as nestest.log:
+//   C000  4C F5 C5  JMP $C5F5          A:00 X:00 Y:00 P:24 SP:FD PPU:  0, 21 CYC:7
+// Only the PC (first 4 hex digits of the line) and the A:, X:, Y:, P:, SP: and CYC: fields are
+// used. The reference is streamed one line at a time and compared in memory, so neither log has
+// to be held in memory or written out in full. Execution stops at the first mismatch.
+
+#include "Base.h"
+#include "Nes.h"
+#include "Movie.h"
+#include "IO.h"
+#include "System.h"
+#include "ToolUtils.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <fstream>
+#include <cstring>
+#include <stdexcept>
+
+namespace
+{
+	const size_t kDefaultMaxFrames = 60 * 60 * 10;
+	const size_t kDefaultNumContextLines = 5;
+
+	// B (bit 4) and Unused (bit 5) don't exist in the CPU and are only meaningful when P is pushed,
+	// so emulators disagree on them. Ignore them by default.
+	const uint8 kIgnoredStatusBits = 0x30;
+
+	struct Options
+	{
+		Options()
+			: compareCycles(true), syncRegisters(false), fullStatus(false)
+			, maxFrames(kDefaultMaxFrames), numContextLines(kDefaultNumContextLines)
+		{}
+
+		bool compareCycles;
+		bool syncRegisters;
+		bool fullStatus;
+		size_t maxFrames;
+		size_t numContextLines;
+		std::string romFile;
+		std::string referenceFile;
+	};
+
+	struct TraceState
+	{
+		CpuRegisters registers;
+		uint64 cycle;
+	};
+
+	bool ParseHexField(const std::string& line, const char* tag, uint8& value)
+	{
+		const size_t pos = line.find(tag);
+		if (pos == std::string::npos)
+			return false;
+		value = static_cast<uint8>(strtoul(line.c_str() + pos + strlen(tag), nullptr, 16));
+		return true;
+	}
+
+	bool ParseReferenceLine(const std::string& line, bool needCycle, TraceState& state)
+	{
+		if (line.size() < 4)
+			return false;
+
+		char* end = nullptr;
+		const std::string pc = line.substr(0, 4);
+		state.registers.PC = static_cast<uint16>(strtoul(pc.c_str(), &end, 16));
+		if (*end != '\0')
+			return false;
+
+		// SP: before P: so that "SP:" isn't taken for "P:"
+		if (!ParseHexField(line, "SP:", state.registers.SP)
+			|| !ParseHexField(line, " A:", state.registers.A)
+			|| !ParseHexField(line, " X:", state.registers.X)
+			|| !ParseHexField(line, " Y:", state.registers.Y)
+			|| !ParseHexField(line, " P:", state.registers.P))
+		{
+			return false;
+		}
+
+		state.cycle = 0;
+		if (needCycle)
+		{
+			const size_t pos = line.find("CYC:");
+			if (pos == std::string::npos)
+				return false;
+			state.cycle = strtoull(line.c_str() + pos + 4, nullptr, 10);
+		}
+		return true;
+	}
+
+	std::string FormatState(const TraceState& state)
+	{
+		const CpuRegisters& r = state.registers;
+		return FormattedString<>("%04X  A:%02X X:%02X Y:%02X P:%02X SP:%02X CYC:%llu",
+			r.PC, r.A, r.X, r.Y, r.P, r.SP, state.cycle).Value();
+	}
+
+	class TraceVerifier : public CpuInstructionListener
+	{
+	public:
+		TraceVerifier(const Options& options, std::istream& reference)
+			: m_options(options), m_reference(reference)
+			, m_lineNumber(0), m_numInstructions(0), m_firstCycle(0), m_referenceFirstCycle(0)
+			, m_mismatch(false), m_done(false)
+		{
+		}
+
+		// Reads the first reference line, which -sync applies to the CPU before running. Returns false
+		// if there is none, or on error (see GetError).
+		bool Begin(TraceState& first)
+		{
+			if (!ReadReferenceLine(m_expected))
+				return false;
+			first = m_expected;
+			m_referenceFirstCycle = m_expected.cycle;
+			return true;
+		}
+
+		virtual void OnCpuInstruction(const CpuRegisters& registers, uint64 totalCycles)
+		{
+			if (m_done)
+				return;
+
+			if (m_numInstructions == 0)
+				m_firstCycle = totalCycles;
+
+			// Cycles are compared relative to the first instruction as reference logs start counting
+			// from different points (e.g. nestest.log starts at 7, after the reset sequence)
+			m_actual.registers = registers;
+			m_actual.cycle = totalCycles - m_firstCycle + m_referenceFirstCycle;
+
+			if (!Matches(m_actual, m_expected))
+			{
+				m_mismatch = true;
+				m_done = true;
+				return;
+			}
+
+			++m_numInstructions;
+			PushContext(m_expectedLine);
+
+			if (!ReadReferenceLine(m_expected))
+				m_done = true;
+		}
+
+		bool IsDone() const { return m_done; }
+		bool HasMismatch() const { return m_mismatch; }
+		const std::string& GetError() const { return m_error; } // Set if the reference log is invalid
+		size_t GetNumInstructions() const { return m_numInstructions; }
+
+		void ReportMismatch() const
+		{
+			printf("Mismatch at reference line %d (instruction %d):\n\n",
+				static_cast<int32>(m_lineNumber), static_cast<int32>(m_numInstructions));
+
+			size_t lineNumber = m_lineNumber - m_context.size();
+			for (const auto& line : m_context)
+				printf("  %6d  %s\n", static_cast<int32>(lineNumber++), line.c_str());
+
+			printf("\n  expected  %s\n", m_expectedLine.c_str());
+			printf("  actual    %s\n", FormatState(m_actual).c_str());
+			printf("  differs   %s\n", DescribeDifferences(m_actual, m_expected).c_str());
+		}
+
+	private:
+		bool ReadReferenceLine(TraceState& state)
+		{
+			while (std::getline(m_reference, m_expectedLine))
+			{
+				++m_lineNumber;
+				if (!m_expectedLine.empty() && m_expectedLine.back() == '\r')
+					m_expectedLine.pop_back();
+				if (m_expectedLine.empty())
+					continue;
+
+				// Called from within the emulator, so don't throw: the main loop stops once done
+				if (!ParseReferenceLine(m_expectedLine, m_options.compareCycles, state))
+				{
+					m_error = FormattedString<>("Failed to parse reference line %d: %s", static_cast<int32>(m_lineNumber), m_expectedLine.c_str()).Value();
+					return false;
+				}
+				return true;
+			}
+			return false;
+		}
+
+		uint8 StatusMask() const { return m_options.fullStatus? 0xFF : static_cast<uint8>(~kIgnoredStatusBits); }
+
+		bool Matches(const TraceState& actual, const TraceState& expected) const
+		{
+			const CpuRegisters& a = actual.registers;
+			const CpuRegisters& e = expected.registers;
+			return a.PC == e.PC && a.A == e.A && a.X == e.X && a.Y == e.Y && a.SP == e.SP
+				&& (a.P & StatusMask()) == (e.P & StatusMask())
+				&& (!m_options.compareCycles || actual.cycle == expected.cycle);
+		}
+
+		std::string DescribeDifferences(const TraceState& actual, const TraceState& expected) const
+		{
+			const CpuRegisters& a = actual.registers;
+			const CpuRegisters& e = expected.registers;
+			std::string result;
+			auto check = [&] (bool same, const char* name)
+			{
+				if (!same)
+					result += (result.empty()? "" : ", ") + std::string(name);
+			};
+			check(a.PC == e.PC, "PC");
+			check(a.A == e.A, "A");
+			check(a.X == e.X, "X");
+			check(a.Y == e.Y, "Y");
+			check((a.P & StatusMask()) == (e.P & StatusMask()), "P");
+			check(a.SP == e.SP, "SP");
+			check(!m_options.compareCycles || actual.cycle == expected.cycle, "CYC");
+			return result;
+		}
+
+		void PushContext(const std::string& line)
+		{
+			if (m_options.numContextLines == 0)
+				return;
+			if (m_context.size() == m_options.numContextLines)
+				m_context.pop_front();
+			m_context.push_back(line);
+		}
+
+		const Options& m_options;
+		std::istream& m_reference;
+		std::string m_expectedLine;
+		std::string m_error;
+		std::deque<std::string> m_context; // Last matched reference lines
+		TraceState m_expected;
+		TraceState m_actual;
+		size_t m_lineNumber;
+		size_t m_numInstructions;
+		uint64 m_firstCycle;
+		uint64 m_referenceFirstCycle;
+		bool m_mismatch;
+		bool m_done;
+	};
+
+	int ShowUsage(const char* appPath)
+	{
+		printf("Usage: %s [options] <nes rom> <reference log>\n\n", appPath);
+		printf("Input is read from <rom>.nesm (recorded with nes-emu) if present.\n\n");
+		printf("Options:\n");
+		printf("  -sync         Set CPU registers from the first reference line before running\n");
+		printf("                (e.g. nestest.log, which starts in automation mode at $C000)\n");
+		printf("  -nocycles     Don't compare cycle counts\n");
+		printf("  -fullp        Also compare the B and Unused bits of P\n");
+		printf("  -frames <n>   Maximum frames to run (default %d)\n", static_cast<int32>(kDefaultMaxFrames));
+		printf("  -context <n>  Matched reference lines shown before a mismatch (default %d)\n", static_cast<int32>(kDefaultNumContextLines));
+		printf("\n");
+		return -1;
+	}
+
+	bool ParseArgs(int argc, char* argv[], Options& options)
+	{
+		std::vector<std::string> args;
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+			if (arg == "-sync")
+				options.syncRegisters = true;
+			else if (arg == "-nocycles")
+				options.compareCycles = false;
+			else if (arg == "-fullp")
+				options.fullStatus = true;
+			else if (arg == "-frames" && i + 1 < argc)
+				options.maxFrames = atoi(argv[++i]);
+			else if (arg == "-context" && i + 1 < argc)
+				options.numContextLines = atoi(argv[++i]);
+			else if (arg[0] == '-')
+				return false;
+			else
+				args.push_back(arg);
+		}
+
+		if (args.size() != 2)
+			return false;
+
+		options.romFile = args[0];
+		options.referenceFile = args[1];
+		return true;
+	}
+
+	int Run(const Options& options)
+	{
+		std::ifstream reference(options.referenceFile);
+		if (!reference)
+		{
+			printf("Failed to open reference log: %s\n", options.referenceFile.c_str());
+			return 1;
+		}
+
+		std::shared_ptr<Nes> nes = std::make_shared<Nes>();
+		nes->Initialize(true);
+		nes->LoadRom(options.romFile.c_str());
+		nes->Reset();
+
+		Movie movie;
+		MoviePlayer player(movie);
+		ToolUtils::NoInputSource noInput;
+		const std::string movieFile = IO::Path::ChangeExtension(options.romFile, "nesm");
+
+		if (ToolUtils::FileExists(movieFile))
+		{
+			if (!movie.Load(movieFile.c_str()) || !movie.Restore(*nes))
+			{
+				printf("Failed to play movie: %s\n", movieFile.c_str());
+				return 1;
+			}
+			nes->SetInputSource(&player);
+		}
+		else
+		{
+			nes->PowerOn();
+			nes->SetInputSource(&noInput);
+		}
+
+		TraceVerifier verifier(options, reference);
+		TraceState first;
+		if (!verifier.Begin(first))
+		{
+			if (!verifier.GetError().empty())
+				printf("ERROR: %s\n", verifier.GetError().c_str());
+			else
+				printf("Reference log is empty: %s\n", options.referenceFile.c_str());
+			return 1;
+		}
+
+		if (options.syncRegisters)
+			nes->SetCpuRegisters(first.registers);
+
+		nes->SetCpuInstructionListener(&verifier);
+
+		// Mismatches are detected per instruction, but the emulator only stops at frame boundaries
+		const float64 startTime = System::GetTimeSec();
+		size_t numFrames = 0;
+		while (!verifier.IsDone() && numFrames < options.maxFrames)
+		{
+			nes->ExecuteFrame(false);
+			++numFrames;
+		}
+		const float64 seconds = System::GetTimeSec() - startTime;
+
+		nes->SetCpuInstructionListener(nullptr);
+
+		if (!verifier.GetError().empty())
+		{
+			printf("ERROR: %s\n", verifier.GetError().c_str());
+			return 1;
+		}
+
+		if (verifier.HasMismatch())
+			verifier.ReportMismatch();
+
+		printf("\n%s: %d instructions matched in %d frames (%.2f s, %.1f M instructions/s)\n",
+			verifier.HasMismatch()? "FAIL" : verifier.IsDone()? "PASS" : "INCOMPLETE",
+			static_cast<int32>(verifier.GetNumInstructions()), static_cast<int32>(numFrames), seconds,
+			seconds > 0? verifier.GetNumInstructions() / seconds / 1000000.0 : 0.0);
+
+		return verifier.IsDone() && !verifier.HasMismatch()? 0 : 1;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!ParseArgs(argc, argv, options))
+		return ShowUsage(argv[0]);
+
+	try
+	{
+		return Run(options);
+	}
+	catch (const std::exception& ex)
+	{
+		printf("ERROR: %s\n", ex.what());
+		return 1;
+	}
+}
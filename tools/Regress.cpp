@@ -0,0 +1,325 @@
+// nes-regress: golden-frame regression tests
+//
+// Runs each rom headless for a number of frames, optionally driven by a movie (<rom>.nesm next to
+// the rom), and hashes the framebuffer, the audio samples and optionally the serialized state
+// after every frame. Hashes are compared against a golden file per rom, and the first frame that
+// differs is reported along with the subsystems that diverged. Roms are run in parallel.
+
+#include "Base.h"
+#include "Nes.h"
+#include "Movie.h"
+#include "Hash.h"
+#include "IO.h"
+#include "System.h"
+#include "Stream.h"
+#include "ToolUtils.h"
+#include <vector>
+#include <string>
+#include <fstream>
+
+namespace
+{
+	const size_t kScreenHeight = 240;
+	const size_t kDefaultNumFrames = 600;
+	const char* kGoldenFileMagic = "nes-regress-golden";
+	const uint32 kGoldenFileVersion = 1;
+
+	struct Options
+	{
+		Options() : update(false), hashState(false), numFrames(kDefaultNumFrames), numJobs(0) {}
+
+		bool update;
+		bool hashState;
+		size_t numFrames;
+		size_t numJobs;
+		std::string goldenDir;
+		std::vector<std::string> romFiles;
+	};
+
+	struct FrameHashes
+	{
+		uint64 video;
+		uint64 audio;
+		uint64 state;
+	};
+
+	struct Golden
+	{
+		Golden() : romHash(0), hasState(false) {}
+
+		uint64 romHash;
+		bool hasState;
+		std::vector<FrameHashes> frames;
+	};
+
+	namespace ResultType
+	{
+		enum Type { Pass, Fail, Updated, Error };
+		static const char* String[] = { "PASS", "FAIL", "UPDATED", "ERROR" };
+	}
+
+	struct Result
+	{
+		Result() : type(ResultType::Error), numFrames(0), seconds(0) {}
+
+		ResultType::Type type;
+		std::string message;
+		size_t numFrames;
+		float64 seconds;
+	};
+
+	std::string GetGoldenFile(const Options& options, const std::string& romFile)
+	{
+		return IO::Path::Combine(options.goldenDir, IO::Path::GetFileNameWithoutExtension(romFile) + ".golden");
+	}
+
+	// Text format so that goldens can be inspected and diffed:
+	//   nes-regress-golden <version>
+	//   rom <rom hash> state <0|1> frames <count>
+	//   <video hash> <audio hash> <state hash>    (one line per frame)
+	bool SaveGolden(const char* file, const Golden& golden)
+	{
+		FileStream fs;
+		if (!fs.Open(file, "w"))
+			return false;
+
+		fs.Printf("%s %u\n", kGoldenFileMagic, kGoldenFileVersion);
+		fs.Printf("rom %016llx state %d frames %u\n", golden.romHash, golden.hasState? 1 : 0, static_cast<uint32>(golden.frames.size()));
+		for (const auto& frame : golden.frames)
+		{
+			fs.Printf("%016llx %016llx %016llx\n", frame.video, frame.audio, frame.state);
+		}
+		return true;
+	}
+
+	bool LoadGolden(const char* file, Golden& golden)
+	{
+		std::ifstream ifs(file);
+		std::string magic, romTag, stateTag, framesTag;
+		uint32 version = 0;
+		size_t numFrames = 0;
+
+		ifs >> magic >> version >> romTag >> std::hex >> golden.romHash >> std::dec >> stateTag >> golden.hasState >> framesTag >> numFrames;
+		if (!ifs || magic != kGoldenFileMagic || version != kGoldenFileVersion || romTag != "rom" || stateTag != "state" || framesTag != "frames")
+			return false;
+
+		golden.frames.resize(numFrames);
+		ifs >> std::hex;
+		for (auto& frame : golden.frames)
+		{
+			ifs >> frame.video >> frame.audio >> frame.state;
+		}
+		return !ifs.fail();
+	}
+
+	Result RunRom(const Options& options, const std::string& romFile)
+	{
+		Result result;
+		const std::string goldenFile = GetGoldenFile(options, romFile);
+
+		Golden golden;
+		if (!options.update && !LoadGolden(goldenFile.c_str(), golden))
+		{
+			result.message = "Missing or invalid golden file: " + goldenFile;
+			return result;
+		}
+
+		std::shared_ptr<Nes> nes = std::make_shared<Nes>();
+		nes->Initialize(true);
+		nes->LoadRom(romFile.c_str());
+		nes->Reset();
+
+		if (!options.update && nes->GetRomHash() != golden.romHash)
+		{
+			result.message = "Golden file was recorded with a different rom: " + goldenFile;
+			return result;
+		}
+
+		Movie movie;
+		MoviePlayer player(movie);
+		ToolUtils::NoInputSource noInput;
+		const std::string movieFile = IO::Path::ChangeExtension(romFile, "nesm");
+		size_t numFrames = options.numFrames;
+
+		if (ToolUtils::FileExists(movieFile))
+		{
+			if (!movie.Load(movieFile.c_str()) || !movie.Restore(*nes))
+			{
+				result.message = "Failed to play movie: " + movieFile;
+				return result;
+			}
+			nes->SetInputSource(&player);
+			numFrames = movie.GetNumFrames();
+		}
+		else
+		{
+			nes->PowerOn();
+			nes->SetInputSource(&noInput);
+		}
+
+		if (!options.update)
+			numFrames = golden.frames.size();
+
+		const bool hashState = options.update? options.hashState : golden.hasState;
+		std::vector<float32> samples;
+		std::vector<uint8> state;
+		nes->SetAudioCapture(&samples);
+
+		Golden actual;
+		actual.romHash = nes->GetRomHash();
+		actual.hasState = hashState;
+		actual.frames.resize(numFrames);
+
+		const float64 startTime = System::GetTimeSec();
+
+		for (size_t i = 0; i < numFrames; ++i)
+		{
+			samples.clear();
+			nes->ExecuteFrame(false);
+
+			FrameHashes& frame = actual.frames[i];
+			size_t pitch;
+			const uint8* pixels = nes->GetFrameBuffer(pitch);
+			frame.video = Fnv1a64(pixels, pitch * kScreenHeight);
+			frame.audio = Fnv1a64(samples.data(), samples.size() * sizeof(float32));
+			frame.state = 0;
+			if (hashState)
+			{
+				nes->SaveState(state);
+				frame.state = Fnv1a64(state.data(), state.size());
+			}
+
+			result.numFrames = i + 1;
+
+			if (options.update)
+				continue;
+
+			// Stop at the first divergence, following frames are of no interest
+			const FrameHashes& expected = golden.frames[i];
+			std::string subsystems;
+			auto check = [&] (bool same, const char* name)
+			{
+				if (!same)
+					subsystems += (subsystems.empty()? "" : ", ") + std::string(name);
+			};
+			check(frame.video == expected.video, "video");
+			check(frame.audio == expected.audio, "audio");
+			check(frame.state == expected.state, "state");
+
+			if (!subsystems.empty())
+			{
+				result.type = ResultType::Fail;
+				result.message = FormattedString<>("frame %d differs in %s", static_cast<int32>(i), subsystems.c_str()).Value();
+				result.seconds = System::GetTimeSec() - startTime;
+				return result;
+			}
+		}
+
+		result.seconds = System::GetTimeSec() - startTime;
+
+		if (options.update)
+		{
+			if (!SaveGolden(goldenFile.c_str(), actual))
+			{
+				result.message = "Failed to write golden file: " + goldenFile;
+				return result;
+			}
+			result.type = ResultType::Updated;
+		}
+		else
+		{
+			result.type = ResultType::Pass;
+		}
+		return result;
+	}
+
+	int ShowUsage(const char* appPath)
+	{
+		printf("Usage: %s [options] <golden dir> <nes rom>...\n\n", appPath);
+		printf("Input for each rom is read from <rom>.nesm (recorded with nes-emu) if present.\n\n");
+		printf("Options:\n");
+		printf("  -update      Record golden files instead of comparing against them\n");
+		printf("  -state       Also hash the serialized state each frame (with -update)\n");
+		printf("  -frames <n>  Frames to run for roms without a movie (with -update, default %d)\n", static_cast<int32>(kDefaultNumFrames));
+		printf("  -jobs <n>    Number of roms to run in parallel (default: number of cores)\n");
+		printf("\n");
+		return -1;
+	}
+
+	bool ParseArgs(int argc, char* argv[], Options& options)
+	{
+		std::vector<std::string> args;
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+			if (arg == "-update")
+				options.update = true;
+			else if (arg == "-state")
+				options.hashState = true;
+			else if (arg == "-frames" && i + 1 < argc)
+				options.numFrames = atoi(argv[++i]);
+			else if (arg == "-jobs" && i + 1 < argc)
+				options.numJobs = atoi(argv[++i]);
+			else if (arg[0] == '-')
+				return false;
+			else
+				args.push_back(arg);
+		}
+
+		if (args.size() < 2)
+			return false;
+
+		options.goldenDir = args[0];
+		options.romFiles.assign(args.begin() + 1, args.end());
+		return true;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!ParseArgs(argc, argv, options))
+		return ShowUsage(argv[0]);
+
+	if (options.update)
+		System::CreateDirectory(options.goldenDir.c_str());
+
+	const size_t numRoms = options.romFiles.size();
+	const size_t numJobs = ToolUtils::GetNumJobs(options.numJobs, numRoms);
+	std::vector<Result> results(numRoms);
+
+	const float64 startTime = System::GetTimeSec();
+
+	ToolUtils::ParallelFor(numRoms, numJobs, [&] (size_t i)
+	{
+		try
+		{
+			results[i] = RunRom(options, options.romFiles[i]);
+		}
+		catch (const std::exception& ex)
+		{
+			results[i].type = ResultType::Error;
+			results[i].message = ex.what();
+		}
+	});
+
+	size_t numFailed = 0;
+	for (size_t i = 0; i < numRoms; ++i)
+	{
+		const Result& result = results[i];
+		printf("%-8s %s", ResultType::String[result.type], options.romFiles[i].c_str());
+		if (!result.message.empty())
+			printf(": %s", result.message.c_str());
+		if (result.seconds > 0)
+			printf(" (%d frames, %.0f FPS)", static_cast<int32>(result.numFrames), result.numFrames / result.seconds);
+		printf("\n");
+
+		if (result.type == ResultType::Fail || result.type == ResultType::Error)
+			++numFailed;
+	}
+
+	printf("\n%d of %d roms failed in %.2f s (%d jobs)\n", static_cast<int32>(numFailed), static_cast<int32>(numRoms),
+		System::GetTimeSec() - startTime, static_cast<int32>(numJobs));
+
+	return numFailed == 0? 0 : 1;
+}
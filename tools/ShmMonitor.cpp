@@ -0,0 +1,152 @@
+// nes-shmmon: monitors frames and audio exported to shared memory by nes-emu -shm <name>
+//
+// Reads frames in place as they are published and prints, once per second, how many frames and
+// audio samples were received, how many were missed (overwritten before being read), and the hash
+// of the last frame. Serves as a reference consumer of SharedMemoryExport.
+
+#include "Base.h"
+#include "SharedMemoryExport.h"
+#include "System.h"
+#include "Hash.h"
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstdlib>
+
+namespace
+{
+	const float64 kOpenTimeoutSec = 10.0;
+
+	struct Options
+	{
+		Options() : seconds(0) {}
+
+		size_t seconds; // 0 to run until the export is closed
+		std::string name;
+	};
+
+	int ShowUsage(const char* appPath)
+	{
+		printf("Usage: %s [options] <shared memory name>\n\n", appPath);
+		printf("Options:\n");
+		printf("  -seconds <n>  Stop after n seconds\n");
+		printf("\n");
+		return -1;
+	}
+
+	bool ParseArgs(int argc, char* argv[], Options& options)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+			if (arg == "-seconds" && i + 1 < argc)
+				options.seconds = atoi(argv[++i]);
+			else if (arg[0] == '-' || !options.name.empty())
+				return false;
+			else
+				options.name = arg;
+		}
+		return !options.name.empty();
+	}
+
+	struct Stats
+	{
+		Stats() : numFrames(0), numFramesMissed(0), numSamples(0), numSamplesMissed(0), lastFrameHash(0) {}
+
+		size_t numFrames;
+		size_t numFramesMissed;
+		uint64 numSamples;
+		uint64 numSamplesMissed;
+		uint64 lastFrameHash;
+	};
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!ParseArgs(argc, argv, options))
+		return ShowUsage(argv[0]);
+
+	// The emulator may not have started yet
+	SharedMemoryImport import;
+	const float64 openEndTime = System::GetTimeSec() + kOpenTimeoutSec;
+	while (!import.Open(options.name.c_str()))
+	{
+		if (System::GetTimeSec() >= openEndTime)
+		{
+			printf("Failed to open shared memory: %s\n", options.name.c_str());
+			return 1;
+		}
+		System::Sleep(100);
+	}
+
+	const SharedMemoryExportHeader& header = import.GetHeader();
+	printf("%s: %dx%d %s, %d slots, audio %d Hz\n", options.name.c_str(), header.frameWidth, header.frameHeight,
+		header.pixelFormat < PixelFormat::NumTypes? PixelFormat::String[header.pixelFormat] : "?", header.numFrameSlots, header.audioSampleRate);
+
+	// Start from what is being published now
+	uint32 frameCount = header.frameCount.load(std::memory_order_acquire);
+	uint64 audioPosition = header.audioSampleCount.load(std::memory_order_acquire);
+	std::vector<float32> samples(header.audioRingSize);
+
+	const size_t frameSize = header.framePitch * header.frameHeight;
+	const float64 startTime = System::GetTimeSec();
+	float64 nextReportTime = startTime + 1.0;
+	Stats stats;
+
+	auto report = [&] ()
+	{
+		printf("frames %4d (missed %d)  samples %6d (missed %d)  last frame %016llx\n", (int)stats.numFrames, (int)stats.numFramesMissed,
+			(int)stats.numSamples, (int)stats.numSamplesMissed, (unsigned long long)stats.lastFrameHash);
+		stats = Stats();
+	};
+
+	while (!import.IsClosed())
+	{
+		const float64 currTime = System::GetTimeSec();
+		if (options.seconds > 0 && currTime - startTime >= options.seconds)
+			break;
+
+		if (import.WaitForFrame(frameCount, 0.1))
+		{
+			const uint32 latestFrameCount = header.frameCount.load(std::memory_order_acquire);
+			if (latestFrameCount != frameCount)
+			{
+				stats.numFramesMissed += latestFrameCount - frameCount - 1;
+				frameCount = latestFrameCount;
+
+				// Hash the pixels where they are, then make sure they weren't overwritten meanwhile
+				const uint8* pixels = import.GetFramePixels(frameCount);
+				const uint64 hash = pixels? Fnv1a64(pixels, frameSize) : 0;
+				if (pixels && import.IsFrameValid(frameCount))
+				{
+					++stats.numFrames;
+					stats.lastFrameHash = hash;
+				}
+				else
+				{
+					++stats.numFramesMissed;
+				}
+			}
+		}
+
+		for (size_t numRead; (numRead = import.ReadAudio(audioPosition, samples.data(), samples.size(), stats.numSamplesMissed)) > 0; )
+			stats.numSamples += numRead;
+
+		if (System::GetTimeSec() >= nextReportTime)
+		{
+			report();
+			nextReportTime += 1.0;
+		}
+	}
+
+	// What was published since the last report, up to the close
+	for (size_t numRead; (numRead = import.ReadAudio(audioPosition, samples.data(), samples.size(), stats.numSamplesMissed)) > 0; )
+		stats.numSamples += numRead;
+	report();
+
+	if (import.IsClosed())
+		printf("Export closed\n");
+
+	return 0;
+}
@@ -0,0 +1,388 @@
+// nes-testrom: runs accuracy test roms that report through the $6000 status protocol
+//
+// Test roms (e.g. blargg's CPU, PPU and APU tests) write their status to $6000 and a text message
+// to $6004, once the signature DE B0 61 is written to $6001-$6003:
+//   $80       Test is running
+//   $81       Test requests a reset, at least 100 ms from now
+//   $00-$7F   Test finished with this result code, 0 meaning it passed
+// Each rom is run headless until it posts a result or times out, and roms are run in parallel.
+// Results are printed and optionally written as JUnit XML and JSON.
+
+#include "Base.h"
+#include "Nes.h"
+#include "MemoryMap.h"
+#include "System.h"
+#include "Stream.h"
+#include "ToolUtils.h"
+#include <vector>
+#include <string>
+#include <cstring>
+#include <algorithm>
+
+namespace
+{
+	const uint16 kStatusAddress = 0x6000;
+	const uint16 kSignatureAddress = 0x6001;
+	const uint16 kTextAddress = 0x6004;
+	const uint8 kSignature[] = { 0xDE, 0xB0, 0x61 };
+
+	const uint8 kStatusRunning = 0x80;
+	const uint8 kStatusResetRequested = 0x81;
+
+	const size_t kFramesPerSecond = 60;
+	const size_t kResetDelayFrames = 10; // At least 100 ms
+	const size_t kDefaultTimeoutSeconds = 120;
+
+	struct Options
+	{
+		Options() : timeoutSeconds(kDefaultTimeoutSeconds), numJobs(0) {}
+
+		size_t timeoutSeconds;
+		size_t numJobs;
+		std::string junitFile;
+		std::string jsonFile;
+		std::vector<std::string> romFiles;
+	};
+
+	namespace ResultType
+	{
+		enum Type { Pass, Fail, Timeout, Error };
+		static const char* String[] = { "PASS", "FAIL", "TIMEOUT", "ERROR" };
+	}
+
+	struct Result
+	{
+		Result() : type(ResultType::Error), code(0), numFrames(0), seconds(0) {}
+
+		ResultType::Type type;
+		uint8 code;
+		std::string message; // Text posted by the rom, or the reason it couldn't run
+		size_t numFrames;
+		float64 seconds;
+	};
+
+	// Mirrors sram as the rom writes it, and tracks status changes
+	class StatusMonitor : public SaveRamWriteListener
+	{
+	public:
+		StatusMonitor() : m_finished(false), m_resetRequested(false)
+		{
+			std::fill(std::begin(m_saveRam), std::end(m_saveRam), 0);
+		}
+
+		virtual void OnSaveRamWrite(uint16 cpuAddress, uint8 value)
+		{
+			m_saveRam[cpuAddress - CpuMemory::kSaveRamBase] = value;
+
+			if (cpuAddress != kStatusAddress || !HasSignature())
+				return;
+
+			if (value == kStatusResetRequested)
+				m_resetRequested = true;
+			else if (value < kStatusRunning)
+				m_finished = true;
+		}
+
+		bool HasSignature() const
+		{
+			return std::equal(std::begin(kSignature), std::end(kSignature), &m_saveRam[kSignatureAddress - CpuMemory::kSaveRamBase]);
+		}
+
+		bool IsFinished() const { return m_finished; }
+		uint8 GetStatus() const { return m_saveRam[kStatusAddress - CpuMemory::kSaveRamBase]; }
+
+		bool ConsumeResetRequest()
+		{
+			const bool requested = m_resetRequested;
+			m_resetRequested = false;
+			return requested;
+		}
+
+		std::string GetText() const
+		{
+			const size_t offset = kTextAddress - CpuMemory::kSaveRamBase;
+			const char* text = reinterpret_cast<const char*>(&m_saveRam[offset]);
+			return std::string(text, strnlen(text, sizeof(m_saveRam) - offset));
+		}
+
+	private:
+		uint8 m_saveRam[KB(8)];
+		bool m_finished;
+		bool m_resetRequested;
+	};
+
+	Result RunRom(const Options& options, const std::string& romFile)
+	{
+		Result result;
+
+		std::shared_ptr<Nes> nes = std::make_shared<Nes>();
+		nes->Initialize(true);
+		nes->LoadRom(romFile.c_str());
+		nes->Reset();
+
+		ToolUtils::NoInputSource noInput;
+		StatusMonitor monitor;
+		nes->SetInputSource(&noInput);
+		nes->SetSaveRamWriteListener(&monitor);
+
+		const size_t maxFrames = options.timeoutSeconds * kFramesPerSecond;
+		size_t resetFrame = 0; // Frame to reset on, if non-zero
+
+		const float64 startTime = System::GetTimeSec();
+
+		while (result.numFrames < maxFrames && !monitor.IsFinished())
+		{
+			nes->ExecuteFrame(false);
+			++result.numFrames;
+
+			if (monitor.ConsumeResetRequest())
+				resetFrame = result.numFrames + kResetDelayFrames;
+
+			if (resetFrame != 0 && result.numFrames >= resetFrame)
+			{
+				nes->Reset();
+				resetFrame = 0;
+			}
+		}
+
+		result.seconds = System::GetTimeSec() - startTime;
+
+		if (monitor.IsFinished())
+		{
+			result.code = monitor.GetStatus();
+			result.type = result.code == 0? ResultType::Pass : ResultType::Fail;
+			result.message = monitor.GetText();
+		}
+		else
+		{
+			result.type = ResultType::Timeout;
+			result.message = monitor.HasSignature()? monitor.GetText() : "No status posted at $6000";
+		}
+		return result;
+	}
+
+	std::string EscapeXml(const std::string& s)
+	{
+		std::string escaped;
+		for (char c : s)
+		{
+			switch (c)
+			{
+			case '&': escaped += "&amp;"; break;
+			case '<': escaped += "&lt;"; break;
+			case '>': escaped += "&gt;"; break;
+			case '"': escaped += "&quot;"; break;
+			default:
+				if (static_cast<uint8>(c) >= 0x20 || c == '\n' || c == '\t')
+					escaped += c;
+				break;
+			}
+		}
+		return escaped;
+	}
+
+	std::string EscapeJson(const std::string& s)
+	{
+		std::string escaped;
+		for (char c : s)
+		{
+			switch (c)
+			{
+			case '"': escaped += "\\\""; break;
+			case '\\': escaped += "\\\\"; break;
+			case '\n': escaped += "\\n"; break;
+			case '\t': escaped += "\\t"; break;
+			default:
+				if (static_cast<uint8>(c) >= 0x20)
+					escaped += c;
+				else
+					escaped += FormattedString<8>("\\u%04x", static_cast<uint8>(c)).Value();
+				break;
+			}
+		}
+		return escaped;
+	}
+
+	// Printf is limited to short strings, so messages are written separately
+	void WriteText(IStream& stream, const std::string& text)
+	{
+		stream.Write(text.c_str(), text.size());
+	}
+
+	bool WriteJUnit(const char* file, const Options& options, const std::vector<Result>& results, float64 seconds)
+	{
+		FileStream fs;
+		if (!fs.Open(file, "w"))
+			return false;
+
+		size_t numFailures = 0, numErrors = 0;
+		for (const auto& result : results)
+		{
+			numFailures += result.type == ResultType::Fail? 1 : 0;
+			numErrors += result.type == ResultType::Timeout || result.type == ResultType::Error? 1 : 0;
+		}
+
+		fs.Printf("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n");
+		fs.Printf("<testsuite name=\"nes-testrom\" tests=\"%d\" failures=\"%d\" errors=\"%d\" time=\"%.3f\">\n",
+			static_cast<int32>(results.size()), static_cast<int32>(numFailures), static_cast<int32>(numErrors), seconds);
+
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const Result& result = results[i];
+			fs.Printf("  <testcase classname=\"nes-testrom\" name=\"");
+			WriteText(fs, EscapeXml(options.romFiles[i]));
+			fs.Printf("\" time=\"%.3f\">\n", result.seconds);
+
+			const std::string message = EscapeXml(result.message);
+			switch (result.type)
+			{
+			case ResultType::Pass:
+				break;
+			case ResultType::Fail:
+				fs.Printf("    <failure message=\"Result code %d\">", result.code);
+				WriteText(fs, message);
+				fs.Printf("</failure>\n");
+				break;
+			default:
+				fs.Printf("    <error message=\"%s\">", ResultType::String[result.type]);
+				WriteText(fs, message);
+				fs.Printf("</error>\n");
+				break;
+			}
+
+			if (!result.message.empty())
+			{
+				fs.Printf("    <system-out>");
+				WriteText(fs, message);
+				fs.Printf("</system-out>\n");
+			}
+
+			fs.Printf("  </testcase>\n");
+		}
+
+		fs.Printf("</testsuite>\n");
+		return true;
+	}
+
+	bool WriteJson(const char* file, const Options& options, const std::vector<Result>& results, float64 seconds)
+	{
+		FileStream fs;
+		if (!fs.Open(file, "w"))
+			return false;
+
+		fs.Printf("{\n  \"seconds\": %.3f,\n  \"results\": [", seconds);
+		for (size_t i = 0; i < results.size(); ++i)
+		{
+			const Result& result = results[i];
+			fs.Printf("%s\n    {\"rom\": \"", i > 0? "," : "");
+			WriteText(fs, EscapeJson(options.romFiles[i]));
+			fs.Printf("\", \"result\": \"%s\", \"code\": %d, \"frames\": %d, \"seconds\": %.3f, \"message\": \"",
+				ResultType::String[result.type], result.code, static_cast<int32>(result.numFrames), result.seconds);
+			WriteText(fs, EscapeJson(result.message));
+			fs.Printf("\"}");
+		}
+		fs.Printf("\n  ]\n}\n");
+		return true;
+	}
+
+	void PrintIndented(const std::string& text)
+	{
+		size_t start = 0;
+		while (start < text.size())
+		{
+			size_t end = text.find('\n', start);
+			if (end == std::string::npos)
+				end = text.size();
+			printf("  %s\n", text.substr(start, end - start).c_str());
+			start = end + 1;
+		}
+	}
+
+	int ShowUsage(const char* appPath)
+	{
+		printf("Usage: %s [options] <nes rom>...\n\n", appPath);
+		printf("Options:\n");
+		printf("  -timeout <s>   Emulated seconds to wait for a result (default %d)\n", static_cast<int32>(kDefaultTimeoutSeconds));
+		printf("  -jobs <n>      Number of roms to run in parallel (default: number of cores)\n");
+		printf("  -junit <file>  Write results as JUnit XML\n");
+		printf("  -json <file>   Write results as JSON\n");
+		printf("\n");
+		return -1;
+	}
+
+	bool ParseArgs(int argc, char* argv[], Options& options)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+			if (arg == "-timeout" && i + 1 < argc)
+				options.timeoutSeconds = atoi(argv[++i]);
+			else if (arg == "-jobs" && i + 1 < argc)
+				options.numJobs = atoi(argv[++i]);
+			else if (arg == "-junit" && i + 1 < argc)
+				options.junitFile = argv[++i];
+			else if (arg == "-json" && i + 1 < argc)
+				options.jsonFile = argv[++i];
+			else if (arg[0] == '-')
+				return false;
+			else
+				options.romFiles.push_back(arg);
+		}
+		return !options.romFiles.empty();
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!ParseArgs(argc, argv, options))
+		return ShowUsage(argv[0]);
+
+	const size_t numRoms = options.romFiles.size();
+	const size_t numJobs = ToolUtils::GetNumJobs(options.numJobs, numRoms);
+	std::vector<Result> results(numRoms);
+
+	const float64 startTime = System::GetTimeSec();
+
+	ToolUtils::ParallelFor(numRoms, numJobs, [&] (size_t i)
+	{
+		try
+		{
+			results[i] = RunRom(options, options.romFiles[i]);
+		}
+		catch (const std::exception& ex)
+		{
+			results[i].type = ResultType::Error;
+			results[i].message = ex.what();
+		}
+	});
+
+	const float64 seconds = System::GetTimeSec() - startTime;
+
+	size_t numFailed = 0;
+	for (size_t i = 0; i < numRoms; ++i)
+	{
+		const Result& result = results[i];
+		printf("%-8s %s (%d frames, %.2f s)\n", ResultType::String[result.type], options.romFiles[i].c_str(),
+			static_cast<int32>(result.numFrames), result.seconds);
+
+		if (result.type != ResultType::Pass)
+		{
+			if (result.type == ResultType::Fail)
+				printf("  Result code %d\n", result.code);
+			PrintIndented(result.message);
+			++numFailed;
+		}
+	}
+
+	printf("\n%d of %d roms failed in %.2f s (%d jobs)\n", static_cast<int32>(numFailed), static_cast<int32>(numRoms),
+		seconds, static_cast<int32>(numJobs));
+
+	if (!options.junitFile.empty() && !WriteJUnit(options.junitFile.c_str(), options, results, seconds))
+		printf("Failed to write JUnit file: %s\n", options.junitFile.c_str());
+
+	if (!options.jsonFile.empty() && !WriteJson(options.jsonFile.c_str(), options, results, seconds))
+		printf("Failed to write JSON file: %s\n", options.jsonFile.c_str());
+
+	return numFailed == 0? 0 : 1;
+}
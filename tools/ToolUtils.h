@@ -0,0 +1,55 @@
+#pragma once
+
+// Helpers shared by the headless tools
+
+#include "Base.h"
+#include "ControllerPorts.h"
+#include "Stream.h"
+#include <string>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+namespace ToolUtils
+{
+	// Used when a rom is run without input, so that nothing reads from the keyboard
+	class NoInputSource : public InputSource
+	{
+	public:
+		virtual uint8 GetButtons(size_t) { return 0; }
+	};
+
+	inline bool FileExists(const std::string& file)
+	{
+		FileStream fs;
+		return fs.Open(file.c_str(), "rb");
+	}
+
+	// Returns numJobs, or the number of cores if 0, clamped to [1, numItems]
+	inline size_t GetNumJobs(size_t numJobs, size_t numItems)
+	{
+		if (numJobs == 0)
+			numJobs = std::thread::hardware_concurrency();
+		return std::max<size_t>(std::min(numJobs, numItems), 1);
+	}
+
+	// Calls func(i) for each i in [0, count) from numJobs threads, each picking the next index
+	// until there are none left.
+	template <typename Func>
+	void ParallelFor(size_t count, size_t numJobs, Func func)
+	{
+		std::atomic<size_t> next(0);
+		auto worker = [&] ()
+		{
+			for (size_t i = next++; i < count; i = next++)
+				func(i);
+		};
+
+		std::vector<std::thread> threads;
+		for (size_t i = 0; i < numJobs; ++i)
+			threads.push_back(std::thread(worker));
+		for (auto& thread : threads)
+			thread.join();
+	}
+}
@@ -0,0 +1,91 @@
+// nes-tracedecode: formats a binary instruction trace as text
+//
+// Trace files are written by nes-emu when emulation fails (trace.bin in the app directory), or on
+// demand by the debugger. Records are printed oldest first, one instruction per line.
+
+#include "Base.h"
+#include "InstructionTrace.h"
+#include <string>
+#include <vector>
+#include <cstdio>
+
+namespace
+{
+	struct Options
+	{
+		Options() : numLast(0) {}
+
+		size_t numLast;
+		std::string traceFile;
+		std::string outputFile;
+	};
+
+	int ShowUsage(const char* appPath)
+	{
+		printf("Usage: %s [options] <trace file> [output file]\n\n", appPath);
+		printf("Writes to stdout if no output file is given.\n\n");
+		printf("Options:\n");
+		printf("  -last <n>  Only decode the last n instructions\n");
+		printf("\n");
+		return -1;
+	}
+
+	bool ParseArgs(int argc, char* argv[], Options& options)
+	{
+		std::vector<std::string> args;
+		for (int i = 1; i < argc; ++i)
+		{
+			const std::string arg = argv[i];
+			if (arg == "-last" && i + 1 < argc)
+				options.numLast = atoi(argv[++i]);
+			else if (arg[0] == '-')
+				return false;
+			else
+				args.push_back(arg);
+		}
+
+		if (args.empty() || args.size() > 2)
+			return false;
+
+		options.traceFile = args[0];
+		if (args.size() == 2)
+			options.outputFile = args[1];
+		return true;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	Options options;
+	if (!ParseArgs(argc, argv, options))
+		return ShowUsage(argv[0]);
+
+	InstructionTrace trace;
+	if (!trace.Load(options.traceFile.c_str()))
+		return 1;
+
+	FILE* output = stdout;
+	if (!options.outputFile.empty())
+	{
+		output = fopen(options.outputFile.c_str(), "w");
+		if (!output)
+		{
+			printf("Failed to open output file: %s\n", options.outputFile.c_str());
+			return 1;
+		}
+	}
+
+	const size_t numRecords = trace.GetNumRecords();
+	const size_t first = options.numLast > 0 && options.numLast < numRecords? numRecords - options.numLast : 0;
+	for (size_t i = first; i < numRecords; ++i)
+	{
+		const std::string line = InstructionTrace::Format(trace.GetRecord(i));
+		fwrite(line.c_str(), 1, line.size(), output);
+		fputc('\n', output);
+	}
+
+	if (output != stdout)
+		fclose(output);
+
+	return 0;
+}